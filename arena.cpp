@@ -0,0 +1,58 @@
+#include <cstdlib>
+#include <cassert>
+
+#include "arena.h"
+
+/* most allocations are a symbol or a few hash buckets, so a modest
+ * chunk keeps the waste low for small programs */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN      alignof(max_align_t)
+
+/* the chunk header is padded so the data following it is aligned */
+struct alignas(max_align_t) arena_chunk {
+    arena_chunk *next;
+    size_t size;
+    size_t used;
+};
+
+void *arena_alloc(arena *pool, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    arena_chunk *chunk = pool->chunks;
+    if(!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ?
+            size : ARENA_CHUNK_SIZE;
+        chunk = (arena_chunk *)malloc(sizeof(arena_chunk) + chunk_size);
+        assert(chunk);
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = pool->chunks;
+        pool->chunks = chunk;
+        pool->nr_chunks++;
+        pool->bytes_reserved += chunk_size;
+    }
+    void *ret = (char *)(chunk + 1) + chunk->used;
+    chunk->used += size;
+    pool->nr_allocs++;
+    pool->bytes_used += size;
+    return ret;
+}
+
+void arena_release(arena *pool)
+{
+    while(pool->chunks) {
+        arena_chunk *next = pool->chunks->next;
+        free(pool->chunks);
+        pool->chunks = next;
+    }
+    pool->nr_chunks = pool->nr_allocs = 0;
+    pool->bytes_used = pool->bytes_reserved = 0;
+}
+
+void arena_dump_stats(FILE *out, arena *pool)
+{
+    fprintf(out, "%s: %lu allocations, %lu bytes used,"
+            " %lu bytes reserved in %lu chunks\n",
+            pool->name, pool->nr_allocs, pool->bytes_used,
+            pool->bytes_reserved, pool->nr_chunks);
+}
@@ -0,0 +1,60 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <cstddef>
+#include <cstdio>
+
+/* An arena hands out memory from large chunks with a bump pointer.
+ * Nothing is freed individually; arena_release() returns every chunk
+ * at once. Objects placed in an arena must not need their destructors
+ * run, which holds as long as any containers inside them also use an
+ * arena_allocator on the same arena. */
+
+struct arena_chunk;
+
+struct arena {
+    const char *name;
+    arena_chunk *chunks;
+    size_t nr_chunks;
+    size_t nr_allocs;
+    size_t bytes_used;
+    size_t bytes_reserved;
+};
+
+#define ARENA_INIT(name) { name, NULL, 0, 0, 0, 0 }
+
+void *arena_alloc(arena *pool, size_t size);
+void arena_release(arena *pool);
+void arena_dump_stats(FILE *out, arena *pool);
+
+/* lets the standard containers draw their storage from an arena.
+ * deallocate is a no-op, the memory goes back on arena_release(). */
+template <class T>
+struct arena_allocator {
+    using value_type = T;
+    arena *pool;
+
+    arena_allocator(arena *p) : pool(p) {}
+    template <class U>
+    arena_allocator(const arena_allocator<U> &other) : pool(other.pool) {}
+
+    T *allocate(size_t n)
+    {
+        return static_cast<T *>(arena_alloc(pool, n * sizeof(T)));
+    }
+    void deallocate(T *, size_t) {}
+};
+
+template <class T, class U>
+bool operator==(const arena_allocator<T> &a, const arena_allocator<U> &b)
+{
+    return a.pool == b.pool;
+}
+
+template <class T, class U>
+bool operator!=(const arena_allocator<T> &a, const arena_allocator<U> &b)
+{
+    return a.pool != b.pool;
+}
+
+#endif
@@ -22,6 +22,7 @@ astree* new_astree (int symbol, int filenr, int linenr,
    tree->lexinfo = intern_stringset (lexinfo);
    tree->blocknr = 0;
    tree->oilname = 0;
+   tree->irval = 0;
    DEBUGF ('f', "astree %p->{%d:%d.%d: %s: \"%s\"}\n",
            tree, tree->filenr, tree->linenr, tree->offset,
            get_yytname (tree->symbol), tree->lexinfo->c_str());
@@ -73,7 +74,7 @@ static void dump_node (FILE* outfile, astree* node) {
    fprintf (outfile, "%s \"%s\" %ld.%ld.%ld {%d} %s",
            tname, node->lexinfo->c_str(), node->filenr,
            node->linenr, node->offset, node->blocknr,
-           __typeid_attrs_string(get_node_attributes(node),
+           __typeid_attrs_string(node->attributes,
                node->type_name).c_str());
 
     if(node->symentry && node->symentry->definition != node)
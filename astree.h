@@ -9,6 +9,7 @@ using namespace std;
 #include "auxlib.h"
 
 struct symbol;
+struct ir_value;
 
 struct astree {
     int symbol;               // token code
@@ -19,9 +20,12 @@ struct astree {
     vector<astree*> children; // children of this n-way node
     struct astree *parent;
     struct symbol *symentry;
+    /* the resolved type. Filled once during semantic analysis;
+     * identifiers copy it from their symbol when they are bound */
     attr_bitset attributes;
     const string *type_name;
     const string *oilname;
+    struct ir_value *irval;   // result of the node once lowered
     int blocknr;
 };
 
@@ -0,0 +1,451 @@
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdlib>
+
+#include "oc.h"
+#include "ir.h"
+#include "vm.h"
+#include "semantics.h"
+using namespace std;
+
+/* Compiling the IR to bytecode for the interpreter (see vm.h).
+ *
+ * Every IR instruction becomes one VM instruction on frame slots, plus
+ * a load or store around it for operands in memory or in globals.
+ * Those go through scratch slots that are reused by every
+ * instruction. A compare whose result is what the block branches on
+ * is fused with the branch.
+ */
+
+static vm_program *program;
+static unordered_map<string, size_t> function_index;
+/* struct field offsets by mangled field name */
+static unordered_map<string, long> field_offsets;
+static unordered_map<string, long> struct_sizes;
+
+/* the slots of the function being compiled */
+static vm_function *vmfn;
+static unordered_map<ir_value *, int> slots;
+/* the first slot of each object kept in the frame */
+static unordered_map<ir_instr *, int> frame_objects;
+static unordered_map<string, int> const_slots;
+static unordered_map<ir_value *, int> global_index;
+static int nr_locals, next_scratch;
+static vector<ir_value *> consts;
+/* jumps to patch with the first instruction of a block, by block id */
+static vector<size_t> block_start;
+static vector<pair<size_t, size_t>> jumps;
+
+static const struct {
+    const char *name;
+    int builtin;
+} builtins[] = {
+    { "____assert_fail", VMB_ASSERT_FAIL }, { "__putb", VMB_PUTB },
+    { "__putc", VMB_PUTC }, { "__puti", VMB_PUTI },
+    { "__puts", VMB_PUTS }, { "__endl", VMB_ENDL },
+    { "__getc", VMB_GETC }, { "__getw", VMB_GETW },
+    { "__getln", VMB_GETLN }, { "__getargv", VMB_GETARGV },
+    { "__exit", VMB_EXIT },
+};
+
+static bool is_global(ir_value *value)
+{
+    return value->kind == IRV_VAR && value->sym->block_nr == SCOPE_GLOBAL;
+}
+
+/* chars and bools are 1 byte in memory, everything else 8 */
+static bool byte_sized(const string &type)
+{
+    return type == "char";
+}
+
+static string object_type(const string &address_type)
+{
+    return address_type.substr(0, address_type.size() - 1);
+}
+
+static size_t emit(int op, int a, int b = 0, int c = 0, int d = 0)
+{
+    vm_instr instr = { NULL, op, a, b, c, d };
+    program->code.push_back(instr);
+    return program->code.size() - 1;
+}
+
+static int scratch()
+{
+    return nr_locals + next_scratch++;
+}
+
+static int const_slot(ir_value *value)
+{
+    string key = value->kind == IRV_STRING ? value->name
+        : to_string(value->category) + ":" + to_string(value->cval);
+    auto found = const_slots.find(key);
+    if(found != const_slots.end())
+        return found->second;
+    int slot = vmfn->const_base + consts.size();
+    consts.push_back(value);
+    const_slots[key] = slot;
+    return slot;
+}
+
+/* the slot an operand can be read from, loading it first if it is in
+ * memory or a global */
+static int operand(ir_value *value)
+{
+    switch(value->kind) {
+        case IRV_CONST: case IRV_STRING:
+            return const_slot(value);
+        case IRV_DEREF: {
+            int slot = scratch();
+            emit(byte_sized(object_type(value->base->type)) ? VM_LOAD1
+                    : VM_LOAD8, slot, slots[value->base]);
+            return slot;
+        }
+        default:
+            if(is_global(value)) {
+                int slot = scratch();
+                emit(VM_GLOAD, slot, global_index[value]);
+                return slot;
+            }
+            return slots[value];
+    }
+}
+
+/* the slot to compute a result into; finish_dest moves it to where it
+ * belongs */
+static int dest_slot(ir_value *dest)
+{
+    if(dest->kind == IRV_DEREF || is_global(dest))
+        return scratch();
+    return slots[dest];
+}
+
+static void finish_dest(ir_value *dest, int slot)
+{
+    if(dest->kind == IRV_DEREF)
+        emit(byte_sized(object_type(dest->base->type)) ? VM_STORE1
+                : VM_STORE8, slots[dest->base], slot);
+    else if(is_global(dest))
+        emit(VM_GSTORE, global_index[dest], slot);
+}
+
+static int binop(const string &op)
+{
+    if(op == "+") return VM_ADD;
+    if(op == "-") return VM_SUB;
+    if(op == "*") return VM_MUL;
+    if(op == "/") return VM_DIV;
+    if(op == "%") return VM_MOD;
+    if(op == "<") return VM_LT;
+    if(op == ">") return VM_GT;
+    if(op == "<=") return VM_LE;
+    if(op == ">=") return VM_GE;
+    if(op == "==") return VM_EQ;
+    return VM_NE;
+}
+
+static int compile_call(ir_instr *instr)
+{
+    string name = "__" + instr->text;
+    vector<int> args;
+    for(size_t arg = 0;arg < instr->args.size();arg++)
+        args.push_back(operand(instr->args[arg]));
+    int dest = instr->dest ? dest_slot(instr->dest) : -1;
+    int first = program->args.size();
+    program->args.insert(program->args.end(), args.begin(), args.end());
+    auto found = function_index.find(name);
+    if(found != function_index.end()) {
+        emit(VM_CALL, dest, found->second, first);
+    } else {
+        size_t b = 0;
+        while(b < sizeof(builtins) / sizeof(builtins[0])
+                && name != builtins[b].name)
+            b++;
+        if(b == sizeof(builtins) / sizeof(builtins[0])) {
+            oc_errprintf("undefined reference to '%s'\n", name.c_str());
+            return 1;
+        }
+        emit(VM_BUILTIN, dest, builtins[b].builtin, first);
+    }
+    if(instr->dest)
+        finish_dest(instr->dest, dest);
+    return 0;
+}
+
+/* how many slots an object kept in the frame takes */
+static int frame_object_slots(ir_instr *instr)
+{
+    const string &type = instr->text;
+    long size = type.compare(0, 9, "struct s_") == 0
+        ? struct_sizes[type.substr(9)] : byte_sized(type) ? 1 : 8;
+    return (instr->args[0]->cval * size + 7) / 8;
+}
+
+static int compile_instr(ir_instr *instr)
+{
+    next_scratch = 0;
+    int a, b, c;
+    switch(instr->op) {
+        case IR_BINOP:
+            b = operand(instr->args[0]);
+            c = operand(instr->args[1]);
+            a = dest_slot(instr->dest);
+            emit(binop(instr->opname), a, b, c);
+            break;
+        case IR_UNOP: {
+            const string &op = instr->opname;
+            b = operand(instr->args[0]);
+            a = dest_slot(instr->dest);
+            emit(op == "-" ? VM_NEG : op == "!" ? VM_NOT
+                    : op == "(char)" ? VM_CHR : VM_MOV, a, b);
+            break;
+        }
+        case IR_COPY: case IR_DECL:
+            if(instr->args.empty())
+                return 0;
+            b = operand(instr->args[0]);
+            if(instr->dest->kind == IRV_DEREF || is_global(instr->dest)) {
+                /* store straight from the operand */
+                finish_dest(instr->dest, b);
+                return 0;
+            }
+            a = dest_slot(instr->dest);
+            if(b >= nr_locals && b < vmfn->const_base) {
+                /* the operand was just loaded; load it into a */
+                program->code.back().a = a;
+                return 0;
+            }
+            emit(VM_MOV, a, b);
+            return 0;
+        case IR_CALL:
+            return compile_call(instr);
+        case IR_INDEX:
+            b = operand(instr->args[0]);
+            c = operand(instr->args[1]);
+            a = dest_slot(instr->dest);
+            emit(byte_sized(object_type(instr->dest->type))
+                    ? VM_INDEX1 : VM_INDEX8, a, b, c);
+            break;
+        case IR_FIELD:
+            b = operand(instr->args[0]);
+            a = dest_slot(instr->dest);
+            emit(VM_FIELD, a, b, field_offsets[instr->text]);
+            break;
+        case IR_NEW:
+            a = dest_slot(instr->dest);
+            emit(VM_NEW, a, 0, struct_sizes[instr->text]);
+            break;
+        case IR_NEWARRAY: case IR_NEWSTRING:
+            b = operand(instr->args[0]);
+            a = dest_slot(instr->dest);
+            emit(VM_NEWARRAY, a, b, instr->op == IR_NEWSTRING
+                    || byte_sized(instr->text) ? 1 : 8);
+            break;
+        case IR_NEWFRAME:
+            a = dest_slot(instr->dest);
+            emit(VM_NEWFRAME, a, frame_objects[instr],
+                    frame_object_slots(instr));
+            break;
+        default:
+            return 0;
+    }
+    finish_dest(instr->dest, a);
+    return 0;
+}
+
+static void jump(int op, int a, ir_block *target)
+{
+    size_t at = emit(op, a);
+    jumps.push_back(make_pair(at, target->id));
+}
+
+static void compile_branch(ir_block *block, ir_block *next)
+{
+    next_scratch = 0;
+    int cond = operand(block->cond);
+    if(ir_jump_if_true(block, next)) {
+        jump(VM_JNZ, cond, block->succ[0]);
+        return;
+    }
+    vm_instr &last = program->code.back();
+    size_t at;
+    if(program->code.size() > block_start[block->id] && last.a == cond
+            && last.op >= VM_LT && last.op <= VM_NE) {
+        last.op += VM_LT_JZ - VM_LT;
+        at = program->code.size() - 1;
+    } else {
+        at = emit(VM_JZ, cond);
+    }
+    jumps.push_back(make_pair(at, block->succ[1]->id));
+    if(block->succ[0] != next)
+        jump(VM_JMP, 0, block->succ[0]);
+}
+
+static int compile_block(ir_block *block, ir_block *next)
+{
+    int errors = 0;
+    block_start[block->id] = program->code.size();
+    for(size_t i = 0;i < block->instrs.size();i++)
+        errors += compile_instr(block->instrs[i]);
+    switch(block->term) {
+        case IR_BRANCH:
+            compile_branch(block, next);
+            break;
+        case IR_GOTO: case IR_FALL:
+            if(!block->succ[0])
+                emit(VM_RETVOID, 0);
+            else if(block->succ[0] != next)
+                jump(VM_JMP, 0, block->succ[0]);
+            break;
+        case IR_RETURN:
+            next_scratch = 0;
+            emit(VM_RET, operand(block->retval));
+            break;
+        case IR_RETURNVOID:
+            emit(VM_RETVOID, 0);
+            break;
+    }
+    return errors;
+}
+
+static void assign_slot(ir_value *value)
+{
+    if(!value)
+        return;
+    if(value->kind == IRV_DEREF)
+        value = value->base;
+    if(slots.count(value) || is_global(value))
+        return;
+    if(value->kind == IRV_REG || value->kind == IRV_VAR)
+        slots[value] = nr_locals++;
+}
+
+static void fill_consts()
+{
+    for(size_t i = 0;i < consts.size();i++) {
+        ir_value *value = consts[i];
+        if(value->kind == IRV_STRING) {
+            size_t s = atol(value->name.c_str() + 1) - 1;
+            vmfn->consts.push_back((long)program->strings[s].c_str());
+        } else if(value->category == IR_CHAR) {
+            vmfn->consts.push_back((signed char)value->cval);
+        } else {
+            vmfn->consts.push_back(value->cval);
+        }
+    }
+}
+
+static int compile_function(ir_function *fn, vm_function &out)
+{
+    vmfn = &out;
+    slots.clear();
+    frame_objects.clear();
+    const_slots.clear();
+    consts.clear();
+    jumps.clear();
+    nr_locals = 0;
+    for(size_t p = 0;p < fn->params.size();p++)
+        assign_slot(fn->params[p]);
+    /* an instruction needs a scratch slot for each operand and one for
+     * its result at most */
+    size_t nr_scratch = 1;
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            if(instr->op == IR_NEWFRAME) {
+                frame_objects[instr] = nr_locals;
+                nr_locals += frame_object_slots(instr);
+            }
+            if(instr->args.size() + 1 > nr_scratch)
+                nr_scratch = instr->args.size() + 1;
+            assign_slot(instr->dest);
+            for(size_t arg = 0;arg < instr->args.size();arg++)
+                assign_slot(instr->args[arg]);
+        }
+        assign_slot(block->cond);
+        assign_slot(block->retval);
+    }
+
+    out.entry = program->code.size();
+    out.nr_params = fn->params.size();
+    out.const_base = nr_locals + nr_scratch;
+    block_start.assign(fn->nr_blocks, 0);
+    int errors = 0;
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *next = b + 1 < fn->blocks.size() ? fn->blocks[b+1]
+            : NULL;
+        errors += compile_block(fn->blocks[b], next);
+    }
+    for(size_t j = 0;j < jumps.size();j++)
+        program->code[jumps[j].first].d = block_start[jumps[j].second];
+    fill_consts();
+    out.nr_slots = out.const_base + consts.size();
+    return errors;
+}
+
+/* every field is 8 bytes */
+static void layout_structs(ir_module *module)
+{
+    field_offsets.clear();
+    struct_sizes.clear();
+    for(size_t s = 0;s < module->structs.size();s++) {
+        ir_struct *st = module->structs[s];
+        for(size_t f = 0;f < st->field_names.size();f++)
+            field_offsets[st->field_names[f]] = 8 * f;
+        struct_sizes[st->name] = 8 * st->field_names.size();
+    }
+}
+
+int vm_compile(ir_module *module, vm_program &out)
+{
+    program = &out;
+    out.code.clear();
+    out.functions.clear();
+    out.args.clear();
+    /* a call from outside returns to this, and stops */
+    emit(VM_HALT, -1);
+    emit(VM_HALT, -1);
+
+    /* the strings first, since constants point into them */
+    out.strings.clear();
+    for(size_t s = 0;s < module->strings.size();s++) {
+        const string &literal = *module->strings[s];
+        string bytes;
+        for(size_t c = 1;c + 1 < literal.size();c++) {
+            char byte = literal[c];
+            if(byte == '\\') {
+                byte = literal[++c];
+                byte = byte == 'n' ? '\n' : byte == 't' ? '\t'
+                    : byte == '0' ? '\0' : byte;
+            }
+            bytes += byte;
+        }
+        out.strings.push_back(bytes);
+    }
+    global_index.clear();
+    for(size_t g = 0;g < module->globals.size();g++)
+        global_index[module->globals[g]->var] = g;
+    out.nr_globals = module->globals.size();
+    layout_structs(module);
+
+    function_index.clear();
+    out.functions.resize(module->functions.size() + 1);
+    for(size_t f = 0;f < module->functions.size();f++) {
+        ir_function *fn = module->functions[f];
+        string name = fn->decl.substr(fn->decl.rfind(' ') + 1);
+        function_index[name] = f;
+        out.functions[f].name = name;
+    }
+    out.main = module->functions.size();
+    out.functions[out.main].name = "__ocmain";
+
+    int errors = 0;
+    for(size_t f = 0;f < module->functions.size();f++)
+        errors += compile_function(module->functions[f],
+                out.functions[f]);
+    errors += compile_function(module->main, out.functions[out.main]);
+    return errors;
+}
@@ -0,0 +1,117 @@
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "opt.h"
+#include "ir.h"
+#include "semantics.h"
+using namespace std;
+
+/* Dead code elimination.
+ *
+ * Blocks that can't be reached from the entry are deleted first; that
+ * covers everything after a return and the arms of branches that were
+ * folded. Then a backward liveness analysis over the control-flow
+ * graph finds the registers and locals whose value is never read
+ * again. An assignment to a dead local, or an instruction computing a
+ * dead register without any other effect, is deleted, and a call whose
+ * result is dead just drops the result.
+ *
+ * Globals are never dead: any function may read them. Stores through
+ * an address are always kept, and so are divisions that might trap.
+ */
+
+static bool may_trap(ir_instr *instr)
+{
+    if(instr->op != IR_BINOP)
+        return false;
+    if(instr->opname != "/" && instr->opname != "%")
+        return false;
+    ir_value *divisor = instr->args[1];
+    return divisor->kind != IRV_CONST || divisor->cval == 0
+        || divisor->cval == -1;
+}
+
+/* delete what writes only dead values in one block. Returns the
+ * number of instructions changed. */
+static int sweep_block(ir_liveness &lv, ir_block *block)
+{
+    int removed = 0;
+    vector<bool> live = lv.live_out[block->id];
+    ir_live_use(lv, live, block->cond);
+    ir_live_use(lv, live, block->retval);
+    vector<ir_instr *> kept;
+    for(size_t i = block->instrs.size();i-- > 0;) {
+        ir_instr *instr = block->instrs[i];
+        ir_value *def = ir_live_def(instr);
+        bool dead = def && !live[lv.index[def]];
+        if(dead && instr->op == IR_CALL) {
+            instr->dest = NULL;
+            removed++;
+        } else if(dead && instr->op == IR_DECL) {
+            /* the declaration stays, other code may name it */
+            if(!instr->args.empty()) {
+                instr->args.clear();
+                removed++;
+            }
+        } else if(dead && !may_trap(instr)) {
+            delete instr;
+            removed++;
+            continue;
+        }
+        ir_live_transfer(lv, live, instr);
+        kept.push_back(instr);
+    }
+    block->instrs.assign(kept.rbegin(), kept.rend());
+    return removed;
+}
+
+/* declarations without an initializer of locals nothing names */
+static void remove_unused_decls(ir_function *fn)
+{
+    unordered_map<ir_value *, int> refs;
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            if(instr->dest)
+                refs[instr->dest]++;
+            for(size_t arg = 0;arg < instr->args.size();arg++)
+                refs[instr->args[arg]]++;
+        }
+        if(block->cond)
+            refs[block->cond]++;
+        if(block->retval)
+            refs[block->retval]++;
+    }
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        vector<ir_instr *> kept;
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            if(instr->op == IR_DECL && instr->args.empty()
+                    && refs[instr->dest] == 1) {
+                delete instr;
+                continue;
+            }
+            kept.push_back(instr);
+        }
+        block->instrs = kept;
+    }
+}
+
+int opt_eliminate_dead_code(ir_function *fn)
+{
+    int changed = ir_remove_unreachable(fn);
+    ir_liveness lv;
+    int removed;
+    do {
+        ir_compute_liveness(fn, lv);
+        removed = 0;
+        for(size_t b = 0;b < fn->blocks.size();b++)
+            removed += sweep_block(lv, fn->blocks[b]);
+        changed += removed;
+    } while(removed);
+    remove_unused_decls(fn);
+    return changed;
+}
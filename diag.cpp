@@ -0,0 +1,169 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_set>
+#include <cstdio>
+#include <cstring>
+
+#include "diag.h"
+#include "semantics.h"
+using namespace std;
+
+/* every '%s' is replaced by the next argument, formatted by kind */
+static const char *diag_formats[DIAG_NR_CODES] = {
+    [DIAG_UNDEFINED_IDENT]      = "identifier '%s' is undefined",
+    [DIAG_STRUCT_NOT_GLOBAL]    = "structures must be in global scope",
+    [DIAG_DUPLICATE_TYPEID]     = "duplicate declaration of typeid '%s'",
+    [DIAG_FUNCTION_NOT_GLOBAL]  = "functions must be in global scope",
+    [DIAG_PROTOTYPE_MISMATCH]   = "function has mis-matching prototype"
+                                  " (declared at %s)",
+    [DIAG_VOID_VARIABLE]        = "cannot have void variables",
+    [DIAG_UNKNOWN_ALLOC_TYPEID] = "allocator with unknown typeid '%s'",
+    [DIAG_UNDEFINED_TYPEID]     = "typeid '%s' is undefined",
+    [DIAG_NO_SUCH_FIELD]        = "typeid '%s' does not have a field '%s'",
+    [DIAG_DUPLICATE_IDENT]      = "duplicate declaration of identifier"
+                                  " '%s'. Previous declaration at %s",
+    [DIAG_VOID_ARRAY]           = "cannot have void arrays",
+    [DIAG_VOID_DECLARATION]     = "cannot have void declarations",
+    [DIAG_ATTR_REQUIRED]        = "node only has {%s}, and {%s}"
+                                  " is required",
+    [DIAG_ATTR_NOTALLOWED]      = "node has {%s}, but none of {%s}"
+                                  " are allowed",
+    [DIAG_ATTR_ANY]             = "node has {%s}, but at least one of"
+                                  " {%s} are required",
+    [DIAG_INCOMPATIBLE]         = "nodes are not compatible:"
+                                  " have {%s} and {%s}",
+    [DIAG_PARAM_COUNT]          = "invalid number of parameters to"
+                                  " function '%s' (needed %s, have %s)",
+    [DIAG_BAD_INDEX]            = "cannot index into non-array"
+                                  " non-string value",
+    [DIAG_RETURN_VOID]          = "can't return void in a"
+                                  " non-void function",
+    [DIAG_RETURN_GLOBAL]        = "can't return non-void in a void"
+                                  " function (global scope)",
+};
+
+struct diag_record {
+    uint16_t code;
+    uint32_t filenr, linenr, offset;
+    diag_arg args[3];
+};
+
+/* 0 means no limit */
+long diag_error_limit = 0;
+
+static vector<diag_record> records;
+/* locations that already have a diagnostic. Anything else reported at
+ * the same spot is a cascade from the first one. */
+static unordered_set<uint64_t> reported_at;
+
+static uint64_t location_key(uint32_t filenr, uint32_t linenr,
+        uint32_t offset)
+{
+    return ((uint64_t)filenr << 48) ^ ((uint64_t)linenr << 20) ^ offset;
+}
+
+diag_arg diag_loc(size_t filenr, size_t linenr, size_t offset)
+{
+    diag_arg arg;
+    arg.kind = DIAG_ARG_LOC;
+    arg.loc.filenr = filenr;
+    arg.loc.linenr = linenr;
+    arg.loc.offset = offset;
+    return arg;
+}
+
+void diag_report(int code, astree *where, diag_arg a1, diag_arg a2,
+        diag_arg a3)
+{
+    diag_record rec;
+    rec.code = code;
+    rec.filenr = where->filenr;
+    rec.linenr = where->linenr;
+    rec.offset = where->offset;
+    if(!reported_at.insert(location_key(rec.filenr, rec.linenr,
+                    rec.offset)).second)
+        return;
+    rec.args[0] = a1;
+    rec.args[1] = a2;
+    rec.args[2] = a3;
+    records.push_back(rec);
+}
+
+static void append_location(string &out, unsigned long filenr,
+        unsigned long linenr, unsigned long offset)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%ld.%2ld.%3.3ld", filenr, linenr, offset);
+    out += buf;
+}
+
+static void append_arg(string &out, const diag_arg &arg)
+{
+    switch(arg.kind) {
+        case DIAG_ARG_STR:
+            out += arg.str ? *arg.str : string("???");
+            break;
+        case DIAG_ARG_ATTRS:
+            out += attrs_string(attr_bitset(arg.attrs));
+            break;
+        case DIAG_ARG_NUM:
+            out += to_string(arg.num);
+            break;
+        case DIAG_ARG_LOC:
+            append_location(out, arg.loc.filenr, arg.loc.linenr,
+                    arg.loc.offset);
+            break;
+    }
+}
+
+static void format_record(string &out, const diag_record &rec)
+{
+    append_location(out, rec.filenr, rec.linenr, rec.offset);
+    out += ": ";
+    int argnr = 0;
+    for(const char *fmt = diag_formats[rec.code]; *fmt; fmt++) {
+        if(fmt[0] == '%' && fmt[1] == 's' && argnr < 3) {
+            append_arg(out, rec.args[argnr++]);
+            fmt++;
+        } else {
+            out += *fmt;
+        }
+    }
+    out += '\n';
+}
+
+static bool record_before(const diag_record &a, const diag_record &b)
+{
+    if(a.filenr != b.filenr)
+        return a.filenr < b.filenr;
+    if(a.linenr != b.linenr)
+        return a.linenr < b.linenr;
+    return a.offset < b.offset;
+}
+
+/* print everything recorded so far in source order, up to the error
+ * limit, and forget it. Returns how many diagnostics were pending. */
+size_t diag_flush(FILE *out)
+{
+    size_t pending = records.size();
+    if(!pending)
+        return 0;
+    stable_sort(records.begin(), records.end(), record_before);
+    size_t shown = pending;
+    if(diag_error_limit > 0 && shown > (size_t)diag_error_limit)
+        shown = diag_error_limit;
+    string buffer;
+    buffer.reserve(shown * 64);
+    for(size_t i = 0; i < shown; i++)
+        format_record(buffer, records[i]);
+    if(shown < pending) {
+        buffer += "error limit reached, " + to_string(pending - shown)
+            + " more diagnostics not shown\n";
+    }
+    fwrite(buffer.data(), 1, buffer.size(), out);
+    fflush(out);
+    records.clear();
+    reported_at.clear();
+    return pending;
+}
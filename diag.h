@@ -0,0 +1,67 @@
+#ifndef __DIAG_H
+#define __DIAG_H
+
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include "type.h"
+#include "astree.h"
+
+/* Semantic diagnostics are not printed where they are found. Each one
+ * is recorded as a code, a source location and up to three arguments,
+ * and diag_flush() sorts them by location, drops the cascades and
+ * formats the rest into a single write. */
+
+enum {
+    DIAG_UNDEFINED_IDENT,
+    DIAG_STRUCT_NOT_GLOBAL,
+    DIAG_DUPLICATE_TYPEID,
+    DIAG_FUNCTION_NOT_GLOBAL,
+    DIAG_PROTOTYPE_MISMATCH,
+    DIAG_VOID_VARIABLE,
+    DIAG_UNKNOWN_ALLOC_TYPEID,
+    DIAG_UNDEFINED_TYPEID,
+    DIAG_NO_SUCH_FIELD,
+    DIAG_DUPLICATE_IDENT,
+    DIAG_VOID_ARRAY,
+    DIAG_VOID_DECLARATION,
+    DIAG_ATTR_REQUIRED,
+    DIAG_ATTR_NOTALLOWED,
+    DIAG_ATTR_ANY,
+    DIAG_INCOMPATIBLE,
+    DIAG_PARAM_COUNT,
+    DIAG_BAD_INDEX,
+    DIAG_RETURN_VOID,
+    DIAG_RETURN_GLOBAL,
+    DIAG_NR_CODES,
+};
+
+enum { DIAG_ARG_NONE, DIAG_ARG_STR, DIAG_ARG_ATTRS,
+    DIAG_ARG_NUM, DIAG_ARG_LOC };
+
+/* an argument is kept unformatted until the diagnostic is printed */
+struct diag_arg {
+    int kind;
+    union {
+        const std::string *str;
+        unsigned long attrs;
+        long num;
+        struct {
+            uint32_t filenr, linenr, offset;
+        } loc;
+    };
+    diag_arg() : kind(DIAG_ARG_NONE), num(0) {}
+    diag_arg(const std::string *s) : kind(DIAG_ARG_STR), str(s) {}
+    diag_arg(attr_bitset a) : kind(DIAG_ARG_ATTRS), attrs(a.to_ulong()) {}
+    diag_arg(long n) : kind(DIAG_ARG_NUM), num(n) {}
+};
+
+diag_arg diag_loc(size_t filenr, size_t linenr, size_t offset);
+
+extern long diag_error_limit;
+
+void diag_report(int code, astree *where, diag_arg a1 = diag_arg(),
+        diag_arg a2 = diag_arg(), diag_arg a3 = diag_arg());
+size_t diag_flush(FILE *out);
+
+#endif
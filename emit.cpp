@@ -1,529 +1,507 @@
 #include <string>
 #include <vector>
+#include <unordered_map>
 #include <cstdio>
 #include <cassert>
 #include <cstring>
+#include <thread>
+#include <atomic>
 
 #include "semantics.h"
 #include "astree.h"
 #include "lyutils.h"
+#include "ir.h"
+#include "opt.h"
+#include "outbuf.h"
 using namespace std;
-FILE *oilfile;
 
-size_t reg_nr = 1, str_nr = 1;
+size_t str_nr = 1;
 /* use C++'s auto-magic string concating to make more readable code */
 #define INDENT "        "
-/* this contains all the strings discovered at parse-time. */
+/* this contains all the strings discovered at parse-time, once each */
 vector<const string *> globalstrings;
+/* the name given to each of them. lexinfo is interned by the string
+ * set, so equal literals share a pointer */
+static unordered_map<const string *, const string *> string_names;
 
 /* DESIGN:
- * In general, a DFS traversal is done, post order. Each node may emit
- * some code, and each node may have a "result". If it has a result,
- * then the name used to refer to the result (whether it's a virtual
- * register or an identifier) is stored in node->oilname. Because the
- * traversal is done post order, when a node is processed, all of its
- * children have their oilname entry set. Thus, they can be used in
- * code emission!
+ * The typed AST is lowered to the IR (see ir.cpp), and this file
+ * prints the IR as oil. Every block prints its label if it has one,
+ * its instructions, and then its terminator. Falling through to the
+ * next block in layout order prints nothing.
  *
- * If a node emits code (like the '+' node), it uses the oilname of
- * its children. That way, if one of its children is another
- * operator, then it'll refer to the correct virtual register.
+ * The oil is appended to a chunked buffer (see outbuf.h) instead of
+ * going through fprintf piece by piece, and the names come ready-made
+ * from the IR values, so printing an instruction doesn't format or
+ * build any strings.
  *
- * If a node doesn't emit code (like the IDENT node), it just sets
- * the oilname correctly and returns.
- *
- * A few nodes are NOT done post-order! For the most part, a node's
- * children must be emitted first, but that's not always the case.
- * IF, IFELSE, and WHILE are the main ones. FUNCTION and STRUCT
- * are emitted entirely sperately, at the beginning of the emission
- * code.
+ * Printing a function only reads its IR, and registers are numbered
+ * per function, so the functions are printed by a thread per core.
+ * They take runs of consecutive functions, each printed into a buffer
+ * of its own, and the buffers are joined in source order, so the oil
+ * is the same however the runs were shared out.
  */
 
-/* allocate a register. All registers share an indexing system */
-static string *register_alloc(const char *type)
-{
-    return new string(string(type) + to_string(reg_nr++));
-}
-
 /* this is called from the parser. It stores all STRONGCONs in order
- * to emit all strings at the top of the file */
+ * to emit all strings at the top of the file. A literal seen before
+ * gets the name it was given the first time. */
 void emitter_register_string(astree *node)
 {
-    node->oilname = new string(string("s") + to_string(str_nr++));
-    globalstrings.push_back(node->lexinfo);
+    const string *&name = string_names[node->lexinfo];
+    if(!name) {
+        name = new string(string("s") + to_string(str_nr++));
+        globalstrings.push_back(node->lexinfo);
+    }
+    node->oilname = name;
 }
 
-string *strip_zeros(const string *lexstr)
-{
-    /* create a new string because lexinfo is a const string */
-    string *stripped = new string(*lexstr);
-    stripped->erase(0, stripped->find_first_not_of('0'));
-    if(*stripped == string(""))
-        *stripped += string("0");
-    return stripped;
-}
+/* everything is appended to oil and written in one go at the end */
+static outbuf oil = OUTBUF_INIT;
+/* where this thread is printing */
+static thread_local outbuf *out = &oil;
 
-int test_is_operand(astree *node)
+static void put(const char *text)
 {
-    return node->symbol == TOK_IDENT
-        || node->symbol == TOK_INTCON
-        || node->symbol == TOK_CHARCON;
+    outbuf_puts(out, text);
 }
 
-/* register categories */
-#define INT  0
-#define BOOL 1
-#define CHAR 2
-#define PTR  3
-static const char *rcategory[4] = {
-    "i", "b", "c", "p"
-};
-
-/* this creates a string that can be used as a C type. The type is
- * calculated from the node's tokid and attributes. */
-const char *get_result_type_name(astree *node)
+static void put(const string &text)
 {
-    attr_bitset attr = get_node_attributes(node);
-    if(attr.test(ATTR_struct))
-        assert(node->type_name);
-    const char *base;
-    if(attr.test(ATTR_bool))
-        base = "char";
-    else if(attr.test(ATTR_char))
-        base = "char";
-    else if(attr.test(ATTR_int))
-        base = "int";
-    else if(attr.test(ATTR_string))
-        base = "char*";
-    else if(attr.test(ATTR_struct))
-        base = "struct ";
-    else
-        assert(0);
-
-    string *str = new string(string(base) +
-            (attr.test(ATTR_struct) ? 
-                string("s_") + *node->type_name 
-                + string("*") : string("")) +
-            (attr.test(ATTR_array) ? string("*") : string("")) + 
-            (node->symbol == '.' ? string("*") : string("")));
-    return str->c_str();
+    outbuf_puts(out, text);
 }
 
-/* figure out the register category. This is mostly based on the tokid
- * except for TOK_CALL. */
-const char *register_category(astree *node)
+static void put_name(ir_value *value)
 {
-    const char *cat = NULL;
-    switch(node->symbol) {
-        case '+': case '-': case '*': case '/':
-        case '%': case TOK_POS: case TOK_NEG:
-        case TOK_ORD:
-            cat = rcategory[INT];
-            break;
-        case '>': case '<': case TOK_EQ:
-        case TOK_NE: case TOK_LE: case TOK_GE: 
-        case '!':
-            cat = rcategory[BOOL];
-            break;
-        case TOK_CHR:
-            cat = rcategory[CHAR];
-            break;
-        case TOK_CALL:
-            const char *result_type = get_result_type_name(node);
-            /* is it a pointer? */
-            if(strchr(result_type, '*'))
-                cat = rcategory[PTR];
-            else if(get_node_attributes(node).test(ATTR_int))
-                cat = rcategory[INT];
-            else if(get_node_attributes(node).test(ATTR_char))
-                cat = rcategory[CHAR];
-            else if(get_node_attributes(node).test(ATTR_bool))
-                cat = rcategory[BOOL];
-            else
-                assert(0);
-            break;
+    if(value->kind == IRV_DEREF) {
+        put("(*");
+        put(value->base->name);
+        put(")");
+    } else if(value->kind == IRV_STRING) {
+        /* the pooled arrays are const; oc strings are not */
+        put("(char*)");
+        put(value->name);
+    } else {
+        put(value->name);
     }
-    return cat;
 }
 
-string *mangle_name(astree *node)
+/* set while printing a function whose registers are declared at its
+ * top */
+static thread_local bool temps_declared;
+/* the objects of the function that live in its frame, _new1 and on */
+static thread_local long nr_frame_objects;
+
+/* the start of an instruction that defines a register */
+static void emit_dest(ir_value *dest)
 {
-    assert(node->symentry);
-    if(node->symbol == TOK_FIELD) {
-        return new string(string("f_") +
-                /* okay, this is kinda ugly. Basically:
-                 * node->symentry->definition is the
-                 * field AST node that defines the field
-                 * in the structure block. It's parent's
-                 * parent is the actual 'struct' AST node,
-                 * whose 0th child is the typename. */
-                *node->symentry->definition->parent->
-                    parent->children[0]->lexinfo + 
-                string("_") + 
-                *node->symentry->definition->lexinfo);
+    put(INDENT);
+    if(!temps_declared) {
+        put(dest->type);
+        put(" ");
     }
-    /* is global variable */
-    if(node->symentry->block_nr == 0)
-        return new string(string("__") + 
-                *node->symentry->definition->lexinfo);
-    else
-        return new string(string("_") + 
-                to_string(node->symentry->block_nr) + 
-                string("_") + 
-                *node->symentry->definition->lexinfo);
+    put_name(dest);
+    put(" = ");
 }
 
-/* because not every node emits code, we can actually run this
- * function on sub-trees with the expectation that it does it
- * correctly. For example, we can run this on struct nodes, and
- * its children wont be printed out, but will have their oilname's
- * set. */
-void emit_recursive(astree *node)
+void emit_instr(ir_instr *instr)
 {
-    /* these nodes must be done first, and they do NOT recurse on
-     * its children automatically. This is because they need to
-     * be traversed in a specific order and at specific times. */
-    switch(node->symbol) {
-        case TOK_STRUCT: case TOK_FUNCTION:
-        case TOK_PROTOTYPE: case TOK_STRINGCON:
-            return;
-        case TOK_WHILE:
-            fprintf(oilfile, "while_%ld_%ld_%ld:;\n",
-                    node->filenr, node->linenr, node->offset);
-            emit_recursive(node->children[0]);
-            fprintf(oilfile, INDENT 
-                    "if (!%s) goto break_%ld_%ld_%ld;\n",
-                    node->children[0]->oilname->c_str(),
-                    node->filenr, node->linenr, node->offset);
-            emit_recursive(node->children[1]);
-            fprintf(oilfile, INDENT "goto while_%ld_%ld_%ld;\n",
-                    node->filenr, node->linenr, node->offset);
-            fprintf(oilfile, "break_%ld_%ld_%ld:;\n",
-                    node->filenr, node->linenr, node->offset);
-            return;
-        case TOK_IF:
-            emit_recursive(node->children[0]);
-            fprintf(oilfile, INDENT "if (!%s) goto fi_%ld_%ld_%ld;\n",
-                    node->children[0]->oilname->c_str(),
-                    node->filenr, node->linenr, node->offset);
-            emit_recursive(node->children[1]);
-            fprintf(oilfile, "fi_%ld_%ld_%ld:;\n",
-                    node->filenr, node->linenr, node->offset);
-            return;
-        case TOK_IFELSE:
-            emit_recursive(node->children[0]);
-            fprintf(oilfile, INDENT "if (!%s) goto else_%ld_%ld_%ld;\n",
-                    node->children[0]->oilname->c_str(),
-                    node->filenr, node->linenr, node->offset);
-            emit_recursive(node->children[1]);
-            fprintf(oilfile, INDENT "goto fi_%ld_%ld_%ld;\n",
-                    node->filenr, node->linenr, node->offset);
-            fprintf(oilfile, "else_%ld_%ld_%ld:;\n",
-                    node->filenr, node->linenr, node->offset);
-            emit_recursive(node->children[2]);
-            fprintf(oilfile, "fi_%ld_%ld_%ld:;\n",
-                    node->filenr, node->linenr, node->offset);
-            return;
-    }
-    /* post order */
-    for(size_t child = 0;child < node->children.size();++child) {
-        emit_recursive(node->children[child]);
-    }
-    string *reg;
-    const char *sym;
-    switch(node->symbol) {
-        /* binary operators print out the operation and
-         * store the result */
-        case '+': case '-': case '*': case '>':
-        case '/': case '%': case '<':
-        case TOK_EQ: case TOK_NE: case TOK_LE:
-        case TOK_GE: 
-            node->oilname = register_alloc(register_category(node));
-            fprintf(oilfile, INDENT "%s %s = %s %s %s;\n",
-                    get_result_type_name(node),
-                    node->oilname->c_str(), 
-                    node->children[0]->oilname->c_str(), 
-                    node->lexinfo->c_str(),
-                    node->children[1]->oilname->c_str());
-            
+    ir_value *dest = instr->dest;
+    switch(instr->op) {
+        case IR_BINOP:
+            emit_dest(dest);
+            put_name(instr->args[0]);
+            put(" ");
+            put(instr->opname);
+            put(" ");
+            put_name(instr->args[1]);
+            put(";\n");
             break;
-        /* so do unary operators */
-        case TOK_POS: case TOK_NEG: case '!':
-        case TOK_ORD: case TOK_CHR:
-            node->oilname = register_alloc(register_category(node));
-            if(node->symbol == TOK_ORD)
-                sym = "(int)";
-            else if(node->symbol == TOK_CHR)
-                sym = "(char)";
-            else
-                sym = node->lexinfo->c_str();
-            
-            fprintf(oilfile, INDENT "%s %s = %s%s;\n",
-                    get_result_type_name(node),
-                    node->oilname->c_str(), sym,
-                    node->children[0]->oilname->c_str());
+        case IR_UNOP:
+            emit_dest(dest);
+            put(instr->opname);
+            put_name(instr->args[0]);
+            put(";\n");
             break;
-        /* this is a special binary operator. The result is
-         * just the lval, it can be used later */
-        case '=':
-            node->oilname = node->children[0]->oilname;
-            fprintf(oilfile, INDENT "%s = %s;\n",
-                    node->children[0]->oilname->c_str(),
-                    node->children[1]->oilname->c_str());
+        case IR_COPY:
+            put(INDENT);
+            put_name(dest);
+            put(" = ");
+            put_name(instr->args[0]);
+            put(";\n");
             break;
-        case TOK_VARDECL:
-            fprintf(oilfile, INDENT);
-            /* if we're a direct child of the root, then we're a
-             * global variable and have already been declared
-             * (see emit_globals). Skip the type part. */
-            if(node->parent->symbol == TOK_ROOT) {
-                if(node->children[0]->symbol == TOK_ARRAY)
-                    fprintf(oilfile, "%s ", 
-                            node->children[0]->
-                            children[1]->oilname->c_str());
-                else
-                    fprintf(oilfile, "%s ",
-                            node->children[0]->
-                            children[0]->oilname->c_str());
-            } else {
-                fprintf(oilfile, "%s ", 
-                        node->children[0]->oilname->c_str());
+        case IR_DECL:
+            put(INDENT);
+            put(instr->text);
+            if(!instr->args.empty()) {
+                put(" = ");
+                put_name(instr->args[0]);
             }
-            fprintf(oilfile, "= %s;\n", 
-                    node->children[1]->oilname->c_str());
+            put(";\n");
             break;
-        case TOK_CALL:
-            /* no register allocated on void function call */
-            if(!get_node_attributes(node).test(ATTR_void)) {
-                node->oilname = register_alloc(register_category(node));
-                fprintf(oilfile, INDENT "%s %s = ",
-                        get_result_type_name(node),
-                        node->oilname->c_str());
-            } else {
-                fprintf(oilfile, INDENT);
-            }
-            fprintf(oilfile, "__%s (",
-                    node->children[0]->lexinfo->c_str());
-            /* emit arguments */
-            for(size_t child = 1;child < node->children.size();
-                    child++) {
-                if(child != 1)
-                    fprintf(oilfile, ", ");
-                fprintf(oilfile, "%s", 
-                        node->children[child]->oilname->c_str());
+        case IR_CALL:
+            if(dest)
+                emit_dest(dest);
+            else
+                put(INDENT);
+            put("__");
+            put(instr->text);
+            put(" (");
+            for(size_t arg = 0;arg < instr->args.size();arg++) {
+                if(arg)
+                    put(", ");
+                put_name(instr->args[arg]);
             }
-            fprintf(oilfile, ");\n");
-            break;
-        case TOK_INTCON:
-            node->oilname = strip_zeros(node->lexinfo);
+            put(");\n");
             break;
-        case TOK_CHARCON:
-            node->oilname = node->lexinfo;
+        case IR_INDEX:
+            emit_dest(dest);
+            put("&");
+            put_name(instr->args[0]);
+            put("[");
+            put_name(instr->args[1]);
+            put("];\n");
             break;
-        case TOK_RETURN:
-            fprintf(oilfile, INDENT "return %s;\n", 
-                    node->children[0]->oilname->c_str());
+        case IR_FIELD:
+            emit_dest(dest);
+            put("&");
+            put_name(instr->args[0]);
+            put("->");
+            put(instr->text);
+            put(";\n");
             break;
-        case TOK_RETURNVOID:
-            fprintf(oilfile, INDENT "return;\n");
+        case IR_NEW:
+            emit_dest(dest);
+            put("xcalloc (1, sizeof (struct s_");
+            put(instr->text);
+            put("));\n");
             break;
-        case TOK_ARRAY:
-            /* this is a declaration node,
-             * just a little special name processing */
-            node->oilname = new string(*node->children[0]->oilname 
-                    + string("* ") + *node->children[1]->oilname);
+        case IR_NEWARRAY:
+            emit_dest(dest);
+            put("xcalloc (");
+            put_name(instr->args[0]);
+            put(", sizeof (");
+            put(instr->text);
+            put("));\n");
             break;
-        case TOK_INDEX:
-            reg = register_alloc("a");
-            fprintf(oilfile, INDENT "%s* %s = &%s[%s];\n",
-                    get_result_type_name(node),
-                    reg->c_str(),
-                    node->children[0]->oilname->c_str(),
-                    node->children[1]->oilname->c_str());
-
-            node->oilname = new string(string("(*") 
-                    + *reg + string(")")); 
-            break;
-        case '.':
-            reg = register_alloc("a");
-            fprintf(oilfile, INDENT "%s %s = &%s->%s;\n",
-                    get_result_type_name(node),
-                    reg->c_str(), node->children[0]->oilname->c_str(),
-                    node->children[1]->oilname->c_str());
-
-            node->oilname = new string(string("(*") + *reg +
-                    string(")")); 
-            break;
-        case TOK_IDENT: case TOK_DECLID: case TOK_FIELD:
-            node->oilname = mangle_name(node);
-            break;
-        /* for these type nodes, if they don't have children then
-         * they're part of an array. So we let the array node handle
-         * the naming. Otherwise, we just setup the name ourselves,
-         * since that only depends on the children */
-        case TOK_INT: case TOK_CHAR: case TOK_VOID:
-            if(node->children.size() == 0)
-                node->oilname = node->lexinfo;
-            else
-                node->oilname = new string(*node->lexinfo 
-                        + " " + *node->children[0]->oilname);
-            break;
-        case TOK_BOOL:
-            if(node->children.size() == 0)
-                node->oilname = new string("char");
-            else
-                node->oilname = new string("char " 
-                        + *node->children[0]->oilname);
-            break;
-        case TOK_STRING:
-            if(node->children.size() == 0)
-                node->oilname = new string("char*");
-            else
-                node->oilname = new string("char* " 
-                        + *node->children[0]->oilname);
-            break;
-        case TOK_TYPEID:
-            if(node->children.size() == 0)
-                node->oilname = new string(string("struct s_") 
-                        + *node->lexinfo + "*");
-            else
-                node->oilname = new string(string("struct s_") 
-                        + *node->lexinfo + "* " 
-                        + *node->children[0]->oilname);
-            break;
-        case TOK_NEW:
-            reg = register_alloc("p");
-            fprintf(oilfile, INDENT "struct s_%s* %s = xcalloc "
-                    "(1, sizeof (struct s_%s));\n",
-                    node->type_name->c_str(),
-                    reg->c_str(),
-                    node->type_name->c_str());
-            node->oilname = reg;
+        case IR_NEWSTRING:
+            emit_dest(dest);
+            put("xcalloc (");
+            put_name(instr->args[0]);
+            put(", sizeof (char));\n");
             break;
-        case TOK_NEWARRAY:
-            reg = register_alloc("p");
-            fprintf(oilfile, INDENT 
-                    "%s* %s = xcalloc (%s, sizeof (%s));\n",
-                    get_result_type_name(node->children[0]),
-                    reg->c_str(),
-                    node->children[1]->oilname->c_str(),
-                    get_result_type_name(node->children[0]));
-            node->oilname = reg;
+        case IR_NEWFRAME:
+            /* an initialized declaration clears the array every time
+             * it is reached */
+            put(INDENT);
+            put(instr->text);
+            put(" _new");
+            outbuf_putl(out, ++nr_frame_objects);
+            put("[");
+            put_name(instr->args[0]);
+            put("] = {0};\n");
+            emit_dest(dest);
+            put("_new");
+            outbuf_putl(out, nr_frame_objects);
+            put(";\n");
             break;
-        case TOK_NEWSTRING:
-            reg = register_alloc("p");
-            fprintf(oilfile, INDENT 
-                    "char* %s = xcalloc (%s, sizeof (char));\n",
-                    reg->c_str(), 
-                    node->children[0]->oilname->c_str());
-            node->oilname = reg;
+        case IR_COUNT:
+            put(INDENT "_prof_counts[");
+            put_name(instr->args[0]);
+            put("]++;\n");
             break;
-        case TOK_NULL: case TOK_FALSE:
-            node->oilname = new string("0");
+        default:
+            assert(0);
+    }
+}
+
+static void emit_goto(ir_block *target)
+{
+    put(INDENT "goto ");
+    put(target->label);
+    put(";\n");
+}
+
+/* if (!cond) goto succ[1], or if (cond) goto succ[0] when succ[1] is
+ * next */
+static void emit_branch(ir_block *block, ir_block *next)
+{
+    int taken = ir_jump_if_true(block, next) ? 0 : 1;
+    put(INDENT "if (");
+    /* tell the C compiler which way the profile says it goes */
+    if(block->likely >= 0)
+        put("__builtin_expect (");
+    if(block->test_fused) {
+        ir_instr *test = block->instrs.back();
+        put_name(test->args[0]);
+        put(" ");
+        put(taken ? ir_inverse_compare(test->opname) : test->opname);
+        put(" ");
+        put_name(test->args[1]);
+    } else {
+        if(taken)
+            put("!");
+        put_name(block->cond);
+    }
+    if(block->likely >= 0)
+        put(block->likely == taken ? ", 1)" : ", 0)");
+    put(") goto ");
+    put(block->succ[taken]->label);
+    put(";\n");
+    if(taken && block->succ[0] != next)
+        emit_goto(block->succ[0]);
+}
+
+void emit_block(ir_block *block, ir_block *next, bool jumped_to)
+{
+    if(jumped_to) {
+        put(block->label);
+        put(":;\n");
+    }
+    size_t nr_instrs = block->instrs.size();
+    /* a fused comparison is printed as the condition of the if */
+    if(block->test_fused)
+        nr_instrs--;
+    for(size_t i = 0;i < nr_instrs;i++)
+        emit_instr(block->instrs[i]);
+    switch(block->term) {
+        case IR_BRANCH:
+            emit_branch(block, next);
             break;
-        case TOK_TRUE:
-            node->oilname = new string("1");
+        case IR_GOTO: case IR_FALL:
+            if(block->succ[0] && block->succ[0] != next)
+                emit_goto(block->succ[0]);
             break;
-        case TOK_BLOCK: case TOK_ROOT:case TOK_STRINGCON:case ';':
+        case IR_RETURN:
+            put(INDENT "return ");
+            put_name(block->retval);
+            put(";\n");
             break;
-        default:
-            fprintf(stderr, "!!! unknown: %s\n", 
-                    get_yytname(node->symbol));
+        case IR_RETURNVOID:
+            put(INDENT "return;\n");
             break;
     }
 }
 
-/* all functions are direct children of root. */
-void emit_functions(astree *root)
+static ir_block *layout_next(ir_function *fn, size_t b)
 {
-    for(size_t child=0;child < root->children.size();child++) {
-        astree *node = root->children[child];
-        if(node->symbol == TOK_FUNCTION) {
-            /* emit function return type and name */
-            emit_recursive(node->children[0]);
-            fprintf(oilfile, "%s(", 
-                    node->children[0]->oilname->c_str());
-
-            /* emit params */
-            if(node->children[1]->children.size() == 0)
-                fprintf(oilfile, "void");
-            for(size_t param = 0;
-                    param < node->children[1]->children.size();
-                    param++) {
+    return b + 1 < fn->blocks.size() ? fn->blocks[b+1] : NULL;
+}
 
-                if(!param) fprintf(oilfile, "\n");
-                astree *parnode = node->children[1]->children[param];
-                emit_recursive(parnode);
-                fprintf(oilfile, INDENT);
-                    fprintf(oilfile, "%s", parnode->oilname->c_str());
-                if(param + 1 != node->children[1]->children.size())
-                    fprintf(oilfile, ",\n");
-            }
-            fprintf(oilfile, ")\n");
-            /* emit block */
-            fprintf(oilfile, "{\n");
-            emit_recursive(node->children[2]);
-            fprintf(oilfile, "}\n");
+/* a label is only printed if some goto will name it */
+static void find_jump_targets(ir_function *fn, vector<bool> &targets)
+{
+    targets.assign(fn->nr_blocks, false);
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        ir_block *next = layout_next(fn, b);
+        switch(block->term) {
+            case IR_BRANCH:
+                if(!ir_jump_if_true(block, next))
+                    targets[block->succ[1]->id] = true;
+                if(block->succ[0] != next)
+                    targets[block->succ[0]->id] = true;
+                break;
+            case IR_GOTO: case IR_FALL:
+                if(block->succ[0] && block->succ[0] != next)
+                    targets[block->succ[0]->id] = true;
+                break;
         }
     }
 }
 
-/* globalstrings contains all string constants found during parse */
-void emit_strings()
+/* -fprofile-generate: the counters, and where each function's start,
+ * for oclib to write out at exit */
+static void emit_counters(ir_module *module)
+{
+    put("long _prof_counts[");
+    outbuf_putl(out, module->nr_counters);
+    put("];\n");
+    put("static const char *_prof_functions[] = {\n");
+    for(size_t f = 0;f <= module->functions.size();f++) {
+        ir_function *fn = f < module->functions.size()
+            ? module->functions[f] : module->main;
+        put(INDENT "\"");
+        put(fn->decl.substr(fn->decl.rfind(' ') + 1));
+        put("\",\n");
+    }
+    put("};\n");
+    put("static const int _prof_firsts[] = {\n");
+    for(size_t f = 0;f <= module->functions.size();f++) {
+        ir_function *fn = f < module->functions.size()
+            ? module->functions[f] : module->main;
+        put(INDENT);
+        outbuf_putl(out, fn->first_counter);
+        put(",\n");
+    }
+    put("};\n");
+}
+
+static void emit_profile_start(ir_module *module)
+{
+    put(INDENT "oc_profile_start (_prof_counts, ");
+    outbuf_putl(out, module->nr_counters);
+    put(", _prof_functions, _prof_firsts, ");
+    outbuf_putl(out, module->functions.size() + 1);
+    put(", \"");
+    for(const char *c = profile_generate;*c;c++) {
+        if(*c == '"' || *c == '\\')
+            put("\\");
+        outbuf_put(out, c, 1);
+    }
+    put("\");\n");
+}
+
+void emit_body(ir_function *fn)
+{
+    vector<bool> targets;
+    find_jump_targets(fn, targets);
+    put("{\n");
+    temps_declared = fn->temps_declared;
+    nr_frame_objects = 0;
+    for(size_t t = 0;t < fn->temps.size();t++) {
+        put(INDENT);
+        put(fn->temps[t]->type);
+        put(" ");
+        put(fn->temps[t]->name);
+        put(";\n");
+    }
+    if(fn == fn->module->main && fn->module->nr_counters)
+        emit_profile_start(fn->module);
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        emit_block(block, layout_next(fn, b), targets[block->id]);
+    }
+    put("}\n");
+}
+
+static void emit_function(ir_function *fn)
+{
+    /* emit function return type and name */
+    put(fn->decl);
+    put("(");
+
+    /* emit params */
+    if(fn->param_decls.size() == 0)
+        put("void");
+    for(size_t param = 0;param < fn->param_decls.size();param++) {
+        if(!param) put("\n");
+        put(INDENT);
+        put(fn->param_decls[param]);
+        if(param + 1 != fn->param_decls.size())
+            put(",\n");
+    }
+    put(")\n");
+    emit_body(fn);
+}
+
+/* the functions a thread takes at a time */
+#define FUNCTIONS_PER_RUN 8
+
+struct emit_runs {
+    ir_module *module;
+    vector<outbuf> bufs;        /* one per run */
+    atomic<size_t> next;        /* the next run nobody has taken */
+};
+
+static void emit_worker(emit_runs *runs)
+{
+    vector<ir_function *> &functions = runs->module->functions;
+    size_t run;
+    while((run = runs->next++) < runs->bufs.size()) {
+        out = &runs->bufs[run];
+        size_t end = min(functions.size(), (run + 1) * FUNCTIONS_PER_RUN);
+        for(size_t f = run * FUNCTIONS_PER_RUN;f < end;f++)
+            emit_function(functions[f]);
+    }
+    out = &oil;
+}
+
+void emit_functions(ir_module *module)
 {
-    for(size_t s=0;s<globalstrings.size();s++)
-        fprintf(oilfile, "char* s%ld = %s;\n", s+1,
-                globalstrings[s]->c_str());
+    size_t nr_runs = (module->functions.size() + FUNCTIONS_PER_RUN - 1)
+        / FUNCTIONS_PER_RUN;
+    size_t nr_threads = min((size_t)thread::hardware_concurrency(),
+            nr_runs);
+    if(nr_threads <= 1) {
+        for(size_t f = 0;f < module->functions.size();f++)
+            emit_function(module->functions[f]);
+        return;
+    }
+    emit_runs runs;
+    outbuf empty = OUTBUF_INIT;
+    runs.module = module;
+    runs.bufs.assign(nr_runs, empty);
+    runs.next = 0;
+    /* this thread is one of them */
+    vector<thread> threads;
+    for(size_t t = 1;t < nr_threads;t++)
+        threads.push_back(thread(emit_worker, &runs));
+    emit_worker(&runs);
+    for(size_t t = 0;t < threads.size();t++)
+        threads[t].join();
+    for(size_t run = 0;run < nr_runs;run++)
+        outbuf_append(&oil, &runs.bufs[run]);
+}
+
+/* globalstrings contains all string constants found during parse.
+ * Each is emitted once, as an array nobody can point elsewhere. */
+void emit_strings(ir_module *module)
+{
+    for(size_t s=0;s<module->strings.size();s++) {
+        put("static const char s");
+        outbuf_putl(out, s + 1);
+        put("[] = ");
+        put(*module->strings[s]);
+        put(";\n");
+    }
 }
 
 /* all global variables are emitted at the top. */
-void emit_globals(astree *root)
+void emit_globals(ir_module *module)
 {
-    for(size_t child = 0;child<root->children.size();child++) {
-        astree *node = root->children[child];
-        if(node->symbol == TOK_VARDECL) {
-            /* recurse to generated oilnames */
-            emit_recursive(node->children[0]);
-            fprintf(oilfile, "%s;\n", 
-                    node->children[0]->oilname->c_str());
-        }
+    for(size_t g = 0;g < module->globals.size();g++) {
+        put(module->globals[g]->decl);
+        put(";\n");
     }
 }
 
 /* emit all structures and their fields */
-void emit_structs(astree *root)
+void emit_structs(ir_module *module)
 {
-    for(size_t child = 0;child<root->children.size();child++) {
-        astree *node = root->children[child];
-        if(node->symbol == TOK_STRUCT) {
-            fprintf(oilfile, "struct s_%s {\n", 
-                    node->children[0]->lexinfo->c_str());
-            for(size_t field = 1;field < node->children.size();
-                    field++) {
-                astree *finode = node->children[field];
-                /* recurse to generated oilnames */
-                emit_recursive(finode);
-                fprintf(oilfile, INDENT "%s;\n", 
-                        finode->oilname->c_str());
-            }
-            fprintf(oilfile, "};\n");
+    for(size_t s = 0;s < module->structs.size();s++) {
+        ir_struct *st = module->structs[s];
+        put("struct s_");
+        put(st->name);
+        put(" {\n");
+        for(size_t field = 0;field < st->field_decls.size();field++) {
+            put(INDENT);
+            put(st->field_decls[field]);
+            put(";\n");
         }
+        put("};\n");
     }
 }
 
 int oc_run_emit(astree *root, FILE *out)
 {
-    oilfile = out;
-    fprintf(oilfile, "#define __OCLIB_C__\n");
-    fprintf(oilfile, "#include \"oclib.oh\"\n");
-    emit_structs(root);
-    emit_strings();
-    emit_globals(root);
-    emit_functions(root);
+    ir_module *module = ir_build(root);
+    opt_run(module);
+    put("#define __OCLIB_C__\n");
+    put("#include \"oclib.oh\"\n");
+    emit_structs(module);
+    emit_strings(module);
+    emit_globals(module);
+    if(module->nr_counters)
+        emit_counters(module);
+    emit_functions(module);
 
-    fprintf(oilfile, "void __ocmain (void)\n{\n");
-    emit_recursive(root);
-    fprintf(oilfile, "}\n");
+    put("void __ocmain (void)\n");
+    emit_body(module->main);
+    ir_free(module);
+    fflush(out);
+    if(outbuf_flush(&oil, fileno(out))) {
+        perror("failed to write oil file");
+        return 1;
+    }
     return 0;
 }
-
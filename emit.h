@@ -4,6 +4,9 @@
 #include "astree.h"
 
 int oc_run_emit(astree *root, FILE *out);
+int oc_run_emit_asm(astree *root, FILE *out);
+int oc_run_jit(astree *root, char **argv);
+int oc_run_interp(astree *root, char **argv);
 void emitter_register_string(astree *node);
 #endif
 
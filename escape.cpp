@@ -0,0 +1,221 @@
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "opt.h"
+#include "ir.h"
+#include "semantics.h"
+using namespace std;
+
+/* Escape analysis.
+ *
+ * Memory from new is never freed, so an object a loop allocates for
+ * scratch use is garbage the program keeps until it exits. If no
+ * reference to the object can outlive the call that made it, it is
+ * put in the frame instead, as an IR_NEWFRAME that every backend
+ * clears each time it runs.
+ *
+ * The pointer is followed through the registers and locals it is
+ * copied into, and the addresses of its fields and elements. It
+ * escapes if any of them is stored in memory or a global, returned,
+ * or passed to a function of the program that may keep it. The
+ * functions of oclib only read what they are given. Whether a
+ * function keeps a parameter is found the same way, starting from
+ * the assumption that all of them do, until nothing changes.
+ *
+ * The storage of one new is reused every time it runs, which is only
+ * right if the object made the last time is dead by then: none of the
+ * values holding a reference to it may be live just before the new.
+ *
+ * Only news with a constant size go in the frame, up to
+ * STACK_OBJECT_LIMIT bytes each and STACK_FRAME_LIMIT for a function,
+ * counting every field and every element but a char as 8.
+ */
+
+#define STACK_OBJECT_LIMIT 512
+#define STACK_FRAME_LIMIT 4096
+
+static ir_module *module;
+/* for every function of the program, which parameters it may keep */
+static unordered_map<string, vector<bool>> keeps;
+
+static string function_name(ir_function *fn)
+{
+    return fn->decl.substr(fn->decl.rfind(' ') + 1);
+}
+
+static bool passed_safely(ir_instr *call, size_t arg)
+{
+    auto found = keeps.find("__" + call->text);
+    return found == keeps.end() || !found->second[arg];
+}
+
+/* follow a reference from root into held. Returns false if it
+ * escapes. */
+static bool contained(ir_function *fn, ir_value *root,
+        unordered_set<ir_value *> &held)
+{
+    held.clear();
+    held.insert(root);
+    bool changed;
+    do {
+        changed = false;
+        for(size_t b = 0;b < fn->blocks.size();b++) {
+            ir_block *block = fn->blocks[b];
+            if(block->retval && held.count(block->retval))
+                return false;
+            for(size_t i = 0;i < block->instrs.size();i++) {
+                ir_instr *instr = block->instrs[i];
+                ir_value *dest = instr->dest;
+                for(size_t arg = 0;arg < instr->args.size();arg++) {
+                    if(!held.count(instr->args[arg]))
+                        continue;
+                    switch(instr->op) {
+                        case IR_COPY: case IR_DECL:
+                            if(dest->kind != IRV_REG
+                                    && (dest->kind != IRV_VAR
+                                        || dest->sym->block_nr
+                                        == SCOPE_GLOBAL))
+                                return false;
+                            break;
+                        case IR_INDEX: case IR_FIELD:
+                            if(arg != 0)
+                                return false;
+                            break;
+                        case IR_BINOP:
+                            if(instr->opname != "=="
+                                    && instr->opname != "!=")
+                                return false;
+                            /* the result is a bool */
+                            continue;
+                        case IR_CALL:
+                            if(!passed_safely(instr, arg))
+                                return false;
+                            continue;
+                        default:
+                            return false;
+                    }
+                    if(held.insert(dest).second)
+                        changed = true;
+                }
+            }
+        }
+    } while(changed);
+    return true;
+}
+
+static void find_kept_params()
+{
+    keeps.clear();
+    for(size_t f = 0;f < module->functions.size();f++) {
+        ir_function *fn = module->functions[f];
+        keeps[function_name(fn)].assign(fn->params.size(), true);
+    }
+    unordered_set<ir_value *> held;
+    bool changed;
+    do {
+        changed = false;
+        for(size_t f = 0;f < module->functions.size();f++) {
+            ir_function *fn = module->functions[f];
+            vector<bool> &kept = keeps[function_name(fn)];
+            for(size_t p = 0;p < fn->params.size();p++) {
+                if(kept[p] && fn->params[p]->type.find('*')
+                        != string::npos
+                        && contained(fn, fn->params[p], held)) {
+                    kept[p] = false;
+                    changed = true;
+                }
+            }
+        }
+    } while(changed);
+}
+
+/* the size of what a new allocates, or -1 if it isn't constant */
+static long object_size(ir_instr *instr)
+{
+    if(instr->op == IR_NEW) {
+        for(size_t s = 0;s < module->structs.size();s++) {
+            ir_struct *st = module->structs[s];
+            if(st->name == instr->text)
+                return 8 * st->field_names.size();
+        }
+        return -1;
+    }
+    ir_value *count = instr->args[0];
+    if(count->kind != IRV_CONST || count->cval <= 0)
+        return -1;
+    bool bytes = instr->op == IR_NEWSTRING || instr->text == "char";
+    return count->cval * (bytes ? 1 : 8);
+}
+
+/* whether any value in held is live just before instrs[at] of block */
+static bool live_before(ir_liveness &lv, ir_block *block, size_t at,
+        unordered_set<ir_value *> &held)
+{
+    vector<bool> live = lv.live_out[block->id];
+    ir_live_use(lv, live, block->cond);
+    ir_live_use(lv, live, block->retval);
+    for(size_t i = block->instrs.size();i-- > at;)
+        ir_live_transfer(lv, live, block->instrs[i]);
+    for(auto it = held.begin();it != held.end();++it) {
+        auto found = lv.index.find(*it);
+        if(found != lv.index.end() && live[found->second])
+            return true;
+    }
+    return false;
+}
+
+static void put_in_frame(ir_instr *instr)
+{
+    switch(instr->op) {
+        case IR_NEW:
+            instr->text = "struct s_" + instr->text;
+            instr->args.push_back(ir_const(module, IR_INT, 1));
+            break;
+        case IR_NEWSTRING:
+            instr->text = "char";
+            break;
+    }
+    instr->op = IR_NEWFRAME;
+}
+
+static int allocate_on_stack(ir_function *fn)
+{
+    ir_liveness lv;
+    ir_compute_liveness(fn, lv);
+    unordered_set<ir_value *> held;
+    long frame = 0;
+    int placed = 0;
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            if(instr->op != IR_NEW && instr->op != IR_NEWARRAY
+                    && instr->op != IR_NEWSTRING)
+                continue;
+            long size = object_size(instr);
+            if(size < 0 || size > STACK_OBJECT_LIMIT
+                    || frame + size > STACK_FRAME_LIMIT)
+                continue;
+            if(!contained(fn, instr->dest, held)
+                    || live_before(lv, block, i, held))
+                continue;
+            put_in_frame(instr);
+            frame += size;
+            placed++;
+        }
+    }
+    return placed;
+}
+
+int opt_allocate_on_stack(ir_module *mod)
+{
+    module = mod;
+    find_kept_params();
+    int placed = 0;
+    for(size_t f = 0;f < module->functions.size();f++)
+        placed += allocate_on_stack(module->functions[f]);
+    placed += allocate_on_stack(module->main);
+    return placed;
+}
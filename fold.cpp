@@ -0,0 +1,188 @@
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <climits>
+#include <cstdint>
+
+#include "opt.h"
+#include "ir.h"
+#include "semantics.h"
+using namespace std;
+
+/* Constant folding and propagation.
+ *
+ * An operator whose operands are all constants is evaluated here and
+ * its register replaced by the result. A local that is declared with
+ * a constant and never assigned again is replaced by that constant
+ * wherever it is read. Both feed each other, so they are repeated
+ * until nothing changes. Branches on a constant become jumps, and the
+ * arm that can no longer be reached is deleted.
+ *
+ * Values are computed the way the oil's C compiler would: ints are 32
+ * bits and wrap, chars are signed bytes and bools are 0 or 1.
+ * Division by zero is left for the program to do at run time.
+ */
+
+static bool fits_int(long value)
+{
+    return value >= INT_MIN && value <= INT_MAX;
+}
+
+static bool fold_binop(const string &op, long a, long b, long &result)
+{
+    if(!fits_int(a) || !fits_int(b))
+        return false;
+    uint32_t ua = (uint32_t)a, ub = (uint32_t)b;
+    if(op == "+")
+        result = (int32_t)(ua + ub);
+    else if(op == "-")
+        result = (int32_t)(ua - ub);
+    else if(op == "*")
+        result = (int32_t)(ua * ub);
+    else if(op == "/" || op == "%") {
+        if(b == 0 || (a == INT_MIN && b == -1))
+            return false;
+        result = op == "/" ? a / b : a % b;
+    }
+    else if(op == "<")
+        result = a < b;
+    else if(op == ">")
+        result = a > b;
+    else if(op == "<=")
+        result = a <= b;
+    else if(op == ">=")
+        result = a >= b;
+    else if(op == "==")
+        result = a == b;
+    else if(op == "!=")
+        result = a != b;
+    else
+        return false;
+    return true;
+}
+
+static bool fold_unop(const string &op, long a, long &result)
+{
+    if(!fits_int(a))
+        return false;
+    if(op == "+" || op == "(int)")
+        result = a;
+    else if(op == "-")
+        result = (int32_t)(0 - (uint32_t)a);
+    else if(op == "!")
+        result = !a;
+    else if(op == "(char)")
+        result = (signed char)a;
+    else
+        return false;
+    return true;
+}
+
+static bool all_constant(ir_instr *instr)
+{
+    for(size_t arg = 0;arg < instr->args.size();arg++) {
+        if(instr->args[arg]->kind != IRV_CONST)
+            return false;
+    }
+    return true;
+}
+
+/* locals that are declared with a constant and never assigned, and
+ * weren't propagated already */
+static void find_constant_locals(ir_function *fn, ir_value_map &map,
+        unordered_set<ir_value *> &propagated)
+{
+    unordered_map<ir_value *, int> defs;
+    unordered_map<ir_value *, ir_value *> init;
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            if(!instr->dest || instr->dest->kind != IRV_VAR)
+                continue;
+            defs[instr->dest]++;
+            if(instr->op == IR_DECL && instr->args.size() == 1
+                    && instr->args[0]->kind == IRV_CONST)
+                init[instr->dest] = instr->args[0];
+        }
+    }
+    for(auto it = init.begin();it != init.end();++it) {
+        ir_value *var = it->first;
+        if(defs[var] == 1 && var->sym->block_nr != SCOPE_GLOBAL
+                && propagated.insert(var).second)
+            map[var] = it->second;
+    }
+}
+
+/* fold every instruction whose operands are constants, recording the
+ * result of each in map */
+static int fold_instrs(ir_function *fn, ir_value_map &map)
+{
+    int folded = 0;
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        vector<ir_instr *> kept;
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            for(size_t arg = 0;arg < instr->args.size();arg++) {
+                auto found = map.find(instr->args[arg]);
+                if(found != map.end())
+                    instr->args[arg] = found->second;
+            }
+            long result;
+            bool done = false;
+            if(instr->op == IR_BINOP && all_constant(instr))
+                done = fold_binop(instr->opname, instr->args[0]->cval,
+                        instr->args[1]->cval, result);
+            else if(instr->op == IR_UNOP && all_constant(instr))
+                done = fold_unop(instr->opname, instr->args[0]->cval,
+                        result);
+            if(done) {
+                map[instr->dest] = ir_const(fn->module,
+                        instr->dest->category, result);
+                delete instr;
+                folded++;
+            } else {
+                kept.push_back(instr);
+            }
+        }
+        block->instrs = kept;
+    }
+    return folded;
+}
+
+/* a branch on a constant always goes the same way */
+static int fold_branches(ir_function *fn)
+{
+    int folded = 0;
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        if(block->term != IR_BRANCH || block->cond->kind != IRV_CONST)
+            continue;
+        if(!block->cond->cval)
+            block->succ[0] = block->succ[1];
+        block->succ[1] = NULL;
+        block->term = IR_FALL;
+        block->cond = NULL;
+        folded++;
+    }
+    return folded;
+}
+
+int opt_fold_constants(ir_function *fn)
+{
+    int changed = 0, progress;
+    unordered_set<ir_value *> propagated;
+    do {
+        ir_value_map map;
+        find_constant_locals(fn, map, propagated);
+        progress = map.size();
+        progress += fold_instrs(fn, map);
+        ir_replace_uses(fn, map);
+        progress += fold_branches(fn);
+        changed += progress;
+    } while(progress);
+    ir_remove_unreachable(fn);
+    return changed;
+}
@@ -0,0 +1,233 @@
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "opt.h"
+#include "ir.h"
+#include "semantics.h"
+using namespace std;
+
+/* Value numbering.
+ *
+ * Every operand gets a number that is the same for two operands known
+ * to hold the same value. An operator, index or field address whose
+ * operation and operand numbers were already seen computes the same
+ * value as the earlier instruction, so it is deleted and its register
+ * replaced by the earlier one.
+ *
+ * The blocks are walked down the dominator tree, and what a block
+ * computes stays visible in the blocks it dominates. Registers,
+ * constants, and locals that are assigned only by their declaration
+ * hold one value wherever they can be read, so expressions over them
+ * are reused across blocks.
+ *
+ * Anything that can change is numbered per block. A local assigned
+ * more than once gets a new number after every assignment, and a
+ * global after every assignment or call. Reading through an address
+ * (*a) depends on memory: a store through an address changes the
+ * objects of its type, and a call may change any of them.
+ */
+
+struct numbering {
+    long next_nr;
+    unordered_map<ir_value *, long> fixed;      /* never change */
+    unordered_map<string, long> constants;
+    unordered_map<ir_value *, bool> mutable_vars;
+    /* reset at the start of every block */
+    unordered_map<ir_value *, long> var_nr;
+    unordered_map<string, long> memory_epoch;
+    unordered_map<string, long> loads;
+    /* expressions seen in the dominating blocks, with an undo log */
+    unordered_map<string, ir_value *> exprs;
+    vector<string> undo;
+    ir_value_map replaced;
+    int removed;
+};
+
+static long fresh(numbering &vn)
+{
+    return vn.next_nr++;
+}
+
+/* the type of the object behind an address register */
+static string object_type(ir_value *deref)
+{
+    const string &type = deref->base->type;
+    return type.substr(0, type.size() - 1);
+}
+
+static long memory_epoch(numbering &vn, const string &type)
+{
+    auto found = vn.memory_epoch.find(type);
+    if(found != vn.memory_epoch.end())
+        return found->second;
+    return vn.memory_epoch[type] = fresh(vn);
+}
+
+static long value_nr(numbering &vn, ir_value *value)
+{
+    auto rep = vn.replaced.find(value);
+    if(rep != vn.replaced.end())
+        value = rep->second;
+    switch(value->kind) {
+        case IRV_CONST: {
+            string key = to_string(value->category) + ":"
+                + to_string(value->cval);
+            auto found = vn.constants.find(key);
+            if(found != vn.constants.end())
+                return found->second;
+            return vn.constants[key] = fresh(vn);
+        }
+        case IRV_DEREF: {
+            string key = to_string(value_nr(vn, value->base)) + "@"
+                + to_string(memory_epoch(vn, object_type(value)));
+            auto found = vn.loads.find(key);
+            if(found != vn.loads.end())
+                return found->second;
+            return vn.loads[key] = fresh(vn);
+        }
+        case IRV_VAR:
+            if(vn.mutable_vars.count(value)) {
+                auto found = vn.var_nr.find(value);
+                if(found != vn.var_nr.end())
+                    return found->second;
+                return vn.var_nr[value] = fresh(vn);
+            }
+            /* fall through */
+        default: {
+            auto found = vn.fixed.find(value);
+            if(found != vn.fixed.end())
+                return found->second;
+            return vn.fixed[value] = fresh(vn);
+        }
+    }
+}
+
+static bool commutative(ir_instr *instr)
+{
+    return instr->op == IR_BINOP && (instr->opname == "+"
+            || instr->opname == "*" || instr->opname == "=="
+            || instr->opname == "!=");
+}
+
+static string expression_key(numbering &vn, ir_instr *instr)
+{
+    vector<long> nrs;
+    for(size_t arg = 0;arg < instr->args.size();arg++)
+        nrs.push_back(value_nr(vn, instr->args[arg]));
+    if(commutative(instr) && nrs[0] > nrs[1])
+        swap(nrs[0], nrs[1]);
+    string key = to_string(instr->op) + instr->opname + "|"
+        + instr->text + "|" + instr->dest->type;
+    for(size_t arg = 0;arg < nrs.size();arg++)
+        key += "|" + to_string(nrs[arg]);
+    return key;
+}
+
+/* the effects of an instruction on what later ones read */
+static void clobber(numbering &vn, ir_instr *instr)
+{
+    ir_value *dest = instr->dest;
+    if(instr->op == IR_CALL) {
+        vn.memory_epoch.clear();
+        for(auto it = vn.var_nr.begin();it != vn.var_nr.end();) {
+            if(it->first->sym->block_nr == SCOPE_GLOBAL)
+                it = vn.var_nr.erase(it);
+            else
+                ++it;
+        }
+    }
+    if(!dest)
+        return;
+    if(dest->kind == IRV_DEREF)
+        vn.memory_epoch.erase(object_type(dest));
+    else if(dest->kind == IRV_VAR && vn.mutable_vars.count(dest))
+        vn.var_nr.erase(dest);
+}
+
+static void number_block(numbering &vn, ir_block *block)
+{
+    vn.var_nr.clear();
+    vn.memory_epoch.clear();
+    vector<ir_instr *> kept;
+    for(size_t i = 0;i < block->instrs.size();i++) {
+        ir_instr *instr = block->instrs[i];
+        switch(instr->op) {
+            case IR_BINOP: case IR_UNOP:
+            case IR_INDEX: case IR_FIELD: {
+                string key = expression_key(vn, instr);
+                auto found = vn.exprs.find(key);
+                if(found != vn.exprs.end()) {
+                    vn.replaced[instr->dest] = found->second;
+                    vn.removed++;
+                    delete instr;
+                    continue;
+                }
+                vn.exprs[key] = instr->dest;
+                vn.undo.push_back(key);
+                break;
+            }
+        }
+        clobber(vn, instr);
+        kept.push_back(instr);
+    }
+    block->instrs = kept;
+}
+
+static void walk(numbering &vn, ir_block *block,
+        vector<vector<ir_block *>> &children)
+{
+    size_t mark = vn.undo.size();
+    number_block(vn, block);
+    vector<ir_block *> &kids = children[block->id];
+    for(size_t c = 0;c < kids.size();c++)
+        walk(vn, kids[c], children);
+    while(vn.undo.size() > mark) {
+        vn.exprs.erase(vn.undo.back());
+        vn.undo.pop_back();
+    }
+}
+
+int opt_number_values(ir_function *fn)
+{
+    numbering vn;
+    vn.next_nr = 0;
+    vn.removed = 0;
+
+    /* locals assigned anywhere but their declaration, and globals */
+    unordered_map<ir_value *, int> defs;
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            ir_value *dest = instr->dest;
+            if(!dest || dest->kind != IRV_VAR)
+                continue;
+            if(instr->op != IR_DECL || ++defs[dest] > 1
+                    || dest->sym->block_nr == SCOPE_GLOBAL)
+                vn.mutable_vars[dest] = true;
+        }
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            for(size_t arg = 0;arg < instr->args.size();arg++) {
+                ir_value *value = instr->args[arg];
+                if(value->kind == IRV_VAR
+                        && value->sym->block_nr == SCOPE_GLOBAL)
+                    vn.mutable_vars[value] = true;
+            }
+        }
+    }
+
+    vector<ir_block *> idom;
+    ir_dominators(fn, idom);
+    vector<vector<ir_block *>> children(fn->nr_blocks);
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        if(idom[block->id] && idom[block->id] != block)
+            children[idom[block->id]->id].push_back(block);
+    }
+    walk(vn, fn->blocks[0], children);
+    if(vn.removed)
+        ir_replace_uses(fn, vn.replaced);
+    return vn.removed;
+}
@@ -0,0 +1,435 @@
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+#include "opt.h"
+#include "ir.h"
+#include "semantics.h"
+using namespace std;
+
+/* Inlining.
+ *
+ * A call to a small function that is not recursive is replaced by a
+ * copy of the function's body. The block holding the call is split:
+ * the first half declares a fresh local for every parameter,
+ * initialized with the argument, and falls into the copied entry
+ * block. Every return becomes a jump to the second half, which starts
+ * by copying the result into the register the call defined. If there
+ * are several returns they first store it in a result local.
+ *
+ * A parameter the callee never assigns is replaced by the argument
+ * itself when that is a register, constant or local of the caller,
+ * since none of those can change while the copy runs.
+ *
+ * The copy gets new registers, and its locals and labels are renamed
+ * with the number of the inlined call, _i4_3_x for the local _3_x.
+ * Real names never start that way, so two copies of one function in
+ * the same caller can't clash.
+ *
+ * Functions are visited callees first, so a caller's size already
+ * counts what was inlined into it. The size of a function is the
+ * number of its instructions and blocks; anything larger than
+ * INLINE_LIMIT, and any function that can call itself again, is left
+ * as a call. A caller stops growing once INLINE_GROWTH instructions
+ * were inlined into it. With a profile, a call that never ran stays a
+ * call, and one in a hot block may copy up to INLINE_HOT_LIMIT. The
+ * copied blocks get the callee's counts, scaled to this call.
+ *
+ * The exception is a tail call to another function of the same cycle.
+ * That copy keeps its returns, since the caller returns right after
+ * the call anyway, so the copy's own tail calls back to the caller
+ * become calls to itself, which opt_eliminate_tail_calls turns into a
+ * loop. Two functions that only tail-call each other then run in
+ * constant stack.
+ */
+
+#define INLINE_LIMIT 16
+#define INLINE_HOT_LIMIT 64
+#define INLINE_GROWTH 1024
+
+static ir_module *module;
+static unordered_map<string, ir_function *> by_name;
+static vector<bool> recursive;
+static vector<size_t> component;
+static unordered_map<ir_function *, size_t> fn_index;
+static size_t next_reg;
+static size_t nr_inlined;
+/* the results have no symbol of their own; this one only says they
+ * are locals */
+static symbol result_symbol(NULL);
+
+static ir_function *callee(ir_instr *instr)
+{
+    if(instr->op != IR_CALL)
+        return NULL;
+    auto found = by_name.find("__" + instr->text);
+    return found == by_name.end() ? NULL : found->second;
+}
+
+/* Tarjan's strongly connected components over the call graph. The
+ * components are finished callees first, which is the order the
+ * functions are visited in. */
+struct call_graph {
+    vector<vector<size_t>> calls;
+    vector<long> index, low;
+    vector<bool> on_stack;
+    vector<size_t> stack, order;
+    long next_index;
+    size_t nr_components;
+
+    void visit(size_t f)
+    {
+        index[f] = low[f] = next_index++;
+        stack.push_back(f);
+        on_stack[f] = true;
+        for(size_t c = 0;c < calls[f].size();c++) {
+            size_t g = calls[f][c];
+            if(index[g] < 0) {
+                visit(g);
+                low[f] = min(low[f], low[g]);
+            } else if(on_stack[g]) {
+                low[f] = min(low[f], index[g]);
+            }
+        }
+        if(low[f] != index[f])
+            return;
+        size_t first = stack.size();
+        do {
+            first--;
+            on_stack[stack[first]] = false;
+        } while(stack[first] != f);
+        /* a component of more than one function is a cycle */
+        for(size_t s = first;s < stack.size();s++) {
+            if(stack.size() - first > 1)
+                recursive[stack[s]] = true;
+            component[stack[s]] = nr_components;
+            order.push_back(stack[s]);
+        }
+        nr_components++;
+        stack.resize(first);
+    }
+};
+
+/* every function followed by __ocmain, callees first */
+static void visit_order(vector<ir_function *> &order)
+{
+    size_t nr_fns = module->functions.size() + 1;
+    call_graph graph;
+    graph.calls.resize(nr_fns);
+    graph.index.assign(nr_fns, -1);
+    graph.low.assign(nr_fns, 0);
+    graph.on_stack.assign(nr_fns, false);
+    graph.next_index = 0;
+    graph.nr_components = 0;
+    recursive.assign(nr_fns, false);
+    component.assign(nr_fns, 0);
+    for(size_t f = 0;f < nr_fns;f++) {
+        ir_function *fn = f < module->functions.size()
+            ? module->functions[f] : module->main;
+        for(size_t b = 0;b < fn->blocks.size();b++) {
+            ir_block *block = fn->blocks[b];
+            for(size_t i = 0;i < block->instrs.size();i++) {
+                ir_function *target = callee(block->instrs[i]);
+                if(!target)
+                    continue;
+                graph.calls[f].push_back(fn_index[target]);
+                if(target == fn)
+                    recursive[f] = true;
+            }
+        }
+    }
+    for(size_t f = 0;f < nr_fns;f++) {
+        if(graph.index[f] < 0)
+            graph.visit(f);
+    }
+    order.clear();
+    for(size_t o = 0;o < graph.order.size();o++) {
+        size_t f = graph.order[o];
+        order.push_back(f < module->functions.size()
+                ? module->functions[f] : module->main);
+    }
+}
+
+static size_t function_size(ir_function *fn)
+{
+    size_t size = fn->blocks.size();
+    for(size_t b = 0;b < fn->blocks.size();b++)
+        size += fn->blocks[b]->instrs.size();
+    return size;
+}
+
+/* the copy of one callee at one call site */
+struct inline_copy {
+    string prefix;
+    ir_value_map values;
+    unordered_map<ir_block *, ir_block *> blocks;
+};
+
+static ir_value *local(const string &name, const string &type,
+        symbol *sym)
+{
+    ir_value *var = new ir_value();
+    var->kind = IRV_VAR;
+    var->name = name;
+    var->type = type;
+    var->sym = sym;
+    module->values.push_back(var);
+    return var;
+}
+
+static ir_value *copy_value(inline_copy &copy, ir_value *value)
+{
+    if(!value)
+        return NULL;
+    auto found = copy.values.find(value);
+    if(found != copy.values.end())
+        return found->second;
+    ir_value *result = value;
+    switch(value->kind) {
+        case IRV_REG:
+            result = ir_register(module, value->category, next_reg++,
+                    value->type);
+            break;
+        case IRV_VAR:
+            if(value->sym->block_nr != SCOPE_GLOBAL)
+                result = local("_" + copy.prefix + value->name,
+                        value->type, value->sym);
+            break;
+        case IRV_DEREF:
+            result = new ir_value(*value);
+            result->base = copy_value(copy, value->base);
+            module->values.push_back(result);
+            break;
+    }
+    copy.values[value] = result;
+    return result;
+}
+
+static ir_instr *new_instr(int op, astree *node, ir_value *dest)
+{
+    ir_instr *instr = new ir_instr();
+    instr->op = op;
+    instr->node = node;
+    instr->dest = dest;
+    return instr;
+}
+
+static ir_instr *declare(ir_value *var, ir_value *init, astree *node)
+{
+    ir_instr *decl = new_instr(IR_DECL, node, var);
+    decl->text = var->type + " " + var->name;
+    if(init)
+        decl->args.push_back(init);
+    return decl;
+}
+
+static bool assigned(ir_function *fn, ir_value *var)
+{
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            if(block->instrs[i]->dest == var)
+                return true;
+        }
+    }
+    return false;
+}
+
+/* values the inlined body can't change: the callee can't name the
+ * caller's locals, and registers are assigned once */
+static bool stable(ir_value *value)
+{
+    switch(value->kind) {
+        case IRV_REG: case IRV_CONST: case IRV_STRING:
+            return true;
+        case IRV_VAR:
+            return value->sym->block_nr != SCOPE_GLOBAL;
+    }
+    return false;
+}
+
+static int nr_returns(ir_function *fn)
+{
+    int returns = 0;
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        if(fn->blocks[b]->term == IR_RETURN)
+            returns++;
+    }
+    return returns;
+}
+
+/* replace the call at instrs[at] of block with the body of fn. The
+ * blocks that were added are inserted after block. For a tail call
+ * the returns of the copy return from the caller. */
+static void inline_call(ir_function *caller, size_t b, size_t at,
+        ir_function *fn, bool tail)
+{
+    ir_block *block = caller->blocks[b];
+    ir_instr *call = block->instrs[at];
+    inline_copy copy;
+    copy.prefix = "i" + to_string(++nr_inlined);
+
+    /* the second half of the block, where every return goes */
+    ir_block *join = NULL;
+    if(!tail) {
+        join = ir_new_block(caller, copy.prefix + "_return");
+        join->instrs.assign(block->instrs.begin() + at + 1,
+                block->instrs.end());
+        join->term = block->term;
+        join->cond = block->cond;
+        join->retval = block->retval;
+        join->succ[0] = block->succ[0];
+        join->succ[1] = block->succ[1];
+        join->count = block->count;
+        join->likely = block->likely;
+    }
+    block->instrs.resize(at);
+
+    /* a parameter the callee never assigns can name the argument
+     * directly if nothing in the copy can change it */
+    for(size_t p = 0;p < fn->params.size();p++) {
+        ir_value *arg = call->args[p];
+        if(stable(arg) && !assigned(fn, fn->params[p])) {
+            copy.values[fn->params[p]] = arg;
+            continue;
+        }
+        ir_value *param = copy_value(copy, fn->params[p]);
+        block->instrs.push_back(declare(param, arg, call->node));
+    }
+    /* with one return, its value can be read directly after it */
+    ir_value *result = NULL;
+    ir_instr *get = NULL;
+    if(call->dest && !tail) {
+        get = new_instr(IR_COPY, call->node, call->dest);
+        join->instrs.insert(join->instrs.begin(), get);
+        if(nr_returns(fn) > 1) {
+            result = local("_" + copy.prefix + "_result", fn->ret_type,
+                    &result_symbol);
+            block->instrs.push_back(declare(result, NULL, call->node));
+            get->args.push_back(result);
+        }
+    }
+
+    vector<ir_block *> added;
+    for(size_t c = 0;c < fn->blocks.size();c++) {
+        ir_block *from = fn->blocks[c];
+        ir_block *to = ir_new_block(caller, from->label.empty() ? ""
+                : copy.prefix + "_" + from->label);
+        copy.blocks[from] = to;
+        added.push_back(to);
+    }
+    for(size_t c = 0;c < fn->blocks.size();c++) {
+        ir_block *from = fn->blocks[c], *to = added[c];
+        for(size_t i = 0;i < from->instrs.size();i++) {
+            ir_instr *instr = new ir_instr(*from->instrs[i]);
+            instr->dest = copy_value(copy, instr->dest);
+            for(size_t arg = 0;arg < instr->args.size();arg++)
+                instr->args[arg] = copy_value(copy, instr->args[arg]);
+            if(instr->op == IR_DECL)
+                instr->text = instr->dest->type + " "
+                    + instr->dest->name;
+            to->instrs.push_back(instr);
+        }
+        to->term = from->term;
+        to->cond = copy_value(copy, from->cond);
+        to->count = opt_scale_count(from->count, block->count,
+                fn->blocks[0]->count);
+        to->likely = from->likely;
+        for(int s = 0;s < ir_nr_succ(from);s++)
+            to->succ[s] = copy.blocks[from->succ[s]];
+        if(tail) {
+            to->retval = copy_value(copy, from->retval);
+            continue;
+        }
+        if(from->term == IR_RETURN && result) {
+            ir_instr *set = new_instr(IR_COPY, call->node, result);
+            set->args.push_back(copy_value(copy, from->retval));
+            to->instrs.push_back(set);
+        } else if(from->term == IR_RETURN && get) {
+            get->args.push_back(copy_value(copy, from->retval));
+        }
+        if(from->term == IR_RETURN || from->term == IR_RETURNVOID
+                || (from->term == IR_FALL && !from->succ[0])) {
+            to->term = IR_GOTO;
+            to->succ[0] = join;
+        }
+    }
+    if(join)
+        added.push_back(join);
+
+    block->term = IR_FALL;
+    block->cond = block->retval = NULL;
+    block->succ[0] = added[0];
+    block->succ[1] = NULL;
+    block->likely = -1;
+    caller->blocks.insert(caller->blocks.begin() + b + 1, added.begin(),
+            added.end());
+    delete call;
+}
+
+static int inline_calls(ir_function *caller)
+{
+    int inlined = 0;
+    size_t growth = 0;
+    bool tail_calls = false;
+    for(size_t b = 0;b < caller->blocks.size();b++) {
+        ir_block *block = caller->blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_function *fn = callee(block->instrs[i]);
+            if(!fn || fn == caller)
+                continue;
+            size_t f = fn_index[fn];
+            bool tail = recursive[f]
+                && component[f] == component[fn_index[caller]]
+                && opt_tail_call(block, i);
+            if((recursive[f] && !tail) || opt_block_cold(block))
+                continue;
+            size_t size = function_size(fn);
+            size_t limit = opt_block_hot(block) ? INLINE_HOT_LIMIT
+                : INLINE_LIMIT;
+            if(size > limit || growth + size > INLINE_GROWTH)
+                continue;
+            inline_call(caller, b, i, fn, tail);
+            growth += size;
+            inlined++;
+            tail_calls |= tail;
+            /* carry on in the copied entry block */
+            break;
+        }
+    }
+    if(tail_calls)
+        opt_eliminate_tail_calls(caller);
+    return inlined;
+}
+
+int opt_inline(ir_module *mod)
+{
+    module = mod;
+    result_symbol.block_nr = SCOPE_GLOBAL + 1;
+    by_name.clear();
+    fn_index.clear();
+    next_reg = 1;
+    nr_inlined = 0;
+    for(size_t v = 0;v < module->values.size();v++) {
+        ir_value *value = module->values[v];
+        if(value->kind == IRV_REG && value->nr >= next_reg)
+            next_reg = value->nr + 1;
+    }
+    for(size_t f = 0;f < module->functions.size();f++) {
+        ir_function *fn = module->functions[f];
+        by_name[fn->decl.substr(fn->decl.rfind(' ') + 1)] = fn;
+        fn_index[fn] = f;
+    }
+    fn_index[module->main] = module->functions.size();
+
+    vector<ir_function *> order;
+    visit_order(order);
+    int inlined = 0;
+    for(size_t f = 0;f < order.size();f++) {
+        /* only what can run is copied */
+        ir_remove_unreachable(order[f]);
+        inlined += inline_calls(order[f]);
+    }
+    return inlined;
+}
@@ -0,0 +1,1126 @@
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+
+#include "ir.h"
+#include "semantics.h"
+#include "astree.h"
+#include "lyutils.h"
+using namespace std;
+
+/* Lowering from the typed AST.
+ *
+ * A DFS traversal is done, post order. Each node may append some
+ * instructions to the current block, and each node may have a result,
+ * stored in node->irval. Because the traversal is post order, when a
+ * node is lowered, all of its children have their results set, and
+ * the node's instructions use those as operands.
+ *
+ * If a node doesn't produce code (like the IDENT node), it just sets
+ * its result and returns.
+ *
+ * IF, IFELSE and WHILE are not done post order, since they split the
+ * code into blocks: the condition, the branches or the loop body, and
+ * the block that follows. FUNCTION and STRUCT are lowered separately,
+ * before the global statements.
+ *
+ * Registers and labels are named exactly as the oil printer spells
+ * them. Registers are numbered from 1 in each function, in lowering
+ * order, so what a function prints doesn't depend on the functions
+ * before it.
+ */
+
+const char *ir_category_names[IR_NR_CATEGORIES] = {
+    "i", "b", "c", "p", "a"
+};
+
+static size_t reg_nr = 1;
+static ir_module *module;
+static ir_function *function;
+static ir_block *current;
+/* one value per variable, so passes can compare operands by pointer */
+static unordered_map<symbol *, ir_value *> variables;
+
+static ir_value *new_value(int kind)
+{
+    ir_value *value = new ir_value();
+    value->kind = kind;
+    module->values.push_back(value);
+    return value;
+}
+
+/* allocate a register of the function being lowered */
+static ir_value *register_alloc(int category, const string &type)
+{
+    ir_value *reg = new_value(IRV_REG);
+    reg->category = category;
+    reg->nr = reg_nr++;
+    reg->name = string(ir_category_names[category]) + to_string(reg->nr);
+    reg->type = type;
+    return reg;
+}
+
+static ir_value *deref_value(ir_value *reg)
+{
+    ir_value *value = new_value(IRV_DEREF);
+    value->base = reg;
+    value->type = reg->type;
+    return value;
+}
+
+string ir_value_name(ir_value *value)
+{
+    if(value->kind == IRV_DEREF)
+        return "(*" + value->base->name + ")";
+    return value->name;
+}
+
+static ir_value *const_value(int category, long cval, const string &name)
+{
+    ir_value *value = new_value(IRV_CONST);
+    value->category = category;
+    value->cval = cval;
+    value->name = name;
+    return value;
+}
+
+/* a constant made by a pass, spelled as a plain number */
+ir_value *ir_const(ir_module *mod, int category, long cval)
+{
+    ir_value *value = new ir_value();
+    value->kind = IRV_CONST;
+    value->category = category;
+    value->cval = cval;
+    value->name = to_string(cval);
+    mod->values.push_back(value);
+    return value;
+}
+
+/* a register numbered by a pass */
+ir_value *ir_register(ir_module *mod, int category, size_t nr,
+        const string &type)
+{
+    ir_value *reg = new ir_value();
+    reg->kind = IRV_REG;
+    reg->category = category;
+    reg->nr = nr;
+    reg->name = string(ir_category_names[category]) + to_string(nr);
+    reg->type = type;
+    mod->values.push_back(reg);
+    return reg;
+}
+
+ir_block *ir_new_block(ir_function *fn, const string &label)
+{
+    ir_block *block = new ir_block();
+    block->id = fn->nr_blocks++;
+    block->label = label;
+    block->term = IR_FALL;
+    block->count = -1;
+    block->likely = -1;
+    return block;
+}
+
+void ir_need_label(ir_block *block)
+{
+    if(block->label.empty())
+        block->label = "jump_" + to_string(block->id);
+}
+
+/* end the current block by falling into 'next', which becomes the
+ * current block */
+static void start_block(ir_block *next)
+{
+    if(current->term == IR_FALL)
+        current->succ[0] = next;
+    function->blocks.push_back(next);
+    current = next;
+}
+
+static void emit_instr(ir_instr *instr)
+{
+    current->instrs.push_back(instr);
+}
+
+static ir_instr *new_instr(int op, astree *node, ir_value *dest)
+{
+    ir_instr *instr = new ir_instr();
+    instr->op = op;
+    instr->node = node;
+    instr->dest = dest;
+    return instr;
+}
+
+static string node_label(const char *prefix, astree *node)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s_%ld_%ld_%ld", prefix,
+            node->filenr, node->linenr, node->offset);
+    return string(buf);
+}
+
+static string strip_zeros(const string *lexstr)
+{
+    string stripped = *lexstr;
+    stripped.erase(0, stripped.find_first_not_of('0'));
+    if(stripped == string(""))
+        stripped += string("0");
+    return stripped;
+}
+
+static long charcon_value(const string *lexstr)
+{
+    const char *c = lexstr->c_str() + 1;
+    if(*c != '\\')
+        return (unsigned char)*c;
+    switch(c[1]) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case '0': return '\0';
+        default:  return (unsigned char)c[1];
+    }
+}
+
+/* this creates a string that can be used as a C type. The type is
+ * calculated from the node's tokid and attributes. */
+static string result_type_name(astree *node)
+{
+    attr_bitset attr = node->attributes;
+    if(attr.test(ATTR_struct))
+        assert(node->type_name);
+    const char *base;
+    if(attr.test(ATTR_bool))
+        base = "char";
+    else if(attr.test(ATTR_char))
+        base = "char";
+    else if(attr.test(ATTR_int))
+        base = "int";
+    else if(attr.test(ATTR_string))
+        base = "char*";
+    else if(attr.test(ATTR_struct))
+        base = "struct ";
+    else
+        assert(0);
+
+    return string(base) +
+            (attr.test(ATTR_struct) ?
+                string("s_") + *node->type_name
+                + string("*") : string("")) +
+            (attr.test(ATTR_array) ? string("*") : string("")) +
+            (node->symbol == '.' ? string("*") : string(""));
+}
+
+/* figure out the register category. This is mostly based on the tokid
+ * except for TOK_CALL. */
+static int register_category(astree *node)
+{
+    int cat = -1;
+    switch(node->symbol) {
+        case '+': case '-': case '*': case '/':
+        case '%': case TOK_POS: case TOK_NEG:
+        case TOK_ORD:
+            cat = IR_INT;
+            break;
+        case '>': case '<': case TOK_EQ:
+        case TOK_NE: case TOK_LE: case TOK_GE:
+        case '!':
+            cat = IR_BOOL;
+            break;
+        case TOK_CHR:
+            cat = IR_CHAR;
+            break;
+        case TOK_CALL:
+            /* is it a pointer? */
+            if(result_type_name(node).find('*') != string::npos)
+                cat = IR_PTR;
+            else if(node->attributes.test(ATTR_int))
+                cat = IR_INT;
+            else if(node->attributes.test(ATTR_char))
+                cat = IR_CHAR;
+            else if(node->attributes.test(ATTR_bool))
+                cat = IR_BOOL;
+            else
+                assert(0);
+            break;
+    }
+    return cat;
+}
+
+static string make_oilname(astree *node)
+{
+    if(node->symbol == TOK_FIELD) {
+        return string("f_") +
+                /* okay, this is kinda ugly. Basically:
+                 * node->symentry->definition is the
+                 * field AST node that defines the field
+                 * in the structure block. It's parent's
+                 * parent is the actual 'struct' AST node,
+                 * whose 0th child is the typename. */
+                *node->symentry->definition->parent->
+                    parent->children[0]->lexinfo +
+                string("_") +
+                *node->symentry->definition->lexinfo;
+    }
+    /* is global variable */
+    if(node->symentry->block_nr == 0)
+        return string("__") +
+                *node->symentry->definition->lexinfo;
+    else
+        return string("_") +
+                to_string(node->symentry->block_nr) +
+                string("_") +
+                *node->symentry->definition->lexinfo;
+}
+
+/* the name is kept in the symbol, so every later reference to it
+ * costs nothing */
+static const string &mangle_name(astree *node)
+{
+    assert(node->symentry);
+    if(!node->symentry->oilname)
+        node->symentry->oilname = new string(make_oilname(node));
+    return *node->symentry->oilname;
+}
+
+static string declared_type(astree *node);
+
+static ir_value *variable(astree *node)
+{
+    auto found = variables.find(node->symentry);
+    if(found != variables.end())
+        return found->second;
+    ir_value *var = new_value(IRV_VAR);
+    var->sym = node->symentry;
+    var->name = mangle_name(node);
+    var->type = declared_type(node->symentry->definition->parent);
+    variables[node->symentry] = var;
+    return var;
+}
+
+/* the C spelling of a base type on its own, as used in arrays and
+ * allocations */
+static string base_type_name(astree *node)
+{
+    switch(node->symbol) {
+        case TOK_BOOL:
+            return "char";
+        case TOK_STRING:
+            return "char*";
+        case TOK_TYPEID:
+            return "struct s_" + *node->lexinfo + "*";
+        default:
+            return *node->lexinfo;
+    }
+}
+
+static astree *declared_ident(astree *node)
+{
+    if(node->symbol == TOK_ARRAY)
+        return node->children[1];
+    return node->children[0];
+}
+
+/* the C type declared by a declaration node: a basetype with a DECLID
+ * or FIELD child, or an ARRAY of a basetype */
+static string declared_type(astree *node)
+{
+    if(node->symbol == TOK_ARRAY)
+        return base_type_name(node->children[0]) + "*";
+    return base_type_name(node);
+}
+
+static string declaration(astree *node)
+{
+    return declared_type(node) + " " + mangle_name(declared_ident(node));
+}
+
+static void lower(astree *node);
+
+static void lower_control(astree *node)
+{
+    ir_block *body, *join, *otherwise;
+    switch(node->symbol) {
+        case TOK_WHILE:
+            start_block(ir_new_block(function, node_label("while", node)));
+            {
+                ir_block *head = current;
+                lower(node->children[0]);
+                body = ir_new_block(function, "");
+                join = ir_new_block(function, node_label("break", node));
+                current->term = IR_BRANCH;
+                current->cond = node->children[0]->irval;
+                current->succ[0] = body;
+                current->succ[1] = join;
+                start_block(body);
+                lower(node->children[1]);
+                current->term = IR_GOTO;
+                current->succ[0] = head;
+            }
+            start_block(join);
+            break;
+        case TOK_IF:
+            lower(node->children[0]);
+            body = ir_new_block(function, "");
+            join = ir_new_block(function, node_label("fi", node));
+            current->term = IR_BRANCH;
+            current->cond = node->children[0]->irval;
+            current->succ[0] = body;
+            current->succ[1] = join;
+            start_block(body);
+            lower(node->children[1]);
+            start_block(join);
+            break;
+        case TOK_IFELSE:
+            lower(node->children[0]);
+            body = ir_new_block(function, "");
+            otherwise = ir_new_block(function, node_label("else", node));
+            join = ir_new_block(function, node_label("fi", node));
+            current->term = IR_BRANCH;
+            current->cond = node->children[0]->irval;
+            current->succ[0] = body;
+            current->succ[1] = otherwise;
+            start_block(body);
+            lower(node->children[1]);
+            current->term = IR_GOTO;
+            current->succ[0] = join;
+            start_block(otherwise);
+            lower(node->children[2]);
+            start_block(join);
+            break;
+    }
+}
+
+/* because not every node produces code, we can actually run this
+ * function on sub-trees with the expectation that it does it
+ * correctly. */
+static void lower(astree *node)
+{
+    /* these nodes must be done first, and they do NOT recurse on
+     * its children automatically. This is because they need to
+     * be traversed in a specific order and at specific times. */
+    switch(node->symbol) {
+        case TOK_STRUCT: case TOK_FUNCTION:
+        case TOK_PROTOTYPE:
+            return;
+        case TOK_STRINGCON:
+            node->irval = new_value(IRV_STRING);
+            node->irval->name = *node->oilname;
+            return;
+        case TOK_WHILE: case TOK_IF: case TOK_IFELSE:
+            lower_control(node);
+            return;
+    }
+    /* post order */
+    for(size_t child = 0;child < node->children.size();++child) {
+        lower(node->children[child]);
+    }
+    ir_instr *instr;
+    ir_value *reg;
+    switch(node->symbol) {
+        /* binary operators compute into a new register */
+        case '+': case '-': case '*': case '>':
+        case '/': case '%': case '<':
+        case TOK_EQ: case TOK_NE: case TOK_LE:
+        case TOK_GE:
+            reg = register_alloc(register_category(node),
+                    result_type_name(node));
+            instr = new_instr(IR_BINOP, node, reg);
+            instr->opname = *node->lexinfo;
+            instr->args.push_back(node->children[0]->irval);
+            instr->args.push_back(node->children[1]->irval);
+            emit_instr(instr);
+            node->irval = reg;
+            break;
+        /* so do unary operators */
+        case TOK_POS: case TOK_NEG: case '!':
+        case TOK_ORD: case TOK_CHR:
+            reg = register_alloc(register_category(node),
+                    result_type_name(node));
+            instr = new_instr(IR_UNOP, node, reg);
+            if(node->symbol == TOK_ORD)
+                instr->opname = "(int)";
+            else if(node->symbol == TOK_CHR)
+                instr->opname = "(char)";
+            else
+                instr->opname = *node->lexinfo;
+            instr->args.push_back(node->children[0]->irval);
+            emit_instr(instr);
+            node->irval = reg;
+            break;
+        /* this is a special binary operator. The result is
+         * just the lval, it can be used later */
+        case '=':
+            instr = new_instr(IR_COPY, node, node->children[0]->irval);
+            instr->args.push_back(node->children[1]->irval);
+            emit_instr(instr);
+            node->irval = node->children[0]->irval;
+            break;
+        case TOK_VARDECL:
+            /* if we're a direct child of the root, then we're a
+             * global variable and have already been declared
+             * (see lower_globals). Just assign it. */
+            if(node->parent->symbol == TOK_ROOT) {
+                instr = new_instr(IR_COPY, node,
+                        declared_ident(node->children[0])->irval);
+            } else {
+                instr = new_instr(IR_DECL, node,
+                        declared_ident(node->children[0])->irval);
+                instr->text = declaration(node->children[0]);
+            }
+            instr->args.push_back(node->children[1]->irval);
+            emit_instr(instr);
+            break;
+        case TOK_CALL:
+            /* no register allocated on void function call */
+            reg = NULL;
+            if(!node->attributes.test(ATTR_void))
+                reg = register_alloc(register_category(node),
+                        result_type_name(node));
+            instr = new_instr(IR_CALL, node, reg);
+            instr->text = *node->children[0]->lexinfo;
+            for(size_t child = 1;child < node->children.size();
+                    child++) {
+                instr->args.push_back(node->children[child]->irval);
+            }
+            emit_instr(instr);
+            node->irval = reg;
+            break;
+        case TOK_INTCON:
+            node->irval = const_value(IR_INT,
+                    atol(node->lexinfo->c_str()),
+                    strip_zeros(node->lexinfo));
+            break;
+        case TOK_CHARCON:
+            node->irval = const_value(IR_CHAR,
+                    charcon_value(node->lexinfo), *node->lexinfo);
+            break;
+        case TOK_NULL:
+            node->irval = const_value(IR_PTR, 0, "0");
+            break;
+        case TOK_FALSE:
+            node->irval = const_value(IR_BOOL, 0, "0");
+            break;
+        case TOK_TRUE:
+            node->irval = const_value(IR_BOOL, 1, "1");
+            break;
+        case TOK_RETURN: case TOK_RETURNVOID:
+            if(node->symbol == TOK_RETURN) {
+                current->term = IR_RETURN;
+                current->retval = node->children[0]->irval;
+            } else {
+                current->term = IR_RETURNVOID;
+            }
+            /* anything after the return in the same block still
+             * gets lowered, into a block nothing reaches */
+            start_block(ir_new_block(function, ""));
+            break;
+        case TOK_INDEX:
+            reg = register_alloc(IR_ADDR, result_type_name(node) + "*");
+            instr = new_instr(IR_INDEX, node, reg);
+            instr->args.push_back(node->children[0]->irval);
+            instr->args.push_back(node->children[1]->irval);
+            emit_instr(instr);
+            node->irval = deref_value(reg);
+            break;
+        case '.':
+            reg = register_alloc(IR_ADDR, result_type_name(node));
+            instr = new_instr(IR_FIELD, node, reg);
+            instr->args.push_back(node->children[0]->irval);
+            instr->text = mangle_name(node->children[1]);
+            emit_instr(instr);
+            node->irval = deref_value(reg);
+            break;
+        case TOK_IDENT: case TOK_DECLID:
+            node->irval = variable(node);
+            break;
+        case TOK_NEW:
+            reg = register_alloc(IR_PTR,
+                    "struct s_" + *node->type_name + "*");
+            instr = new_instr(IR_NEW, node, reg);
+            instr->text = *node->type_name;
+            emit_instr(instr);
+            node->irval = reg;
+            break;
+        case TOK_NEWARRAY:
+            reg = register_alloc(IR_PTR,
+                    result_type_name(node->children[0]) + "*");
+            instr = new_instr(IR_NEWARRAY, node, reg);
+            instr->text = result_type_name(node->children[0]);
+            instr->args.push_back(node->children[1]->irval);
+            emit_instr(instr);
+            node->irval = reg;
+            break;
+        case TOK_NEWSTRING:
+            reg = register_alloc(IR_PTR, "char*");
+            instr = new_instr(IR_NEWSTRING, node, reg);
+            instr->args.push_back(node->children[0]->irval);
+            emit_instr(instr);
+            node->irval = reg;
+            break;
+        /* declarations and type names produce no code; their C
+         * spelling is built by declaration() where it is needed */
+        case TOK_FIELD: case TOK_ARRAY:
+        case TOK_INT: case TOK_CHAR: case TOK_VOID:
+        case TOK_BOOL: case TOK_STRING: case TOK_TYPEID:
+        case TOK_BLOCK: case TOK_ROOT: case ';':
+            break;
+        default:
+            fprintf(stderr, "!!! unknown: %s\n",
+                    get_yytname(node->symbol));
+            break;
+    }
+}
+
+static ir_function *new_function(astree *node)
+{
+    function = new ir_function();
+    function->node = node;
+    function->module = module;
+    function->nr_blocks = 0;
+    function->temps_declared = false;
+    reg_nr = 1;
+    current = ir_new_block(function, "");
+    function->blocks.push_back(current);
+    return function;
+}
+
+/* all functions are direct children of root. */
+static void lower_functions(astree *root)
+{
+    for(size_t child=0;child < root->children.size();child++) {
+        astree *node = root->children[child];
+        if(node->symbol != TOK_FUNCTION)
+            continue;
+        ir_function *fn = new_function(node);
+        fn->sym = declared_ident(node->children[0])->symentry;
+        fn->decl = declaration(node->children[0]);
+        fn->ret_type = declared_type(node->children[0]);
+        astree *params = node->children[1];
+        for(size_t param = 0;param < params->children.size();param++) {
+            astree *parnode = params->children[param];
+            lower(parnode);
+            fn->param_decls.push_back(declaration(parnode));
+            fn->params.push_back(declared_ident(parnode)->irval);
+        }
+        lower(node->children[2]);
+        module->functions.push_back(fn);
+    }
+}
+
+/* all global variables are declared at the top. */
+static void lower_globals(astree *root)
+{
+    for(size_t child = 0;child<root->children.size();child++) {
+        astree *node = root->children[child];
+        if(node->symbol == TOK_VARDECL) {
+            ir_global *global = new ir_global();
+            global->decl = declaration(node->children[0]);
+            global->var = variable(declared_ident(node->children[0]));
+            module->globals.push_back(global);
+        }
+    }
+}
+
+/* all structures and their fields */
+static void lower_structs(astree *root)
+{
+    for(size_t child = 0;child<root->children.size();child++) {
+        astree *node = root->children[child];
+        if(node->symbol == TOK_STRUCT) {
+            ir_struct *st = new ir_struct();
+            st->name = *node->children[0]->lexinfo;
+            st->node = node;
+            for(size_t field = 1;field < node->children.size();
+                    field++) {
+                astree *finode = node->children[field];
+                st->field_decls.push_back(declaration(finode));
+                st->field_types.push_back(declared_type(finode));
+                st->field_names.push_back(
+                        mangle_name(declared_ident(finode)));
+            }
+            module->structs.push_back(st);
+        }
+    }
+}
+
+ir_module *ir_build(astree *root)
+{
+    extern vector<const string *> globalstrings;
+    module = new ir_module();
+    variables.clear();
+    lower_structs(root);
+    module->strings = globalstrings;
+    lower_globals(root);
+    lower_functions(root);
+
+    module->main = new_function(root);
+    module->main->sym = NULL;
+    module->main->decl = "void __ocmain";
+    module->main->ret_type = "void";
+    lower(root);
+    return module;
+}
+
+static ir_value *replacement(const ir_value_map &map, ir_value *value)
+{
+    if(!value)
+        return value;
+    auto found = map.find(value);
+    if(found != map.end())
+        return found->second;
+    /* the object behind a replaced address */
+    if(value->kind == IRV_DEREF) {
+        ir_value *base = replacement(map, value->base);
+        if(base != value->base)
+            return deref_value(base);
+    }
+    return value;
+}
+
+/* replace every operand found in map. Destinations are left alone. */
+void ir_replace_uses(ir_function *fn, const ir_value_map &map)
+{
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            for(size_t arg = 0;arg < instr->args.size();arg++)
+                instr->args[arg] = replacement(map, instr->args[arg]);
+            /* a store through an address is a use of the address */
+            if(instr->dest && instr->dest->kind == IRV_DEREF)
+                instr->dest = replacement(map, instr->dest);
+        }
+        block->cond = replacement(map, block->cond);
+        block->retval = replacement(map, block->retval);
+    }
+}
+
+/* the successors are succ[0 .. ir_nr_succ(block)-1] */
+int ir_nr_succ(ir_block *block)
+{
+    switch(block->term) {
+        case IR_FALL: case IR_GOTO:
+            return block->succ[0] ? 1 : 0;
+        case IR_BRANCH:
+            return 2;
+    }
+    return 0;
+}
+
+bool ir_jump_if_true(ir_block *block, ir_block *next)
+{
+    return block->term == IR_BRANCH && block->succ[1] == next
+        && block->succ[0] != next;
+}
+
+static void postorder(ir_block *block, vector<bool> &seen,
+        vector<ir_block *> &order)
+{
+    seen[block->id] = true;
+    for(int s = 0;s < ir_nr_succ(block);s++) {
+        if(!seen[block->succ[s]->id])
+            postorder(block->succ[s], seen, order);
+    }
+    order.push_back(block);
+}
+
+/* the reachable blocks in reverse postorder, entry first */
+void ir_reverse_postorder(ir_function *fn, vector<ir_block *> &order)
+{
+    vector<bool> seen(fn->nr_blocks, false);
+    order.clear();
+    postorder(fn->blocks[0], seen, order);
+    reverse(order.begin(), order.end());
+}
+
+/* immediate dominators, indexed by block id, using the iterative
+ * algorithm of Cooper, Harvey and Kennedy. The entry is its own
+ * dominator, and unreachable blocks have none. */
+void ir_dominators(ir_function *fn, vector<ir_block *> &idom)
+{
+    vector<ir_block *> order;
+    ir_reverse_postorder(fn, order);
+    vector<size_t> rpo_nr(fn->nr_blocks, 0);
+    for(size_t i = 0;i < order.size();i++)
+        rpo_nr[order[i]->id] = i;
+    vector<vector<ir_block *>> preds(fn->nr_blocks);
+    for(size_t i = 0;i < order.size();i++) {
+        for(int s = 0;s < ir_nr_succ(order[i]);s++)
+            preds[order[i]->succ[s]->id].push_back(order[i]);
+    }
+
+    idom.assign(fn->nr_blocks, NULL);
+    idom[order[0]->id] = order[0];
+    bool changed;
+    do {
+        changed = false;
+        for(size_t i = 1;i < order.size();i++) {
+            ir_block *block = order[i];
+            ir_block *new_idom = NULL;
+            vector<ir_block *> &p = preds[block->id];
+            for(size_t j = 0;j < p.size();j++) {
+                if(!idom[p[j]->id])
+                    continue;
+                if(!new_idom) {
+                    new_idom = p[j];
+                    continue;
+                }
+                /* intersect */
+                ir_block *a = p[j], *b = new_idom;
+                while(a != b) {
+                    while(rpo_nr[a->id] > rpo_nr[b->id])
+                        a = idom[a->id];
+                    while(rpo_nr[b->id] > rpo_nr[a->id])
+                        b = idom[b->id];
+                }
+                new_idom = a;
+            }
+            if(idom[block->id] != new_idom) {
+                idom[block->id] = new_idom;
+                changed = true;
+            }
+        }
+    } while(changed);
+}
+
+void ir_find_loops(ir_function *fn, vector<ir_loop> &loops)
+{
+    vector<ir_block *> order, idom;
+    ir_reverse_postorder(fn, order);
+    ir_dominators(fn, idom);
+    vector<vector<ir_block *>> preds(fn->nr_blocks);
+    for(size_t i = 0;i < order.size();i++) {
+        for(int s = 0;s < ir_nr_succ(order[i]);s++)
+            preds[order[i]->succ[s]->id].push_back(order[i]);
+    }
+
+    loops.clear();
+    unordered_map<ir_block *, size_t> by_header;
+    for(size_t i = 0;i < order.size();i++) {
+        ir_block *block = order[i];
+        for(int s = 0;s < ir_nr_succ(block);s++) {
+            ir_block *header = block->succ[s];
+            /* a back edge: the header dominates the block */
+            ir_block *dom = block;
+            while(dom != header && idom[dom->id] != dom)
+                dom = idom[dom->id];
+            if(dom != header)
+                continue;
+            if(!by_header.count(header)) {
+                by_header[header] = loops.size();
+                loops.push_back(ir_loop());
+                loops.back().header = header;
+                loops.back().contains[header] = true;
+            }
+            ir_loop &loop = loops[by_header[header]];
+            vector<ir_block *> work(1, block);
+            while(!work.empty()) {
+                ir_block *b = work.back();
+                work.pop_back();
+                if(loop.contains.count(b))
+                    continue;
+                loop.contains[b] = true;
+                for(size_t p = 0;p < preds[b->id].size();p++)
+                    work.push_back(preds[b->id][p]);
+            }
+        }
+    }
+    for(size_t l = 0;l < loops.size();l++) {
+        for(size_t i = 0;i < order.size();i++) {
+            if(loops[l].contains.count(order[i]))
+                loops[l].blocks.push_back(order[i]);
+        }
+    }
+    stable_sort(loops.begin(), loops.end(),
+            [](const ir_loop &a, const ir_loop &b) {
+                return a.blocks.size() < b.blocks.size();
+            });
+}
+
+/* the block every entry into the loop from outside goes through,
+ * right before the header. If the loop is only entered from a block
+ * that does nothing but continue into the header, that block is it;
+ * otherwise a new one is made, and added to the loops around this
+ * one. */
+ir_block *ir_loop_preheader(ir_function *fn, ir_loop &loop,
+        vector<ir_loop> &loops)
+{
+    ir_block *header = loop.header;
+    size_t at = find(fn->blocks.begin(), fn->blocks.end(), header)
+        - fn->blocks.begin();
+    vector<ir_block *> entries;
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        if(loop.contains.count(block))
+            continue;
+        for(int s = 0;s < ir_nr_succ(block);s++) {
+            if(block->succ[s] == header) {
+                entries.push_back(block);
+                break;
+            }
+        }
+    }
+    if(entries.size() == 1 && ir_nr_succ(entries[0]) == 1 && at > 0
+            && fn->blocks[at - 1] == entries[0])
+        return entries[0];
+
+    ir_block *pre = ir_new_block(fn, "");
+    pre->label = "pre_" + (header->label.empty()
+            ? to_string(pre->id) : header->label);
+    pre->succ[0] = header;
+    for(size_t e = 0;e < entries.size();e++) {
+        for(int s = 0;s < ir_nr_succ(entries[e]);s++) {
+            if(entries[e]->succ[s] == header)
+                entries[e]->succ[s] = pre;
+        }
+    }
+    fn->blocks.insert(fn->blocks.begin() + at, pre);
+    for(size_t o = 0;o < loops.size();o++) {
+        ir_loop &outer = loops[o];
+        if(&outer == &loop || !outer.contains.count(header))
+            continue;
+        outer.contains[pre] = true;
+        size_t pos = find(outer.blocks.begin(), outer.blocks.end(),
+                header) - outer.blocks.begin();
+        outer.blocks.insert(outer.blocks.begin() + pos, pre);
+    }
+    return pre;
+}
+
+size_t ir_next_register_nr(ir_function *fn)
+{
+    size_t nr = 1;
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_value *dest = block->instrs[i]->dest;
+            if(dest && dest->kind == IRV_REG && dest->nr >= nr)
+                nr = dest->nr + 1;
+        }
+    }
+    return nr;
+}
+
+string ir_inverse_compare(const string &op)
+{
+    if(op == "<") return ">=";
+    if(op == ">=") return "<";
+    if(op == ">") return "<=";
+    if(op == "<=") return ">";
+    if(op == "==") return "!=";
+    return "==";
+}
+
+int ir_type_category(const string &type)
+{
+    if(type == "int")
+        return IR_INT;
+    if(type == "char")
+        return IR_CHAR;
+    return IR_PTR;
+}
+
+/* Liveness of registers and locals. Globals are not tracked, since
+ * any function may read them. */
+static bool live_tracked(ir_value *value)
+{
+    if(value->kind == IRV_REG)
+        return true;
+    return value->kind == IRV_VAR
+        && value->sym->block_nr != SCOPE_GLOBAL;
+}
+
+static void live_number(ir_liveness &lv, ir_value *value)
+{
+    if(value && live_tracked(value) && !lv.index.count(value)) {
+        size_t nr = lv.index.size();
+        lv.index[value] = nr;
+    }
+}
+
+/* the value an instruction defines, if liveness tracks it */
+ir_value *ir_live_def(ir_instr *instr)
+{
+    if(instr->dest && live_tracked(instr->dest))
+        return instr->dest;
+    return NULL;
+}
+
+void ir_live_use(ir_liveness &lv, vector<bool> &live, ir_value *value)
+{
+    if(!value)
+        return;
+    if(value->kind == IRV_DEREF)
+        value = value->base;
+    auto found = lv.index.find(value);
+    if(found != lv.index.end())
+        live[found->second] = true;
+}
+
+/* step backwards over one instruction */
+void ir_live_transfer(ir_liveness &lv, vector<bool> &live,
+        ir_instr *instr)
+{
+    ir_value *def = ir_live_def(instr);
+    if(def)
+        live[lv.index[def]] = false;
+    else if(instr->dest && instr->dest->kind == IRV_DEREF)
+        ir_live_use(lv, live, instr->dest);
+    for(size_t arg = 0;arg < instr->args.size();arg++)
+        ir_live_use(lv, live, instr->args[arg]);
+}
+
+static void block_live_out(ir_liveness &lv, ir_block *block,
+        vector<bool> &out)
+{
+    out.assign(lv.index.size(), false);
+    for(int s = 0;s < ir_nr_succ(block);s++) {
+        vector<bool> &in = lv.live_in[block->succ[s]->id];
+        for(size_t v = 0;v < out.size();v++)
+            if(in[v])
+                out[v] = true;
+    }
+}
+
+void ir_compute_liveness(ir_function *fn, ir_liveness &lv)
+{
+    lv.index.clear();
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            live_number(lv, ir_live_def(instr));
+            for(size_t arg = 0;arg < instr->args.size();arg++)
+                live_number(lv, instr->args[arg]);
+        }
+    }
+    size_t nr_values = lv.index.size();
+    lv.live_in.assign(fn->nr_blocks, vector<bool>(nr_values, false));
+    lv.live_out.assign(fn->nr_blocks, vector<bool>(nr_values, false));
+
+    bool changed;
+    do {
+        changed = false;
+        /* reverse layout order converges quickly on forward code */
+        for(size_t b = fn->blocks.size();b-- > 0;) {
+            ir_block *block = fn->blocks[b];
+            vector<bool> live;
+            block_live_out(lv, block, live);
+            lv.live_out[block->id] = live;
+            ir_live_use(lv, live, block->cond);
+            ir_live_use(lv, live, block->retval);
+            for(size_t i = block->instrs.size();i-- > 0;)
+                ir_live_transfer(lv, live, block->instrs[i]);
+            if(live != lv.live_in[block->id]) {
+                lv.live_in[block->id] = live;
+                changed = true;
+            }
+        }
+    } while(changed);
+}
+
+static void mark_used(unordered_map<ir_value *, bool> &used,
+        ir_value *value)
+{
+    if(!value)
+        return;
+    used[value] = true;
+    if(value->kind == IRV_DEREF)
+        used[value->base] = true;
+}
+
+/* delete the blocks that can't be reached from the entry. A local
+ * declared in a deleted block may still be named by code that is
+ * kept (C lets a declaration be jumped over), so its declaration
+ * moves to the top of the function without the initializer. Returns
+ * the number of blocks deleted. */
+size_t ir_remove_unreachable(ir_function *fn)
+{
+    vector<bool> reached(fn->nr_blocks, false);
+    vector<ir_block *> work;
+    reached[fn->blocks[0]->id] = true;
+    work.push_back(fn->blocks[0]);
+    while(!work.empty()) {
+        ir_block *block = work.back();
+        work.pop_back();
+        int nr_succ = ir_nr_succ(block);
+        for(int s = 0;s < nr_succ;s++) {
+            if(!reached[block->succ[s]->id]) {
+                reached[block->succ[s]->id] = true;
+                work.push_back(block->succ[s]);
+            }
+        }
+    }
+
+    vector<ir_block *> kept, dead;
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        if(reached[fn->blocks[b]->id])
+            kept.push_back(fn->blocks[b]);
+        else
+            dead.push_back(fn->blocks[b]);
+    }
+    if(dead.empty())
+        return 0;
+
+    unordered_map<ir_value *, bool> used;
+    for(size_t b = 0;b < kept.size();b++) {
+        ir_block *block = kept[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            mark_used(used, instr->dest);
+            for(size_t arg = 0;arg < instr->args.size();arg++)
+                mark_used(used, instr->args[arg]);
+        }
+        mark_used(used, block->cond);
+        mark_used(used, block->retval);
+    }
+    vector<ir_instr *> hoisted;
+    for(size_t b = 0;b < dead.size();b++) {
+        ir_block *block = dead[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            if(instr->op == IR_DECL && used.count(instr->dest)) {
+                instr->args.clear();
+                hoisted.push_back(instr);
+            } else {
+                delete instr;
+            }
+        }
+        delete block;
+    }
+    ir_block *entry = kept[0];
+    entry->instrs.insert(entry->instrs.begin(), hoisted.begin(),
+            hoisted.end());
+    fn->blocks = kept;
+    return dead.size();
+}
+
+void ir_free_function(ir_function *fn)
+{
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++)
+            delete block->instrs[i];
+        delete block;
+    }
+    delete fn;
+}
+
+void ir_free(ir_module *mod)
+{
+    for(size_t i = 0;i < mod->structs.size();i++)
+        delete mod->structs[i];
+    for(size_t i = 0;i < mod->globals.size();i++)
+        delete mod->globals[i];
+    for(size_t i = 0;i < mod->functions.size();i++)
+        ir_free_function(mod->functions[i]);
+    ir_free_function(mod->main);
+    for(size_t i = 0;i < mod->values.size();i++)
+        delete mod->values[i];
+    delete mod;
+}
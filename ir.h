@@ -0,0 +1,197 @@
+#ifndef __IR_H
+#define __IR_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdio>
+#include "astree.h"
+#include "semantics.h"
+
+/* The intermediate representation sits between the typed AST and the
+ * oil printer. A module holds the structures, string constants,
+ * globals and functions of a program; the global statements become
+ * the body of __ocmain. A function is a list of basic blocks in the
+ * order they are printed, and each block is a list of three-address
+ * instructions closed by a terminator. */
+
+/* value kinds */
+enum {
+    IRV_REG,        /* virtual register: i5, b2, c7, p3, a9 */
+    IRV_DEREF,      /* the object an address register points at: (*a9) */
+    IRV_VAR,        /* a global, local or parameter */
+    IRV_CONST,      /* int, char, bool or null constant */
+    IRV_STRING,     /* string constant: s4 */
+};
+
+/* register categories, also used to type constants */
+enum { IR_INT, IR_BOOL, IR_CHAR, IR_PTR, IR_ADDR, IR_NR_CATEGORIES };
+extern const char *ir_category_names[IR_NR_CATEGORIES];
+
+struct ir_value {
+    int kind;
+    int category;       /* registers and constants */
+    size_t nr;          /* registers */
+    long cval;          /* constants */
+    string name;        /* as spelled in the oil, except for IRV_DEREF */
+    string type;        /* C type of registers and variables */
+    symbol *sym;        /* variables */
+    ir_value *base;     /* IRV_DEREF: the address register */
+};
+
+/* instructions. The result, if any, is dest. */
+enum {
+    IR_BINOP,       /* dest = args[0] op args[1] */
+    IR_UNOP,        /* dest = op args[0] */
+    IR_COPY,        /* dest = args[0] */
+    IR_DECL,        /* text [= args[0]], declaring the local dest */
+    IR_CALL,        /* [dest =] __text (args...) */
+    IR_INDEX,       /* dest = &args[0][args[1]] */
+    IR_FIELD,       /* dest = &args[0]->text */
+    IR_NEW,         /* dest = new struct s_text */
+    IR_NEWARRAY,    /* dest = new text[args[0]] */
+    IR_NEWSTRING,   /* dest = new char[args[0]] */
+    IR_NEWFRAME,    /* dest = zeroed text[args[0]] in the frame, for a
+                     * new whose object dies with the call */
+    IR_COUNT,       /* add one to profile counter args[0] */
+};
+
+struct ir_instr {
+    int op;
+    string opname;      /* operator spelling for IR_BINOP and IR_UNOP */
+    ir_value *dest;
+    vector<ir_value *> args;
+    string text;
+    astree *node;       /* the AST node it was lowered from */
+};
+
+/* terminators. A block that falls through or ends in a goto continues
+ * with succ[0]; the printer only writes the goto when that is not the
+ * next block in layout order. succ[0] is NULL when a block falls off
+ * the end of a function. A branch
+ * continues with succ[0] if cond is true and jumps to succ[1] if it
+ * is false, or, when succ[1] is the next block, jumps to succ[0] if
+ * cond is true and falls into succ[1]. */
+enum { IR_FALL, IR_GOTO, IR_BRANCH, IR_RETURN, IR_RETURNVOID };
+
+struct ir_block {
+    size_t id;
+    string label;       /* empty if nothing jumps here */
+    vector<ir_instr *> instrs;
+    int term;
+    ir_value *cond;     /* IR_BRANCH */
+    ir_value *retval;   /* IR_RETURN */
+    ir_block *succ[2];
+    /* IR_BRANCH: the last instruction compares into cond, which
+     * nothing else reads, so the compare and the jump can be one */
+    bool test_fused;
+    /* from -fprofile-use: how many times the block ran, or -1 if that
+     * isn't known, and for IR_BRANCH the successor it nearly always
+     * went on to, or -1 */
+    long count;
+    int likely;
+};
+
+struct ir_module;
+
+struct ir_function {
+    string decl;                /* return type and name */
+    string ret_type;
+    vector<string> param_decls;
+    vector<ir_value *> params;
+    vector<ir_block *> blocks;  /* layout order, blocks[0] is the entry */
+    size_t nr_blocks;           /* block ids are below this */
+    symbol *sym;                /* NULL for __ocmain */
+    astree *node;
+    ir_module *module;
+    /* after register allocation, the registers are declared at the
+     * top of the function instead of where they are defined */
+    vector<ir_value *> temps;
+    bool temps_declared;
+    /* -fprofile-generate: the counter of block id is first_counter
+     * + id */
+    size_t first_counter;
+};
+
+struct ir_struct {
+    string name;
+    vector<string> field_decls;
+    vector<string> field_types;     /* C types and mangled names */
+    vector<string> field_names;
+    astree *node;
+};
+
+struct ir_global {
+    string decl;
+    ir_value *var;
+};
+
+struct ir_module {
+    vector<ir_struct *> structs;
+    vector<const string *> strings;
+    vector<ir_global *> globals;
+    vector<ir_function *> functions;
+    ir_function *main;
+    /* every value, so the module can be freed */
+    vector<ir_value *> values;
+    size_t nr_counters;         /* 0 unless instrumented */
+};
+
+ir_module *ir_build(astree *root);
+void ir_free(ir_module *module);
+/* for a function taken out of its module. Its values belong to the
+ * module and are freed with it. */
+void ir_free_function(ir_function *function);
+
+string ir_value_name(ir_value *value);
+ir_value *ir_const(ir_module *module, int category, long cval);
+ir_value *ir_register(ir_module *module, int category, size_t nr,
+        const string &type);
+ir_block *ir_new_block(ir_function *function, const string &label);
+/* give block a label if it has none, for a jump that is added to it */
+void ir_need_label(ir_block *block);
+
+/* helpers for the passes in opt.cpp */
+typedef unordered_map<ir_value *, ir_value *> ir_value_map;
+void ir_replace_uses(ir_function *function, const ir_value_map &map);
+size_t ir_remove_unreachable(ir_function *function);
+int ir_nr_succ(ir_block *block);
+/* whether a branch is printed as a jump to succ[0] on true, because
+ * succ[1] follows it */
+bool ir_jump_if_true(ir_block *block, ir_block *next);
+void ir_reverse_postorder(ir_function *function,
+        vector<ir_block *> &order);
+void ir_dominators(ir_function *function, vector<ir_block *> &idom);
+
+/* a natural loop: the header and the blocks that reach a back edge to
+ * it without passing through it, in reverse postorder. ir_find_loops
+ * lists inner loops before the loops around them. */
+struct ir_loop {
+    ir_block *header;
+    vector<ir_block *> blocks;
+    unordered_map<ir_block *, bool> contains;
+};
+void ir_find_loops(ir_function *function, vector<ir_loop> &loops);
+ir_block *ir_loop_preheader(ir_function *function, ir_loop &loop,
+        vector<ir_loop> &loops);
+
+/* registers made by a pass: a number no register of the function has,
+ * and the category of a C type */
+size_t ir_next_register_nr(ir_function *function);
+int ir_type_category(const string &type);
+/* the comparison that is true when op is false: >= for < */
+string ir_inverse_compare(const string &op);
+
+/* which registers and locals are live at block boundaries. Values are
+ * numbered densely by index, and the sets are indexed by block id. */
+struct ir_liveness {
+    unordered_map<ir_value *, size_t> index;
+    vector<vector<bool>> live_in, live_out;
+};
+void ir_compute_liveness(ir_function *function, ir_liveness &lv);
+ir_value *ir_live_def(ir_instr *instr);
+void ir_live_use(ir_liveness &lv, vector<bool> &live, ir_value *value);
+void ir_live_transfer(ir_liveness &lv, vector<bool> &live,
+        ir_instr *instr);
+
+#endif
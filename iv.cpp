@@ -0,0 +1,335 @@
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+#include "opt.h"
+#include "ir.h"
+#include "semantics.h"
+using namespace std;
+
+/* Strength reduction of induction variables.
+ *
+ * A local assigned only by i = i + c (or i - c) inside a loop, for a
+ * constant c, is an induction variable. Only ones that count up are
+ * used. Every &a[i] in the loop with
+ * a base that doesn't change is then computed by a pointer instead:
+ * the preheader sets p = &a[i], p = &p[c] follows the step of i, and
+ * the index becomes a copy of p, or disappears if what reads it can
+ * read p. That is an add where there was a multiply and an add.
+ *
+ * If i is left with no use but its own step and the loop condition
+ * i < n (any comparison, n invariant), the condition becomes
+ * p < &a[n] and the step of i is deleted, so the loop keeps only the
+ * pointer. What is left of i goes with dead code elimination.
+ */
+
+static ir_module *module;
+static size_t next_reg;
+static size_t nr_pointers;
+
+/* where an induction variable steps */
+struct induction {
+    ir_value *var;
+    ir_instr *step;         /* var = r */
+    ir_instr *add;          /* r = var + c */
+    ir_block *block;        /* holding step */
+    long by;
+};
+
+static bool invariant(unordered_map<ir_value *, int> &defs, bool calls,
+        ir_value *value)
+{
+    switch(value->kind) {
+        case IRV_CONST: case IRV_STRING:
+            return true;
+        case IRV_REG: case IRV_VAR:
+            if(defs.count(value))
+                return false;
+            return value->kind == IRV_REG
+                || value->sym->block_nr != SCOPE_GLOBAL || !calls;
+    }
+    return false;
+}
+
+/* how often each value is read in the function */
+static void count_uses(ir_function *fn,
+        unordered_map<ir_value *, int> &uses)
+{
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            for(size_t arg = 0;arg < instr->args.size();arg++) {
+                ir_value *value = instr->args[arg];
+                uses[value]++;
+                if(value->kind == IRV_DEREF)
+                    uses[value->base]++;
+            }
+            if(instr->dest && instr->dest->kind == IRV_DEREF)
+                uses[instr->dest->base]++;
+        }
+        if(block->cond)
+            uses[block->cond]++;
+        if(block->retval)
+            uses[block->retval]++;
+    }
+}
+
+static ir_instr *new_instr(int op, ir_instr *like, ir_value *dest)
+{
+    ir_instr *instr = new ir_instr();
+    instr->op = op;
+    instr->node = like->node;
+    instr->dest = dest;
+    return instr;
+}
+
+static ir_value *new_register(const string &type)
+{
+    return ir_register(module, ir_type_category(type), next_reg++, type);
+}
+
+static ir_instr *index_instr(ir_instr *like, ir_value *base,
+        ir_value *at)
+{
+    ir_instr *instr = new_instr(IR_INDEX, like,
+            new_register(like->dest->type));
+    instr->args.push_back(base);
+    instr->args.push_back(at);
+    return instr;
+}
+
+/* insert after the step of the induction variable */
+static void after_step(induction &iv, ir_instr *instr, size_t &extra)
+{
+    vector<ir_instr *> &instrs = iv.block->instrs;
+    for(size_t i = 0;i < instrs.size();i++) {
+        if(instrs[i] == iv.step) {
+            instrs.insert(instrs.begin() + i + 1 + extra, instr);
+            extra++;
+            return;
+        }
+    }
+}
+
+static void find_inductions(ir_loop &l, vector<induction> &ivs,
+        unordered_map<ir_value *, int> &defs, bool &calls)
+{
+    unordered_map<ir_value *, ir_instr *> def_instr;
+    calls = false;
+    for(size_t b = 0;b < l.blocks.size();b++) {
+        ir_block *block = l.blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            if(instr->op == IR_CALL)
+                calls = true;
+            if(!instr->dest || instr->dest->kind == IRV_DEREF)
+                continue;
+            defs[instr->dest]++;
+            def_instr[instr->dest] = instr;
+        }
+    }
+    /* in layout order, so the output doesn't depend on addresses */
+    for(size_t b = 0;b < l.blocks.size();b++) {
+        ir_block *block = l.blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *step = block->instrs[i];
+            ir_value *var = step->dest;
+            if(step->op != IR_COPY || var->kind != IRV_VAR
+                    || var->sym->block_nr == SCOPE_GLOBAL
+                    || defs[var] != 1
+                    || step->args[0]->kind != IRV_REG
+                    || !def_instr.count(step->args[0]))
+                continue;
+            ir_instr *add = def_instr[step->args[0]];
+            if(add->op != IR_BINOP)
+                continue;
+            ir_value *x = add->args[0], *y = add->args[1];
+            induction iv = { var, step, add, block, 0 };
+            if(add->opname == "+" && x == var && y->kind == IRV_CONST)
+                iv.by = y->cval;
+            else if(add->opname == "+" && y == var
+                    && x->kind == IRV_CONST)
+                iv.by = x->cval;
+            else if(add->opname == "-" && x == var
+                    && y->kind == IRV_CONST)
+                iv.by = -y->cval;
+            /* a pointer stepping down ends up before the array,
+             * which C doesn't allow */
+            if(iv.by > 0)
+                ivs.push_back(iv);
+        }
+    }
+}
+
+/* the comparison of the header's branch, if it tests iv against an
+ * invariant and nothing else reads it */
+static ir_instr *exit_test(ir_loop &l, induction &iv,
+        unordered_map<ir_value *, int> &defs, bool calls,
+        unordered_map<ir_value *, int> &uses, size_t &bound)
+{
+    ir_block *header = l.header;
+    if(header->term != IR_BRANCH || uses[header->cond] != 1)
+        return NULL;
+    for(size_t i = 0;i < header->instrs.size();i++) {
+        ir_instr *instr = header->instrs[i];
+        if(instr->dest != header->cond || instr->op != IR_BINOP)
+            continue;
+        const string &op = instr->opname;
+        if(op != "<" && op != "<=" && op != ">" && op != ">="
+                && op != "==" && op != "!=")
+            return NULL;
+        for(size_t side = 0;side < 2;side++) {
+            if(instr->args[side] == iv.var
+                    && invariant(defs, calls, instr->args[1 - side])) {
+                bound = 1 - side;
+                return instr;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int occurrences(ir_instr *instr, ir_value *value)
+{
+    int found = 0;
+    for(size_t arg = 0;arg < instr->args.size();arg++) {
+        ir_value *a = instr->args[arg];
+        if(a == value || (a->kind == IRV_DEREF && a->base == value))
+            found++;
+    }
+    if(instr->dest && instr->dest->kind == IRV_DEREF
+            && instr->dest->base == value)
+        found++;
+    return found;
+}
+
+/* An index that became a = p is read through a, while p goes on to
+ * step. If every use of a comes before p steps, in the same block,
+ * they can read p itself and the copy goes with dead code. */
+static void forward_pointers(ir_function *fn, vector<ir_instr *> &copies,
+        vector<ir_block *> &blocks,
+        unordered_map<ir_value *, ir_instr *> &steps)
+{
+    unordered_map<ir_value *, int> uses;
+    count_uses(fn, uses);
+    ir_value_map forward;
+    for(size_t c = 0;c < copies.size();c++) {
+        ir_value *a = copies[c]->dest, *p = copies[c]->args[0];
+        vector<ir_instr *> &instrs = blocks[c]->instrs;
+        size_t i = find(instrs.begin(), instrs.end(), copies[c])
+            - instrs.begin();
+        int seen = 0;
+        for(i++;i < instrs.size() && instrs[i] != steps[p];i++)
+            seen += occurrences(instrs[i], a);
+        if(seen == uses[a])
+            forward[a] = p;
+    }
+    ir_replace_uses(fn, forward);
+}
+
+static int reduce_loop(ir_function *fn, ir_loop &l,
+        vector<ir_loop> &loops)
+{
+    vector<induction> ivs;
+    unordered_map<ir_value *, int> defs;
+    bool calls;
+    find_inductions(l, ivs, defs, calls);
+    int reduced = 0;
+    vector<ir_instr *> copies;
+    vector<ir_block *> copy_blocks;
+    unordered_map<ir_value *, ir_instr *> steps;
+    for(size_t v = 0;v < ivs.size();v++) {
+        induction &iv = ivs[v];
+        /* one pointer for every base indexed by the variable */
+        unordered_map<ir_value *, ir_value *> pointers;
+        ir_value *first_base = NULL;
+        ir_instr *first_index = NULL;
+        size_t extra = 0;
+        for(size_t b = 0;b < l.blocks.size();b++) {
+            ir_block *block = l.blocks[b];
+            for(size_t i = 0;i < block->instrs.size();i++) {
+                ir_instr *instr = block->instrs[i];
+                if(instr->op != IR_INDEX || instr->args[1] != iv.var
+                        || !invariant(defs, calls, instr->args[0]))
+                    continue;
+                ir_value *base = instr->args[0];
+                ir_value *&p = pointers[base];
+                if(!p) {
+                    ir_block *pre = ir_loop_preheader(fn, l, loops);
+                    p = new ir_value();
+                    p->kind = IRV_VAR;
+                    p->type = instr->dest->type;
+                    p->name = "_iv" + to_string(++nr_pointers);
+                    p->sym = iv.var->sym;
+                    module->values.push_back(p);
+                    ir_instr *start = index_instr(instr, base, iv.var);
+                    ir_instr *decl = new_instr(IR_DECL, instr, p);
+                    decl->text = p->type + " " + p->name;
+                    decl->args.push_back(start->dest);
+                    pre->instrs.push_back(start);
+                    pre->instrs.push_back(decl);
+                    ir_instr *next = index_instr(instr, p,
+                            ir_const(module, IR_INT, iv.by));
+                    ir_instr *set = new_instr(IR_COPY, instr, p);
+                    set->args.push_back(next->dest);
+                    after_step(iv, next, extra);
+                    after_step(iv, set, extra);
+                    steps[p] = set;
+                    if(!first_base) {
+                        first_base = base;
+                        first_index = instr;
+                    }
+                }
+                instr->op = IR_COPY;
+                instr->args.assign(1, p);
+                copies.push_back(instr);
+                copy_blocks.push_back(block);
+                reduced++;
+            }
+        }
+        if(!first_base)
+            continue;
+
+        /* replace the exit test if, apart from the step and the
+         * starting values of the pointers, it is the last use of iv */
+        unordered_map<ir_value *, int> uses;
+        count_uses(fn, uses);
+        size_t bound;
+        ir_instr *test = exit_test(l, iv, defs, calls, uses, bound);
+        if(!test || uses[iv.add->dest] != 1
+                || (size_t)uses[iv.var] != 2 + pointers.size())
+            continue;
+        ir_block *pre = ir_loop_preheader(fn, l, loops);
+        ir_instr *end = index_instr(first_index, first_base,
+                test->args[bound]);
+        pre->instrs.push_back(end);
+        test->args[bound] = end->dest;
+        test->args[1 - bound] = pointers[first_base];
+        /* the step goes; the add it read is then dead */
+        vector<ir_instr *> &instrs = iv.block->instrs;
+        for(size_t i = 0;i < instrs.size();i++) {
+            if(instrs[i] == iv.step) {
+                instrs.erase(instrs.begin() + i);
+                delete iv.step;
+                break;
+            }
+        }
+    }
+    forward_pointers(fn, copies, copy_blocks, steps);
+    return reduced;
+}
+
+int opt_reduce_strength(ir_function *fn)
+{
+    module = fn->module;
+    next_reg = ir_next_register_nr(fn);
+    nr_pointers = 0;
+    vector<ir_loop> loops;
+    ir_find_loops(fn, loops);
+    int reduced = 0;
+    for(size_t l = 0;l < loops.size();l++)
+        reduced += reduce_loop(fn, loops[l], loops);
+    return reduced;
+}
@@ -0,0 +1,143 @@
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "oc.h"
+#include "ir.h"
+#include "x86.h"
+#include "opt.h"
+#include "emit.h"
+using namespace std;
+
+/* oc --run: compile to machine code in memory and call it.
+ *
+ * The program is assembled into an x86_image (see x86asm.cpp) and
+ * placed in one anonymous mapping: the text, then the string
+ * constants, then the globals, each starting on a page of its own.
+ * The runtime is oclib.c itself, linked into the compiler without its
+ * main; calls to it go through a stub at the end of the text that
+ * jumps to the absolute address, since the mapping can be anywhere
+ * relative to the compiler. Nothing is written to disk.
+ */
+
+extern "C" {
+#define __OCLIB_C__
+#include "oclib.oh"
+extern char **oc_argv;
+void ____assert_fail(char *expr, char *file, int line);
+}
+
+static const struct {
+    const char *name;
+    void *address;
+} runtime[] = {
+    { "xcalloc", (void *)xcalloc },
+    { "____assert_fail", (void *)____assert_fail },
+    { "__putb", (void *)__putb },
+    { "__putc", (void *)__putc },
+    { "__puti", (void *)__puti },
+    { "__puts", (void *)__puts },
+    { "__endl", (void *)__endl },
+    { "__getc", (void *)__getc },
+    { "__getw", (void *)__getw },
+    { "__getln", (void *)__getln },
+    { "__getargv", (void *)__getargv },
+    { "__exit", (void *)__exit },
+};
+
+static void *runtime_address(const string &name)
+{
+    for(size_t r = 0;r < sizeof(runtime) / sizeof(runtime[0]);r++) {
+        if(name == runtime[r].name)
+            return runtime[r].address;
+    }
+    return NULL;
+}
+
+/* define every symbol the program uses but doesn't define as a stub
+ * that does jmp *address(%rip). Returns nonzero if one isn't part of
+ * the runtime. */
+static int link_runtime(x86_image &image)
+{
+    int errors = 0;
+    for(size_t f = 0;f < image.fixups.size();f++) {
+        const string &sym = image.fixups[f].sym;
+        if(image.symbols.count(sym))
+            continue;
+        void *address = runtime_address(sym);
+        if(!address) {
+            oc_errprintf("undefined reference to '%s'\n", sym.c_str());
+            errors++;
+            continue;
+        }
+        x86_symbol stub = { X86_TEXT, image.text.size() };
+        image.symbols[sym] = stub;
+        static const unsigned char jmp[] = { 0xff, 0x25, 0, 0, 0, 0 };
+        image.text.insert(image.text.end(), jmp, jmp + sizeof(jmp));
+        unsigned char bytes[8];
+        memcpy(bytes, &address, sizeof(bytes));
+        image.text.insert(image.text.end(), bytes, bytes + 8);
+    }
+    return errors;
+}
+
+static size_t page_round(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+int oc_run_jit(astree *root, char **argv)
+{
+    ir_module *module = ir_build(root);
+    opt_run(module);
+    x86_image image;
+    x86_assemble_image(&image);
+    x86_generate(module);
+    ir_free(module);
+    if(link_runtime(image))
+        return 1;
+
+    size_t text_size = page_round(image.text.size());
+    size_t rodata_size = page_round(image.rodata.size());
+    size_t size = text_size + rodata_size + page_round(image.bss_size);
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mapping == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    unsigned char *text = (unsigned char *)mapping;
+    unsigned char *sections[3] = {
+        text, text + text_size, text + text_size + rodata_size
+    };
+    memcpy(sections[X86_TEXT], image.text.data(), image.text.size());
+    memcpy(sections[X86_RODATA], image.rodata.data(),
+            image.rodata.size());
+    for(size_t f = 0;f < image.fixups.size();f++) {
+        x86_fixup &fixup = image.fixups[f];
+        x86_symbol &sym = image.symbols[fixup.sym];
+        int32_t disp = sections[sym.section] + sym.offset + fixup.addend
+            - (text + fixup.offset);
+        memcpy(text + fixup.offset, &disp, sizeof(disp));
+    }
+    if(mprotect(text, text_size, PROT_READ | PROT_EXEC)
+            || (rodata_size && mprotect(sections[X86_RODATA],
+                    rodata_size, PROT_READ))) {
+        perror("mprotect");
+        munmap(mapping, size);
+        return 1;
+    }
+
+    oc_argv = argv;
+    void (*ocmain)(void) =
+        (void (*)(void))(text + image.symbols["__ocmain"].offset);
+    ocmain();
+    fflush(NULL);
+    munmap(mapping, size);
+    return 0;
+}
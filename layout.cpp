@@ -0,0 +1,291 @@
+#include <vector>
+#include <unordered_set>
+#include <algorithm>
+
+#include "opt.h"
+#include "ir.h"
+using namespace std;
+
+/* Block layout.
+ *
+ * Blocks are lowered in source order, so a while loop is its test, its
+ * body and a goto back up to the test, and every iteration jumps twice.
+ * This pass orders the blocks so that the edges taken most often are
+ * the ones that fall through.
+ *
+ * Every block starts out as a chain of its own. Going from the most
+ * frequent edge down, an edge from the last block of one chain to the
+ * first block of another joins the two. Frequencies come from the
+ * profile where there is one. Otherwise every loop is guessed to run
+ * LOOP_WEIGHT times, a branch out of a loop to be taken on the last of
+ * them, and any other branch to go either way as often. Of edges
+ * that are as frequent, back edges go first and edges from a loop
+ * header into its loop last. Among the rest, the edges that already
+ * fell through go first, so that without a reason to move anything the
+ * layout stays as it was lowered.
+ *
+ * The edges around a loop run about as often, so that order closes the
+ * chain of the loop at the edge from its test into its body: the test
+ * ends up below the body, and is jumped to once on the way into the
+ * loop. Each iteration then takes the one jump from the test back up to
+ * the body, instead of a jump up to the test and one out of the loop.
+ *
+ * The chains are placed in the order their first blocks were, which
+ * keeps the entry first. A block that falls off the end of the function
+ * has nothing after it, so its chain goes last, or only the block if
+ * that chain is the entry's.
+ *
+ * Once blocks have moved, a use of a local may come before its
+ * declaration in the oil, so every local is declared in the entry and
+ * declarations elsewhere become copies.
+ */
+
+#define LOOP_WEIGHT 10
+/* percent of the runs of a likely branch that go the likely way */
+#define LAYOUT_LIKELY 90
+
+struct layout_edge {
+    ir_block *from, *to;
+    double weight;
+    bool back;      /* from inside a loop to its header */
+    bool to_body;   /* from a loop header into its loop */
+    bool falls;     /* to the block after from, as lowered */
+    size_t order;
+};
+
+static bool heavier(const layout_edge &a, const layout_edge &b)
+{
+    if(a.weight != b.weight)
+        return a.weight > b.weight;
+    if(a.back != b.back)
+        return a.back;
+    if(a.to_body != b.to_body)
+        return b.to_body;
+    if(a.falls != b.falls)
+        return a.falls;
+    return a.order < b.order;
+}
+
+/* the innermost loop each block is in, or -1. ir_find_loops lists
+ * inner loops first. */
+static void innermost_loops(ir_function *fn, vector<ir_loop> &loops,
+        vector<int> &inner)
+{
+    inner.assign(fn->nr_blocks, -1);
+    for(size_t l = loops.size();l-- > 0;) {
+        for(size_t b = 0;b < loops[l].blocks.size();b++)
+            inner[loops[l].blocks[b]->id] = l;
+    }
+}
+
+/* percent of the runs of block that go on to succ[s]. Without a
+ * profile, a branch out of a loop is guessed to be taken once every
+ * LOOP_WEIGHT times, and any other branch half of the time. */
+static int edge_percent(ir_block *block, int s, vector<ir_loop> &loops,
+        vector<int> &inner)
+{
+    if(block->term != IR_BRANCH)
+        return 100;
+    if(block->likely >= 0)
+        return block->likely == s ? LAYOUT_LIKELY : 100 - LAYOUT_LIKELY;
+    int l = inner[block->id];
+    if(l < 0 || loops[l].contains.count(block->succ[0])
+            == loops[l].contains.count(block->succ[1]))
+        return 50;
+    bool stays = loops[l].contains.count(block->succ[s]);
+    return stays ? 100 - 100 / LOOP_WEIGHT : 100 / LOOP_WEIGHT;
+}
+
+static bool back_edge(vector<ir_loop> &loops, ir_block *from,
+        ir_block *to)
+{
+    for(size_t l = 0;l < loops.size();l++) {
+        if(loops[l].header == to && loops[l].contains.count(from))
+            return true;
+    }
+    return false;
+}
+
+/* how often each block runs: its count if the profile has one, and
+ * otherwise a guess that follows the edges from the entry, in which
+ * every loop runs LOOP_WEIGHT times each time it is entered */
+static void guess_frequencies(ir_function *fn, vector<ir_loop> &loops,
+        vector<int> &inner, vector<double> &freq)
+{
+    vector<ir_block *> order;
+    ir_reverse_postorder(fn, order);
+    freq.assign(fn->nr_blocks, 0);
+    vector<double> entered(fn->nr_blocks, 0);
+    freq[fn->blocks[0]->id] = 1;
+    for(size_t b = 0;b < order.size();b++) {
+        ir_block *block = order[b];
+        int l = inner[block->id];
+        if(l >= 0 && loops[l].header == block) {
+            entered[block->id] = freq[block->id];
+            freq[block->id] *= LOOP_WEIGHT;
+        }
+        for(int s = 0;s < ir_nr_succ(block);s++) {
+            ir_block *succ = block->succ[s];
+            if(back_edge(loops, block, succ))
+                continue;
+            /* what comes after a loop runs as often as the loop was
+             * entered. Loops are listed inner first, so the last one
+             * left is the outermost. */
+            int left = -1;
+            for(size_t k = 0;k < loops.size();k++) {
+                if(loops[k].contains.count(block)
+                        && !loops[k].contains.count(succ))
+                    left = k;
+            }
+            if(left >= 0)
+                freq[succ->id] += entered[loops[left].header->id];
+            else
+                freq[succ->id] += freq[block->id]
+                    * edge_percent(block, s, loops, inner) / 100;
+        }
+    }
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        if(block->count >= 0)
+            freq[block->id] = block->count;
+    }
+}
+
+static void find_edges(ir_function *fn, vector<ir_loop> &loops,
+        vector<layout_edge> &edges)
+{
+    vector<int> inner;
+    innermost_loops(fn, loops, inner);
+    vector<double> freq;
+    guess_frequencies(fn, loops, inner, freq);
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        ir_block *next = b + 1 < fn->blocks.size() ? fn->blocks[b + 1]
+            : NULL;
+        for(int s = 0;s < ir_nr_succ(block);s++) {
+            layout_edge edge;
+            edge.from = block;
+            edge.to = block->succ[s];
+            edge.weight = freq[block->id]
+                * edge_percent(block, s, loops, inner) / 100;
+            edge.back = back_edge(loops, block, edge.to);
+            edge.to_body = false;
+            for(size_t l = 0;l < loops.size();l++) {
+                if(loops[l].header == block
+                        && loops[l].contains.count(edge.to))
+                    edge.to_body = true;
+            }
+            edge.falls = edge.to == next;
+            edge.order = edges.size();
+            edges.push_back(edge);
+        }
+    }
+}
+
+static void declare_at_entry(ir_function *fn)
+{
+    unordered_set<ir_value *> declared;
+    vector<ir_instr *> decls;
+    ir_block *entry = fn->blocks[0];
+    for(size_t i = 0;i < entry->instrs.size();i++) {
+        if(entry->instrs[i]->op == IR_DECL)
+            declared.insert(entry->instrs[i]->dest);
+    }
+    for(size_t b = 1;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        vector<ir_instr *> kept;
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            if(instr->op != IR_DECL) {
+                kept.push_back(instr);
+                continue;
+            }
+            if(declared.insert(instr->dest).second) {
+                ir_instr *decl = new ir_instr(*instr);
+                decl->args.clear();
+                decls.push_back(decl);
+            }
+            if(instr->args.empty()) {
+                delete instr;
+                continue;
+            }
+            instr->op = IR_COPY;
+            instr->text.clear();
+            kept.push_back(instr);
+        }
+        block->instrs = kept;
+    }
+    entry->instrs.insert(entry->instrs.begin(), decls.begin(),
+            decls.end());
+}
+
+int opt_layout_blocks(ir_function *fn)
+{
+    if(fn->blocks.size() < 3)
+        return 0;
+    vector<ir_loop> loops;
+    ir_find_loops(fn, loops);
+    vector<layout_edge> edges;
+    find_edges(fn, loops, edges);
+    sort(edges.begin(), edges.end(), heavier);
+
+    /* chain[id] is the chain block id is in; chains start as one block
+     * each, in layout order */
+    vector<vector<ir_block *>> chains(fn->blocks.size());
+    vector<size_t> chain(fn->nr_blocks);
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        chains[b].push_back(fn->blocks[b]);
+        chain[fn->blocks[b]->id] = b;
+    }
+    ir_block *entry = fn->blocks[0];
+    for(size_t e = 0;e < edges.size();e++) {
+        size_t from = chain[edges[e].from->id];
+        size_t to = chain[edges[e].to->id];
+        if(from == to || chains[from].back() != edges[e].from
+                || chains[to].front() != edges[e].to
+                || edges[e].to == entry)
+            continue;
+        for(size_t b = 0;b < chains[to].size();b++) {
+            chains[from].push_back(chains[to][b]);
+            chain[chains[to][b]->id] = from;
+        }
+        chains[to].clear();
+    }
+
+    /* the chains were numbered by where their first blocks were */
+    vector<ir_block *> blocks, last;
+    for(size_t c = 0;c < chains.size();c++) {
+        vector<ir_block *> &ch = chains[c];
+        if(ch.empty())
+            continue;
+        ir_block *tail = ch.back();
+        if(tail->term == IR_FALL && !tail->succ[0]) {
+            if(c > 0) {
+                last = ch;
+                continue;
+            }
+            if(ch.size() > 1) {
+                last.push_back(tail);
+                ch.pop_back();
+            }
+        }
+        blocks.insert(blocks.end(), ch.begin(), ch.end());
+    }
+    blocks.insert(blocks.end(), last.begin(), last.end());
+    if(blocks == fn->blocks)
+        return 0;
+    fn->blocks = blocks;
+    declare_at_entry(fn);
+
+    /* what fell into a block that moved now jumps there */
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        ir_block *next = b + 1 < fn->blocks.size() ? fn->blocks[b + 1]
+            : NULL;
+        for(int s = 0;s < ir_nr_succ(block);s++) {
+            if(block->succ[s] != next)
+                ir_need_label(block->succ[s]);
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,210 @@
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "opt.h"
+#include "ir.h"
+#include "semantics.h"
+using namespace std;
+
+/* Loop-invariant code motion.
+ *
+ * A loop is found from its back edges: an edge to a block that
+ * dominates its source. The loop is the header and every block that
+ * reaches the source without passing through the header; for a while
+ * loop that is the condition and the body.
+ *
+ * An instruction computing a register from operands that keep their
+ * value for the whole loop computes the same thing on every iteration,
+ * so it moves to the loop's preheader, the block that every entry
+ * into the loop from outside goes through on its way to the header
+ * (see ir_loop_preheader). Registers are assigned once, so moving the
+ * definition up can't change what any other instruction reads.
+ *
+ * An operand is invariant if it is a constant, a register defined
+ * outside the loop or by a moved instruction, or a variable the loop
+ * doesn't assign. Globals also need a loop without calls.
+ *
+ * Hoisted code runs even when the loop body wouldn't, so only what
+ * can't trap moves out of the body: arithmetic other than division
+ * and address computations. A load through an address only moves
+ * out of the header, which runs whenever the preheader does, and only
+ * if the loop makes no calls and stores nothing to an object of the
+ * same type, which is all that could change it. Loads are operands
+ * rather than instructions, so a hoisted load gets a register of its
+ * own that the header reads instead.
+ *
+ * Inner loops are done first, so what they hoist into their preheader
+ * can move further out with the next loop.
+ */
+
+/* what the loop writes */
+struct loop_effects {
+    bool calls;
+    unordered_set<ir_value *> vars;
+    unordered_set<string> objects;
+};
+
+/* the type of the object behind an address register */
+static string object_type(ir_value *deref)
+{
+    const string &type = deref->base->type;
+    return type.substr(0, type.size() - 1);
+}
+
+static bool may_trap(ir_instr *instr)
+{
+    if(instr->op != IR_BINOP)
+        return false;
+    if(instr->opname != "/" && instr->opname != "%")
+        return false;
+    ir_value *divisor = instr->args[1];
+    return divisor->kind != IRV_CONST || divisor->cval == 0
+        || divisor->cval == -1;
+}
+
+static void find_effects(ir_loop &l, loop_effects &effects)
+{
+    effects.calls = false;
+    for(size_t b = 0;b < l.blocks.size();b++) {
+        ir_block *block = l.blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            if(instr->op == IR_CALL)
+                effects.calls = true;
+            if(!instr->dest)
+                continue;
+            if(instr->dest->kind == IRV_VAR)
+                effects.vars.insert(instr->dest);
+            else if(instr->dest->kind == IRV_DEREF)
+                effects.objects.insert(object_type(instr->dest));
+        }
+    }
+}
+
+static bool invariant(loop_effects &effects,
+        unordered_set<ir_value *> &defined, ir_value *value,
+        bool in_header)
+{
+    switch(value->kind) {
+        case IRV_CONST: case IRV_STRING:
+            return true;
+        case IRV_REG:
+            return !defined.count(value);
+        case IRV_VAR:
+            if(effects.vars.count(value))
+                return false;
+            return value->sym->block_nr != SCOPE_GLOBAL
+                || !effects.calls;
+        case IRV_DEREF:
+            return in_header && !effects.calls
+                && !effects.objects.count(object_type(value))
+                && invariant(effects, defined, value->base, in_header);
+    }
+    return false;
+}
+
+static bool hoistable(loop_effects &effects,
+        unordered_set<ir_value *> &defined, ir_instr *instr,
+        bool in_header)
+{
+    switch(instr->op) {
+        case IR_BINOP: case IR_UNOP: case IR_COPY:
+        case IR_INDEX: case IR_FIELD:
+            break;
+        default:
+            return false;
+    }
+    if(!instr->dest || instr->dest->kind != IRV_REG || may_trap(instr))
+        return false;
+    for(size_t arg = 0;arg < instr->args.size();arg++) {
+        if(!invariant(effects, defined, instr->args[arg], in_header))
+            return false;
+    }
+    return true;
+}
+
+static size_t next_reg;
+
+static int hoist_loop(ir_function *fn, ir_loop &l,
+        vector<ir_loop> &loops)
+{
+    loop_effects effects;
+    find_effects(l, effects);
+    unordered_set<ir_value *> defined;
+    for(size_t b = 0;b < l.blocks.size();b++) {
+        ir_block *block = l.blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            if(instr->dest && instr->dest->kind == IRV_REG)
+                defined.insert(instr->dest);
+        }
+    }
+
+    /* blocks are in reverse postorder, so most definitions are seen
+     * before their uses; loop for the rest */
+    vector<ir_instr *> hoisted;
+    bool changed;
+    do {
+        changed = false;
+        for(size_t b = 0;b < l.blocks.size();b++) {
+            ir_block *block = l.blocks[b];
+            bool in_header = block == l.header;
+            vector<ir_instr *> kept;
+            for(size_t i = 0;i < block->instrs.size();i++) {
+                ir_instr *instr = block->instrs[i];
+                if(hoistable(effects, defined, instr, in_header)) {
+                    defined.erase(instr->dest);
+                    hoisted.push_back(instr);
+                    changed = true;
+                } else {
+                    kept.push_back(instr);
+                }
+            }
+            block->instrs = kept;
+        }
+    } while(changed);
+
+    /* loads the header repeats, in instructions that stay */
+    unordered_map<ir_value *, ir_value *> loaded;
+    for(size_t i = 0;i < l.header->instrs.size();i++) {
+        ir_instr *instr = l.header->instrs[i];
+        for(size_t arg = 0;arg < instr->args.size();arg++) {
+            ir_value *value = instr->args[arg];
+            if(value->kind != IRV_DEREF
+                    || !invariant(effects, defined, value, true))
+                continue;
+            ir_value *&reg = loaded[value->base];
+            if(!reg) {
+                string type = object_type(value);
+                reg = ir_register(fn->module, ir_type_category(type),
+                        next_reg++, type);
+                ir_instr *load = new ir_instr();
+                load->op = IR_COPY;
+                load->node = instr->node;
+                load->dest = reg;
+                load->args.push_back(value);
+                hoisted.push_back(load);
+            }
+            instr->args[arg] = reg;
+        }
+    }
+
+    if(hoisted.empty())
+        return 0;
+    ir_block *pre = ir_loop_preheader(fn, l, loops);
+    pre->instrs.insert(pre->instrs.end(), hoisted.begin(), hoisted.end());
+    return hoisted.size();
+}
+
+int opt_hoist_invariants(ir_function *fn)
+{
+    vector<ir_loop> loops;
+    ir_find_loops(fn, loops);
+    next_reg = ir_next_register_nr(fn);
+    int hoisted = 0;
+    for(size_t l = 0;l < loops.size();l++)
+        hoisted += hoist_loop(fn, loops[l], loops);
+    return hoisted;
+}
@@ -16,6 +16,8 @@ using namespace std;
 #include "auxlib.h"
 #include "semantics.h"
 #include "emit.h"
+#include "diag.h"
+#include "opt.h"
 
 char *progname = NULL;
 
@@ -29,8 +31,13 @@ extern int yy_flex_debug, yydebug;
 
 void usage()
 {
-    fprintf(stderr, "usage: %s [-D <define>] [-yl] <source file>\n",
-            progname);
+    fprintf(stderr, "usage: %s [-D <define>] [-ylmiS] [-O<level>]"
+            " [-ferror-limit=<n>]\n"
+            "       [-fprofile-generate[=<file>]]"
+            " [-fprofile-use[=<file>]] <source file>\n"
+            "       %s --run|--interp [options] <source file>"
+            " [arguments]\n",
+            progname, progname);
     exit(0);
 }
 
@@ -41,8 +48,28 @@ int main (int argc, char** argv) {
     yy_flex_debug = 0;
 
     int c;
+    bool memstats = false;
+    bool native = false;
+    bool run = false;
+    bool interp = false;
+    /* -fprofile-generate and -fprofile-use without a file name use
+     * the name of the program with .prof */
+    bool profile_default_generate = false, profile_default_use = false;
+    static struct option long_options[] = {
+        { "run", no_argument, NULL, 'r' },
+        { "interp", no_argument, NULL, 'x' },
+        { NULL, 0, NULL, 0 },
+    };
+    /* with --run or --interp, everything after the source file is
+     * passed to the program instead of being parsed here */
+    const char *optstring = "D:h@lymiSf:O:";
+    for(int i = 1;i < argc;i++) {
+        if(!strcmp(argv[i], "--run") || !strcmp(argv[i], "--interp"))
+            optstring = "+D:h@lymiSf:O:";
+    }
     /* holy... */
-    while((c = getopt(argc, argv, "D:h@ly")) != -1) {
+    while((c = getopt_long(argc, argv, optstring, long_options, NULL))
+            != -1) {
         switch(c) {
             case 'D':
                 defines.push_back(string(optarg));
@@ -58,6 +85,45 @@ int main (int argc, char** argv) {
             case 'y':
                 yydebug = 1;
                 break;
+            case 'm':
+                memstats = true;
+                break;
+            /* incremental check: only re-analyze what changed since
+             * the last run, and don't generate code */
+            case 'i':
+                semcache_incremental = true;
+                break;
+            case 'f':
+                if(!strncmp(optarg, "error-limit=", 12)) {
+                    diag_error_limit = atol(optarg + 12);
+                } else if(!strcmp(optarg, "profile-generate")) {
+                    profile_default_generate = true;
+                } else if(!strncmp(optarg, "profile-generate=", 17)) {
+                    profile_generate = optarg + 17;
+                } else if(!strcmp(optarg, "profile-use")) {
+                    profile_default_use = true;
+                } else if(!strncmp(optarg, "profile-use=", 12)) {
+                    profile_use = optarg + 12;
+                } else {
+                    oc_errprintf("unknown option -f%s\n", optarg);
+                    return 1;
+                }
+                break;
+            /* x86-64 assembly instead of oil */
+            case 'S':
+                native = true;
+                break;
+            case 'O':
+                opt_level = atoi(optarg);
+                break;
+            /* compile into memory and run it, writing no files */
+            case 'r':
+                run = true;
+                break;
+            /* the same, but interpret bytecode instead */
+            case 'x':
+                run = interp = true;
+                break;
         }
     }
 
@@ -66,7 +132,7 @@ int main (int argc, char** argv) {
         oc_errprintf("no program file specified\n");
         return 1;
     }
-    if(optind + 1 < argc) {
+    if(optind + 1 < argc && !run) {
         oc_errprintf("multiple program files is not supported\n");
         return 1;
     }
@@ -88,7 +154,22 @@ int main (int argc, char** argv) {
     string tokoutfile = filename + ".tok";
     string astoutfile = filename + ".ast";
     string symoutfile = filename + ".sym";
-    string oiloutfile = filename + ".oil";
+    string oiloutfile = filename + (native ? ".s" : ".oil");
+    string semoutfile = filename + ".sem";
+    if(run) {
+        stroutfile = tokoutfile = astoutfile = "/dev/null";
+        symoutfile = semoutfile = "/dev/null";
+    }
+    string profoutfile = filename + ".prof";
+    if(profile_default_generate)
+        profile_generate = profoutfile.c_str();
+    if(profile_default_use)
+        profile_use = profoutfile.c_str();
+    /* the counters are only written out by oclib.c */
+    if(profile_generate && (native || run)) {
+        oc_errprintf("-fprofile-generate only works for oil output\n");
+        return 1;
+    }
 
     /* test for access to input file.
      * Yeah, we could call access(), but I'm lazy. */
@@ -143,23 +224,40 @@ int main (int argc, char** argv) {
         return 1;
     }
     
-    FILE *oilfile = fopen(oiloutfile.c_str(), "w");
-    if(!oilfile) {
-        perror("failed to open output file\n");
-        return 1;
+    FILE *oilfile = NULL;
+    if(!semcache_incremental && !run) {
+        oilfile = fopen(oiloutfile.c_str(), "w");
+        if(!oilfile) {
+            perror("failed to open output file\n");
+            return 1;
+        }
     }
 
     /* do semantics */
+    if(semcache_incremental)
+        semcache_load(semoutfile.c_str());
     int semantic_errors =
         oc_run_semantics(yyparse_astree, symtablefile);
+    diag_flush(stderr);
+    if(semcache_save(semoutfile.c_str()))
+        perror("failed to write .sem file");
     int emit_errors=0;
-    if(parse_errors + semantic_errors == 0) {
-        emit_errors = 
-            oc_run_emit(yyparse_astree, oilfile);
+    if(parse_errors + semantic_errors == 0 && interp)
+        emit_errors = oc_run_interp(yyparse_astree, argv + optind);
+    else if(parse_errors + semantic_errors == 0 && run)
+        emit_errors = oc_run_jit(yyparse_astree, argv + optind);
+    else if(parse_errors + semantic_errors == 0 && oilfile) {
+        if(native)
+            emit_errors = oc_run_emit_asm(yyparse_astree, oilfile);
+        else
+            emit_errors = oc_run_emit(yyparse_astree, oilfile);
     }
     dump_astree(astfile, yyparse_astree);
     fclose(astfile);
     fclose(symtablefile);
+    if(memstats)
+        arena_dump_stats(stderr, &symbol_arena);
+    oc_free_semantics();
     return (parse_errors + semantic_errors + emit_errors > 0) ? 2 : 0;
 }
 
@@ -26,6 +26,8 @@ void* xcalloc (int nelem, int size) {
    return result;
 }
 
+// oc --run links this file into the compiler, which has its own main
+#ifndef OCLIB_NO_MAIN
 void __ocmain (void);
 int main (int argc, char** argv) {
    argc = argc; // warning: unused parameter 'argc'
@@ -33,6 +35,7 @@ int main (int argc, char** argv) {
    __ocmain();
    return EXIT_SUCCESS;
 }
+#endif
 
 
 char* scan (int (*skipover) (int), int (*stopat) (int)) {
@@ -67,3 +70,46 @@ char* __getln (void)     { return scan (isfalse, isnl); }
 char** __getargv (void)  { return oc_argv; }
 void __exit (int status) { exit (status); }
 
+// oc -fprofile-generate: the program counts how many times each block
+// runs, and the counts are written out when it exits
+static struct {
+   long* counts;
+   int nr_counts;
+   const char** functions;
+   const int* firsts;
+   int nr_functions;
+   const char* path;
+} oc_profile;
+
+static void oc_profile_write (void) {
+   FILE* file = fopen (oc_profile.path, "w");
+   if (file == NULL) {
+      perror (oc_profile.path);
+      return;
+   }
+   fprintf (file, "oc profile 1\n");
+   for (int fn = 0; fn < oc_profile.nr_functions; ++fn) {
+      int first = oc_profile.firsts[fn];
+      int end = fn + 1 < oc_profile.nr_functions
+              ? oc_profile.firsts[fn + 1] : oc_profile.nr_counts;
+      fprintf (file, "%s %d", oc_profile.functions[fn], end - first);
+      for (int count = first; count < end; ++count) {
+         fprintf (file, " %ld", oc_profile.counts[count]);
+      }
+      fprintf (file, "\n");
+   }
+   fclose (file);
+}
+
+void oc_profile_start (long* counts, int nr_counts,
+                       const char** functions, const int* firsts,
+                       int nr_functions, const char* path) {
+   oc_profile.counts = counts;
+   oc_profile.nr_counts = nr_counts;
+   oc_profile.functions = functions;
+   oc_profile.firsts = firsts;
+   oc_profile.nr_functions = nr_functions;
+   oc_profile.path = path;
+   atexit (oc_profile_write);
+}
+
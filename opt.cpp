@@ -0,0 +1,61 @@
+#include <string>
+#include <vector>
+
+#include "opt.h"
+#include "ir.h"
+using namespace std;
+
+/* The pass manager. Functions and structs the program doesn't use are
+ * dropped first, so nothing is spent on them. Self tail calls are
+ * turned into loops next, so the inliner doesn't take those functions
+ * for recursive ones. At -O2 small functions are then inlined into
+ * their callers, which leaves fewer calls for objects to escape
+ * through, before the objects that don't are moved to the frame.
+ * After that every function, and the global statements in __ocmain,
+ * is optimized on its own.
+ *
+ * Counters for -fprofile-generate go in at every level, before the
+ * code is changed, and the counts of -fprofile-use are read for the
+ * same code, before the first pass. */
+
+int opt_level = 0;
+
+static void optimize_function(ir_function *fn)
+{
+    if(opt_level >= 1)
+        opt_fold_constants(fn);
+    if(opt_level >= 2) {
+        opt_number_values(fn);
+        opt_hoist_invariants(fn);
+        opt_reduce_strength(fn);
+    }
+    if(opt_level >= 1) {
+        opt_layout_blocks(fn);
+        if(profile_use)
+            opt_move_cold_blocks(fn);
+        opt_peephole(fn);
+        opt_eliminate_dead_code(fn);
+        opt_allocate_registers(fn);
+    }
+}
+
+void opt_run(ir_module *module)
+{
+    if(opt_level >= 1)
+        opt_remove_unused(module);
+    if(profile_generate)
+        opt_instrument(module);
+    if(opt_level <= 0)
+        return;
+    if(profile_use)
+        opt_read_profile(module);
+    for(size_t f = 0;f < module->functions.size();f++)
+        opt_eliminate_tail_calls(module->functions[f]);
+    if(opt_level >= 2) {
+        opt_inline(module);
+        opt_allocate_on_stack(module);
+    }
+    for(size_t f = 0;f < module->functions.size();f++)
+        optimize_function(module->functions[f]);
+    optimize_function(module->main);
+}
@@ -0,0 +1,56 @@
+#ifndef __OPT_H
+#define __OPT_H
+
+#include "ir.h"
+
+/* optimization level, set with -O<n>. At 0 the IR is printed exactly
+ * as it was lowered. */
+extern int opt_level;
+
+void opt_run(ir_module *module);
+
+/* -fprofile-generate: the file the instrumented program writes its
+ * counts to. -fprofile-use: the file they are read from. NULL if not
+ * given. See profile.cpp. */
+extern const char *profile_generate;
+extern const char *profile_use;
+/* adds a counter to every block of every function */
+void opt_instrument(ir_module *module);
+/* sets the count of every block from profile_use. Returns the number
+ * of functions that got counts. */
+int opt_read_profile(ir_module *module);
+/* whether the profile says the block never ran, or ran often */
+bool opt_block_cold(ir_block *block);
+bool opt_block_hot(ir_block *block);
+/* count * part / whole, or -1 if any of them isn't known */
+long opt_scale_count(long count, long part, long whole);
+
+/* drops the functions __ocmain can't reach and the structs nothing
+ * left names. Returns the number removed. */
+int opt_remove_unused(ir_module *module);
+
+/* inlines small functions into their callers, before the functions
+ * are optimized one by one. Returns the number of calls inlined. */
+int opt_inline(ir_module *module);
+
+/* puts the objects of news that don't escape their function in its
+ * frame. Returns the number of news changed. */
+int opt_allocate_on_stack(ir_module *module);
+
+/* whether the call at instrs[at] of block is the last thing its
+ * function does, returning whatever the call returns */
+bool opt_tail_call(ir_block *block, size_t at);
+
+/* passes. Each returns non-zero if it changed the function. */
+int opt_eliminate_tail_calls(ir_function *function);
+int opt_fold_constants(ir_function *function);
+int opt_eliminate_dead_code(ir_function *function);
+int opt_number_values(ir_function *function);
+int opt_hoist_invariants(ir_function *function);
+int opt_reduce_strength(ir_function *function);
+int opt_layout_blocks(ir_function *function);
+int opt_peephole(ir_function *function);
+int opt_move_cold_blocks(ir_function *function);
+int opt_allocate_registers(ir_function *function);
+
+#endif
@@ -0,0 +1,126 @@
+#include <cstdlib>
+#include <cassert>
+#include <cerrno>
+#include <climits>
+#include <sys/uio.h>
+
+#include "outbuf.h"
+
+#define OUTBUF_CHUNK_SIZE (256 * 1024)
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct outbuf_chunk {
+    outbuf_chunk *next;
+    size_t size;
+    size_t used;            /* filled in when the next chunk starts */
+};
+
+static char *chunk_data(outbuf_chunk *chunk)
+{
+    return (char *)(chunk + 1);
+}
+
+/* start a new chunk with room for at least size bytes */
+void outbuf_grow(outbuf *buf, size_t size)
+{
+    if(buf->tail)
+        buf->tail->used = buf->pos - chunk_data(buf->tail);
+    size_t chunk_size = size > OUTBUF_CHUNK_SIZE ? size
+        : OUTBUF_CHUNK_SIZE;
+    outbuf_chunk *chunk =
+        (outbuf_chunk *)malloc(sizeof(outbuf_chunk) + chunk_size);
+    assert(chunk);
+    chunk->next = NULL;
+    chunk->size = chunk_size;
+    chunk->used = 0;
+    if(buf->tail)
+        buf->tail->next = chunk;
+    else
+        buf->head = chunk;
+    buf->tail = chunk;
+    buf->pos = chunk_data(chunk);
+    buf->end = buf->pos + chunk_size;
+}
+
+void outbuf_putl(outbuf *buf, long value)
+{
+    char digits[24];
+    char *end = digits + sizeof(digits), *p = end;
+    unsigned long magnitude = value < 0 ? -(unsigned long)value : value;
+    do {
+        *--p = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while(magnitude);
+    if(value < 0)
+        *--p = '-';
+    outbuf_put(buf, p, end - p);
+}
+
+/* move the chunks of from to the end of buf, leaving from empty. No
+ * text is copied. */
+void outbuf_append(outbuf *buf, outbuf *from)
+{
+    if(!from->head)
+        return;
+    from->tail->used = from->pos - chunk_data(from->tail);
+    if(buf->tail) {
+        buf->tail->used = buf->pos - chunk_data(buf->tail);
+        buf->tail->next = from->head;
+    } else {
+        buf->head = from->head;
+    }
+    buf->tail = from->tail;
+    buf->pos = from->pos;
+    buf->end = from->end;
+    from->head = from->tail = NULL;
+    from->pos = from->end = NULL;
+}
+
+/* write everything out and release the chunks. Returns 0, or -1 with
+ * errno set if a write failed. */
+int outbuf_flush(outbuf *buf, int fd)
+{
+    if(buf->tail)
+        buf->tail->used = buf->pos - chunk_data(buf->tail);
+    int status = 0;
+    outbuf_chunk *chunk = buf->head;
+    while(chunk && !status) {
+        struct iovec iov[IOV_MAX];
+        int nr = 0;
+        for(outbuf_chunk *c = chunk;c && nr < IOV_MAX;c = c->next) {
+            iov[nr].iov_base = chunk_data(c);
+            iov[nr].iov_len = c->used;
+            nr++;
+        }
+        /* writev may stop short; carry on from where it stopped */
+        struct iovec *next = iov;
+        while(nr && !status) {
+            ssize_t written = writev(fd, next, nr);
+            if(written < 0) {
+                if(errno != EINTR)
+                    status = -1;
+                continue;
+            }
+            while(nr && (size_t)written >= next->iov_len) {
+                written -= next->iov_len;
+                next++;
+                nr--;
+                chunk = chunk->next;
+            }
+            if(nr) {
+                next->iov_base = (char *)next->iov_base + written;
+                next->iov_len -= written;
+            }
+        }
+    }
+    while(buf->head) {
+        outbuf_chunk *next = buf->head->next;
+        free(buf->head);
+        buf->head = next;
+    }
+    buf->tail = NULL;
+    buf->pos = buf->end = NULL;
+    return status;
+}
@@ -0,0 +1,45 @@
+#ifndef __OUTBUF_H
+#define __OUTBUF_H
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+/* An output buffer collects text in large chunks, so writing a piece
+ * of it is a bounds check and a memcpy instead of a call into stdio.
+ * outbuf_flush() hands every chunk to the kernel with writev() and
+ * releases them. */
+
+struct outbuf_chunk;
+
+struct outbuf {
+    outbuf_chunk *head, *tail;
+    char *pos, *end;        /* free space in the tail chunk */
+};
+
+#define OUTBUF_INIT { NULL, NULL, NULL, NULL }
+
+void outbuf_grow(outbuf *buf, size_t size);
+void outbuf_putl(outbuf *buf, long value);
+void outbuf_append(outbuf *buf, outbuf *from);
+int outbuf_flush(outbuf *buf, int fd);
+
+static inline void outbuf_put(outbuf *buf, const char *text, size_t len)
+{
+    if((size_t)(buf->end - buf->pos) < len)
+        outbuf_grow(buf, len);
+    memcpy(buf->pos, text, len);
+    buf->pos += len;
+}
+
+static inline void outbuf_puts(outbuf *buf, const char *text)
+{
+    outbuf_put(buf, text, strlen(text));
+}
+
+static inline void outbuf_puts(outbuf *buf, const std::string &text)
+{
+    outbuf_put(buf, text.data(), text.size());
+}
+
+#endif
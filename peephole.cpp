@@ -0,0 +1,295 @@
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "opt.h"
+#include "ir.h"
+using namespace std;
+
+/* Peephole optimization.
+ *
+ * The waste the bigger passes leave behind is cleaned up by a table of
+ * small patterns, each a match and a rewrite. An instruction pattern
+ * looks at the instruction at one position of a block and the ones
+ * right after it; a block pattern looks at the end of a block and
+ * where it goes. Every pattern is tried everywhere until none of them
+ * matches, so one rewrite can set up another.
+ *
+ * This runs before register allocation, while every register still
+ * has one definition, so the number of times a register is read says
+ * whether the instruction reading it is the only one.
+ */
+
+struct peephole {
+    ir_function *fn;
+    unordered_map<ir_value *, int> uses;
+};
+
+static void count_uses(peephole &p)
+{
+    p.uses.clear();
+    for(size_t b = 0;b < p.fn->blocks.size();b++) {
+        ir_block *block = p.fn->blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            for(size_t arg = 0;arg < instr->args.size();arg++) {
+                ir_value *value = instr->args[arg];
+                p.uses[value]++;
+                if(value->kind == IRV_DEREF)
+                    p.uses[value->base]++;
+            }
+            if(instr->dest && instr->dest->kind == IRV_DEREF)
+                p.uses[instr->dest->base]++;
+        }
+        if(block->cond)
+            p.uses[block->cond]++;
+        if(block->retval)
+            p.uses[block->retval]++;
+    }
+}
+
+static bool const_equals(ir_value *value, long cval)
+{
+    return value->kind == IRV_CONST && value->cval == cval;
+}
+
+static bool is_compare(ir_instr *instr)
+{
+    if(instr->op != IR_BINOP)
+        return false;
+    const string &op = instr->opname;
+    return op == "<" || op == ">" || op == "<=" || op == ">="
+        || op == "==" || op == "!=";
+}
+
+/* the C type a value is stored as */
+static string stored_type(ir_value *value)
+{
+    if(value->kind != IRV_DEREF)
+        return value->type;
+    const string &type = value->base->type;
+    return type.substr(0, type.size() - 1);
+}
+
+/*
+ * Instruction patterns, on instrs[at] of block.
+ */
+
+/* x + 0, 0 + x, x - 0, x * 1, 1 * x, x / 1: a copy of x */
+static bool match_identity(peephole &, ir_block *block, size_t at)
+{
+    ir_instr *instr = block->instrs[at];
+    if(instr->op != IR_BINOP)
+        return false;
+    const string &op = instr->opname;
+    ir_value *x = instr->args[0], *y = instr->args[1];
+    return ((op == "+" || op == "-") && const_equals(y, 0))
+        || (op == "+" && const_equals(x, 0))
+        || ((op == "*" || op == "/") && const_equals(y, 1))
+        || (op == "*" && const_equals(x, 1));
+}
+
+static void rewrite_identity(peephole &, ir_block *block, size_t at)
+{
+    ir_instr *instr = block->instrs[at];
+    ir_value *x = instr->args[0];
+    if(x->kind == IRV_CONST)
+        x = instr->args[1];
+    instr->op = IR_COPY;
+    instr->opname.clear();
+    instr->args.assign(1, x);
+}
+
+/* r = ...; v = r, where nothing else reads r: v = ... */
+static bool match_forward(peephole &p, ir_block *block, size_t at)
+{
+    if(at + 1 >= block->instrs.size())
+        return false;
+    ir_instr *def = block->instrs[at], *copy = block->instrs[at + 1];
+    ir_value *r = def->dest;
+    if(!r || r->kind != IRV_REG || def->op == IR_DECL
+            || copy->op != IR_COPY || copy->args[0] != r
+            || p.uses[r] != 1)
+        return false;
+    /* the result has to be stored the same way */
+    return stored_type(copy->dest) == r->type;
+}
+
+static void rewrite_forward(peephole &p, ir_block *block, size_t at)
+{
+    ir_instr *def = block->instrs[at], *copy = block->instrs[at + 1];
+    p.uses[def->dest] = 0;
+    def->dest = copy->dest;
+    block->instrs.erase(block->instrs.begin() + at + 1);
+    delete copy;
+}
+
+static const struct {
+    const char *name;
+    bool (*match)(peephole &p, ir_block *block, size_t at);
+    void (*rewrite)(peephole &p, ir_block *block, size_t at);
+} instr_patterns[] = {
+    { "arithmetic identity", match_identity, rewrite_identity },
+    { "result copied into a variable", match_forward, rewrite_forward },
+};
+
+/*
+ * Block patterns.
+ */
+
+/* where a jump to target really ends up, past empty blocks. A loop
+ * of empty blocks has nowhere to end up, so target stays. */
+static ir_block *jump_target(ir_block *target)
+{
+    unordered_set<ir_block *> seen;
+    ir_block *to = target;
+    while(to->instrs.empty() && to->succ[0]
+            && (to->term == IR_FALL || to->term == IR_GOTO)) {
+        if(!seen.insert(to).second)
+            return target;
+        to = to->succ[0];
+    }
+    return to;
+}
+
+/* a jump to an empty block that only goes on elsewhere. Falling into
+ * one costs nothing, so that is left alone. */
+static bool threads(ir_block *block, int s, ir_block *next)
+{
+    ir_block *succ = block->succ[s];
+    return succ && (s == 1 || succ != next) && jump_target(succ) != succ;
+}
+
+static bool match_empty_target(peephole &, ir_block *block,
+        ir_block *next)
+{
+    for(int s = 0;s < ir_nr_succ(block);s++) {
+        if(threads(block, s, next))
+            return true;
+    }
+    return false;
+}
+
+static void rewrite_empty_target(peephole &, ir_block *block,
+        ir_block *next)
+{
+    for(int s = 0;s < ir_nr_succ(block);s++) {
+        if(!threads(block, s, next))
+            continue;
+        ir_block *target = jump_target(block->succ[s]);
+        /* it may only have been fallen into until now */
+        ir_need_label(target);
+        block->succ[s] = target;
+    }
+}
+
+/* a branch both ways to the same block */
+static bool match_same_targets(peephole &, ir_block *block, ir_block *)
+{
+    return block->term == IR_BRANCH && block->succ[0] == block->succ[1];
+}
+
+static void rewrite_same_targets(peephole &p, ir_block *block, ir_block *)
+{
+    p.uses[block->cond]--;
+    block->term = IR_GOTO;
+    block->cond = NULL;
+    block->succ[1] = NULL;
+    block->test_fused = false;
+    block->likely = -1;
+}
+
+/* b = x < y; if (!b) goto: compare and jump in one go */
+static bool match_fresh_test(peephole &p, ir_block *block, ir_block *)
+{
+    if(block->term != IR_BRANCH || block->test_fused
+            || block->instrs.empty())
+        return false;
+    ir_instr *last = block->instrs.back();
+    return is_compare(last) && last->dest == block->cond
+        && p.uses[block->cond] == 1;
+}
+
+static void rewrite_fresh_test(peephole &, ir_block *block, ir_block *)
+{
+    block->test_fused = true;
+}
+
+/* if (x < y) goto over the next block: if (x >= y) goto the other */
+static bool match_branch_to_next(peephole &, ir_block *block,
+        ir_block *next)
+{
+    return block->test_fused && block->succ[1] == next
+        && block->succ[0] != next;
+}
+
+static void rewrite_branch_to_next(peephole &, ir_block *block,
+        ir_block *)
+{
+    ir_instr *test = block->instrs.back();
+    test->opname = ir_inverse_compare(test->opname);
+    ir_block *taken = block->succ[0];
+    block->succ[0] = block->succ[1];
+    block->succ[1] = taken;
+    if(block->likely >= 0)
+        block->likely = 1 - block->likely;
+}
+
+static const struct {
+    const char *name;
+    bool (*match)(peephole &p, ir_block *block, ir_block *next);
+    void (*rewrite)(peephole &p, ir_block *block, ir_block *next);
+} block_patterns[] = {
+    { "jump to an empty block", match_empty_target,
+        rewrite_empty_target },
+    { "branch both ways to one block", match_same_targets,
+        rewrite_same_targets },
+    { "branch on a fresh comparison", match_fresh_test,
+        rewrite_fresh_test },
+    { "branch around the next block", match_branch_to_next,
+        rewrite_branch_to_next },
+};
+
+#define NR_PATTERNS(table) (sizeof(table) / sizeof(table[0]))
+
+static int apply_patterns(peephole &p)
+{
+    int applied = 0;
+    for(size_t b = 0;b < p.fn->blocks.size();b++) {
+        ir_block *block = p.fn->blocks[b];
+        ir_block *next = b + 1 < p.fn->blocks.size() ? p.fn->blocks[b+1]
+            : NULL;
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            for(size_t k = 0;k < NR_PATTERNS(instr_patterns);k++) {
+                if(instr_patterns[k].match(p, block, i)) {
+                    instr_patterns[k].rewrite(p, block, i);
+                    applied++;
+                }
+            }
+        }
+        for(size_t k = 0;k < NR_PATTERNS(block_patterns);k++) {
+            if(block_patterns[k].match(p, block, next)) {
+                block_patterns[k].rewrite(p, block, next);
+                applied++;
+            }
+        }
+    }
+    return applied;
+}
+
+int opt_peephole(ir_function *fn)
+{
+    peephole p;
+    p.fn = fn;
+    count_uses(p);
+    int applied = 0, round;
+    do {
+        round = apply_patterns(p);
+        applied += round;
+    } while(round);
+    /* the empty blocks nothing jumps to any more */
+    if(applied)
+        ir_remove_unreachable(fn);
+    return applied;
+}
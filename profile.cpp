@@ -0,0 +1,239 @@
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include "opt.h"
+#include "ir.h"
+#include "oc.h"
+using namespace std;
+
+/* Profile-guided optimization.
+ *
+ * With -fprofile-generate every block of the IR as it was lowered
+ * starts with an IR_COUNT of its own counter. The oil declares the
+ * counters and hands them to oclib, which writes them out when the
+ * program exits: a line per function, with its name, its number of
+ * blocks and how many times each of them ran, by block id. A call
+ * can't branch, so the count of its block is the count of the call.
+ *
+ * -fprofile-use reads such a file back before anything is optimized.
+ * The same source is lowered the same way, so the block ids match; a
+ * function whose number of blocks doesn't is left without counts, and
+ * the lines of functions that were removed are skipped. Then
+ *  - a branch that went one way at least PROFILE_LIKELY percent of
+ *    the times it ran is marked likely, which the oil printer passes
+ *    on to the C compiler as __builtin_expect,
+ *  - the inliner leaves calls that never ran alone, and takes larger
+ *    functions into blocks that ran often,
+ *  - blocks that never ran are moved to the end of their function, so
+ *    the code that runs is together and falls through.
+ * Blocks the passes add inherit counts where that is easy, and are
+ * unknown otherwise.
+ */
+
+#define PROFILE_MAGIC "oc profile 1"
+#define PROFILE_LIKELY 90
+/* a block is hot if it ran at least 1/PROFILE_HOT of the times the
+ * hottest block of the program did */
+#define PROFILE_HOT 100
+
+const char *profile_generate = NULL;
+const char *profile_use = NULL;
+
+static long max_count;
+
+static string function_name(ir_function *fn)
+{
+    return fn->decl.substr(fn->decl.rfind(' ') + 1);
+}
+
+static void instrument_function(ir_module *module, ir_function *fn)
+{
+    fn->first_counter = module->nr_counters;
+    module->nr_counters += fn->nr_blocks;
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        ir_instr *count = new ir_instr();
+        count->op = IR_COUNT;
+        count->dest = NULL;
+        count->node = fn->node;
+        count->args.push_back(ir_const(module, IR_INT,
+                    fn->first_counter + block->id));
+        block->instrs.insert(block->instrs.begin(), count);
+    }
+}
+
+void opt_instrument(ir_module *module)
+{
+    module->nr_counters = 0;
+    for(size_t f = 0;f < module->functions.size();f++)
+        instrument_function(module, module->functions[f]);
+    instrument_function(module, module->main);
+}
+
+/* which way each branch of fn went. Where a successor is only reached
+ * from the branch, its count is the count of that edge. */
+static void find_likely(ir_function *fn)
+{
+    vector<int> preds(fn->nr_blocks, 0);
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        for(int s = 0;s < ir_nr_succ(block);s++)
+            preds[block->succ[s]->id]++;
+    }
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        if(block->term != IR_BRANCH || block->count <= 0)
+            continue;
+        long edge[2] = { -1, -1 };
+        for(int s = 0;s < 2;s++) {
+            if(preds[block->succ[s]->id] == 1)
+                edge[s] = block->succ[s]->count;
+        }
+        for(int s = 0;s < 2;s++) {
+            if(edge[s] < 0 && edge[1 - s] >= 0)
+                edge[s] = block->count - edge[1 - s];
+        }
+        for(int s = 0;s < 2;s++) {
+            if(edge[s] >= 0 && edge[s] * 100
+                    >= block->count * PROFILE_LIKELY)
+                block->likely = s;
+        }
+    }
+}
+
+/* the counts on the rest of a line */
+static bool read_counts(FILE *file, vector<long> &counts)
+{
+    size_t nr_blocks;
+    if(fscanf(file, "%zu", &nr_blocks) != 1)
+        return false;
+    counts.resize(nr_blocks);
+    for(size_t c = 0;c < nr_blocks;c++) {
+        if(fscanf(file, "%ld", &counts[c]) != 1)
+            return false;
+    }
+    return true;
+}
+
+/* give the blocks of fn their counts. Returns false if they don't fit
+ * it. */
+static bool set_counts(ir_function *fn, vector<long> &counts)
+{
+    if(counts.size() != fn->nr_blocks)
+        return false;
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        block->count = counts[block->id];
+        if(block->count > max_count)
+            max_count = block->count;
+    }
+    find_likely(fn);
+    return true;
+}
+
+int opt_read_profile(ir_module *module)
+{
+    max_count = 0;
+    FILE *file = fopen(profile_use, "r");
+    if(!file) {
+        oc_errprintf("warning: cannot read profile %s: %s\n",
+                profile_use, strerror(errno));
+        return 0;
+    }
+    char magic[32];
+    if(!fgets(magic, sizeof(magic), file)
+            || string(magic) != PROFILE_MAGIC "\n") {
+        oc_errprintf("warning: %s is not a profile\n", profile_use);
+        fclose(file);
+        return 0;
+    }
+    unordered_map<string, ir_function *> by_name;
+    for(size_t f = 0;f < module->functions.size();f++) {
+        ir_function *fn = module->functions[f];
+        by_name[function_name(fn)] = fn;
+    }
+    by_name[function_name(module->main)] = module->main;
+
+    int matched = 0;
+    char name[256];
+    vector<long> counts;
+    while(fscanf(file, "%255s", name) == 1) {
+        if(!read_counts(file, counts)) {
+            oc_errprintf("warning: profile %s is cut short at %s\n",
+                    profile_use, name);
+            break;
+        }
+        /* a function that isn't used any more has nothing to count */
+        auto found = by_name.find(name);
+        if(found == by_name.end())
+            continue;
+        if(set_counts(found->second, counts))
+            matched++;
+        else
+            oc_errprintf("warning: profile %s doesn't match %s\n",
+                    profile_use, name);
+    }
+    fclose(file);
+    return matched;
+}
+
+bool opt_block_cold(ir_block *block)
+{
+    return block->count == 0;
+}
+
+bool opt_block_hot(ir_block *block)
+{
+    return block->count > 0 && block->count * PROFILE_HOT >= max_count;
+}
+
+long opt_scale_count(long count, long part, long whole)
+{
+    if(count < 0 || part < 0 || whole <= 0)
+        return -1;
+    return (long)((double)count * part / whole);
+}
+
+int opt_move_cold_blocks(ir_function *fn)
+{
+    /* nothing to go by in a function that never ran */
+    bool ran = false;
+    for(size_t b = 0;b < fn->blocks.size();b++)
+        ran |= fn->blocks[b]->count > 0;
+    if(!ran)
+        return 0;
+    /* the entry stays first, and a block that falls off the end of the
+     * function stays last */
+    ir_block *last = fn->blocks.back();
+    bool falls_off = last->term == IR_FALL && !last->succ[0];
+    size_t end = fn->blocks.size() - (falls_off ? 1 : 0);
+    vector<ir_block *> hot, cold;
+    for(size_t b = 0;b < end;b++) {
+        ir_block *block = fn->blocks[b];
+        if(b > 0 && opt_block_cold(block))
+            cold.push_back(block);
+        else
+            hot.push_back(block);
+    }
+    if(cold.empty())
+        return 0;
+    /* what fell into a block that moved now jumps there */
+    hot.insert(hot.end(), cold.begin(), cold.end());
+    if(falls_off)
+        hot.push_back(last);
+    fn->blocks = hot;
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        ir_block *next = b + 1 < fn->blocks.size() ? fn->blocks[b + 1]
+            : NULL;
+        for(int s = 0;s < ir_nr_succ(block);s++) {
+            if(block->succ[s] != next)
+                ir_need_label(block->succ[s]);
+        }
+    }
+    return cold.size();
+}
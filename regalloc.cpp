@@ -0,0 +1,170 @@
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "opt.h"
+#include "ir.h"
+using namespace std;
+
+/* Register allocation.
+ *
+ * Lowering gives every intermediate result its own register, and the
+ * numbers grow across the whole program. Here the registers of one
+ * function are mapped onto a few temporaries that are reused once
+ * their value is dead. Two registers interfere if one is defined
+ * while the other is live; registers only share a temporary with
+ * registers of the same C type that they don't interfere with.
+ * Registers are colored greedily in the order they are defined.
+ *
+ * The temporaries are numbered from 1 in every function and are
+ * declared at the top of it, since one temporary is now assigned in
+ * many places.
+ */
+
+/* a set of value indexes that can be listed in time proportional to
+ * its size */
+struct sparse_set {
+    vector<size_t> dense, pos;
+
+    void reset(size_t size)
+    {
+        dense.clear();
+        pos.assign(size, (size_t)-1);
+    }
+    void insert(size_t v)
+    {
+        if(pos[v] == (size_t)-1) {
+            pos[v] = dense.size();
+            dense.push_back(v);
+        }
+    }
+    void erase(size_t v)
+    {
+        if(pos[v] == (size_t)-1)
+            return;
+        size_t last = dense.back();
+        dense[pos[v]] = last;
+        pos[last] = pos[v];
+        dense.pop_back();
+        pos[v] = (size_t)-1;
+    }
+};
+
+static void live_registers(ir_liveness &lv, sparse_set &live,
+        ir_value *value)
+{
+    if(!value)
+        return;
+    if(value->kind == IRV_DEREF)
+        value = value->base;
+    if(value->kind != IRV_REG)
+        return;
+    live.insert(lv.index[value]);
+}
+
+static void build_interference(ir_function *fn, ir_liveness &lv,
+        vector<ir_value *> &values, vector<vector<size_t>> &adj)
+{
+    sparse_set live;
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        live.reset(values.size());
+        vector<bool> &out = lv.live_out[block->id];
+        for(size_t v = 0;v < out.size();v++) {
+            if(out[v] && values[v]->kind == IRV_REG)
+                live.insert(v);
+        }
+        live_registers(lv, live, block->cond);
+        live_registers(lv, live, block->retval);
+        for(size_t i = block->instrs.size();i-- > 0;) {
+            ir_instr *instr = block->instrs[i];
+            ir_value *def = instr->dest;
+            if(def && def->kind == IRV_REG) {
+                size_t d = lv.index[def];
+                live.erase(d);
+                for(size_t l = 0;l < live.dense.size();l++) {
+                    size_t other = live.dense[l];
+                    if(values[other]->type == def->type) {
+                        adj[d].push_back(other);
+                        adj[other].push_back(d);
+                    }
+                }
+            } else if(def && def->kind == IRV_DEREF) {
+                live_registers(lv, live, def);
+            }
+            for(size_t arg = 0;arg < instr->args.size();arg++)
+                live_registers(lv, live, instr->args[arg]);
+        }
+    }
+}
+
+int opt_allocate_registers(ir_function *fn)
+{
+    ir_liveness lv;
+    ir_compute_liveness(fn, lv);
+    vector<ir_value *> values(lv.index.size());
+    for(auto it = lv.index.begin();it != lv.index.end();++it)
+        values[it->second] = it->first;
+    vector<vector<size_t>> adj(values.size());
+    build_interference(fn, lv, values, adj);
+
+    /* color in order of definition */
+    vector<long> color(values.size(), -1);
+    unordered_map<string, vector<ir_value *>> temps;
+    ir_value_map renamed;
+    size_t nr_regs = 0, next_nr = 1;
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            ir_value *def = instr->dest;
+            if(!def || def->kind != IRV_REG || renamed.count(def))
+                continue;
+            nr_regs++;
+            size_t d = lv.index[def];
+            vector<bool> taken;
+            for(size_t n = 0;n < adj[d].size();n++) {
+                long c = color[adj[d][n]];
+                if(c < 0)
+                    continue;
+                if((size_t)c >= taken.size())
+                    taken.resize(c + 1, false);
+                taken[c] = true;
+            }
+            size_t c = 0;
+            while(c < taken.size() && taken[c])
+                c++;
+            color[d] = c;
+
+            vector<ir_value *> &pool = temps[def->type];
+            if(c == pool.size()) {
+                ir_value *temp = ir_register(fn->module, def->category,
+                        next_nr++, def->type);
+                pool.push_back(temp);
+                fn->temps.push_back(temp);
+            }
+            renamed[def] = pool[c];
+        }
+    }
+
+    ir_replace_uses(fn, renamed);
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        vector<ir_instr *> kept;
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            auto found = renamed.find(instr->dest);
+            if(instr->dest && found != renamed.end())
+                instr->dest = found->second;
+            /* a copy between registers that share a temporary */
+            if(instr->op == IR_COPY && instr->dest == instr->args[0]) {
+                delete instr;
+                continue;
+            }
+            kept.push_back(instr);
+        }
+        block->instrs = kept;
+    }
+    fn->temps_declared = true;
+    return nr_regs - fn->temps.size();
+}
@@ -1,6 +1,7 @@
 #include "semantics.h"
 #include "astree.h"
 #include "lyutils.h"
+#include "diag.h"
 #include <cassert>
 #include <map>
 
@@ -20,13 +21,11 @@ int process_node(astree *node)
         /* look up the symbol */
         symbol *sym = find_symbol(node->lexinfo);
         if(!sym) {
-            fprintf(stderr, 
-                    "%ld.%2ld.%3.3ld: identifier '%s' is undefined\n",
-                    node->filenr, node->linenr, node->offset,
-                    node->lexinfo->c_str());
+            diag_report(DIAG_UNDEFINED_IDENT, node, node->lexinfo);
             semantic_errors++;
         } else {
             node->symentry = sym;
+            node->attributes = sym->attributes;
             node->type_name = sym->type_name;
         }
     } else {
@@ -39,9 +38,7 @@ int process_node(astree *node)
 int handle_structure(astree *node)
 {
     if(symbol_stack.size() != 1) {
-        fprintf(stderr,
-                "%ld.%2ld.%3.3ld: structures must be in global scope\n",
-                node->filenr, node->linenr, node->offset);
+        diag_report(DIAG_STRUCT_NOT_GLOBAL, node);
         semantic_errors++;
         return 1;
     }
@@ -49,11 +46,8 @@ int handle_structure(astree *node)
     symbol *sym = find_symbol_in_table(typeid_table,
             node->children[0]->lexinfo);
     if(sym) {
-        fprintf(stderr, 
-                "%ld.%2ld.%3.3ld: duplicate"
-                "declaration of typeid '%s'\n",
-                node->filenr, node->linenr, node->offset,
-                node->children[0]->lexinfo->c_str());
+        diag_report(DIAG_DUPLICATE_TYPEID, node,
+                node->children[0]->lexinfo);
         semantic_errors++;
         return 1;
     }
@@ -68,10 +62,11 @@ int handle_structure(astree *node)
     node->children[0]->blocknr = 0;
     sym->attributes.set(ATTR_typeid);
     sym->block_nr = 0;
+    node->children[0]->attributes = sym->attributes;
 
     print_depth++;
 
-    symbol_table *field_table = new symbol_table();
+    symbol_table *field_table = new_symbol_table();
     sym->fields = field_table;
 
     for(size_t child = 1; child < node->children.size(); ++child) {
@@ -88,15 +83,14 @@ int handle_structure(astree *node)
     return 0;
 }
 
-int handle_function(astree *node)
+int handle_function(astree *node, bool check_body)
 {
     if(scope_get_current_depth() != 0) {
-        fprintf(stderr,
-                "%ld.%2ld.%3.3ld: functions must be in global scope\n",
-                node->filenr, node->linenr, node->offset);
+        diag_report(DIAG_FUNCTION_NOT_GLOBAL, node);
         semantic_errors++;
         return 1;
     }
+    size_t sig_hash = typecheck_signature_hash(node);
     if(node->children.size() == 2) {
         /* prototype */
         astree *decl;
@@ -109,13 +103,11 @@ int handle_function(astree *node)
                         decl->lexinfo))) {
             /* found a previous prototype */
             astree *prototype = sym->definition->parent->parent;
-            if(!typecheck_compare_functions(prototype, node)) {
-                fprintf(stderr,
-                        "%ld.%2ld%3.3ld: function has mis-matching"
-                        " prototype (declared at %ld.%2ld.%3.3ld)\n",
-                        node->filenr, node->linenr, node->offset,
-                        prototype->filenr, prototype->linenr,
-                        prototype->offset);
+            if(sym->sig_hash != sig_hash
+                    || !typecheck_compare_functions(prototype, node)) {
+                diag_report(DIAG_PROTOTYPE_MISMATCH, node,
+                        diag_loc(prototype->filenr, prototype->linenr,
+                            prototype->offset));
                 semantic_errors++;
                 return 1;
             }
@@ -130,15 +122,15 @@ int handle_function(astree *node)
         if(sym->definition->parent != node->children[0]) {
             /* found a previous prototype */
             astree *prototype = sym->definition->parent->parent;
-            if(!typecheck_compare_functions(prototype, node)) {
-                fprintf(stderr,
-                        "%ld.%2ld%3.3ld: function has mis-matching"
-                        " prototype (declared at %ld.%2ld.%3.3ld)\n",
-                        node->filenr, node->linenr, node->offset,
-                        prototype->filenr, prototype->linenr,
-                        prototype->offset);
+            if(sym->sig_hash != sig_hash
+                    || !typecheck_compare_functions(prototype, node)) {
+                diag_report(DIAG_PROTOTYPE_MISMATCH, node,
+                        diag_loc(prototype->filenr, prototype->linenr,
+                            prototype->offset));
                 semantic_errors++;
             }
+        } else {
+            sym->sig_hash = sig_hash;
         }
     } else {
         semantic_errors++;
@@ -163,11 +155,12 @@ int handle_function(astree *node)
     }
     fprintf(symfile, "\n");
 
-    if(node->symbol == TOK_FUNCTION) {
+    if(node->symbol == TOK_FUNCTION)
+        sym->fnblock = node->children[2];
+    if(node->symbol == TOK_FUNCTION && check_body) {
         /* manually parse the block */
         astree *block = node->children[2];
         block->blocknr = get_current_block();
-        sym->fnblock = block;
         for (size_t child = 0; child < block->children.size();
                 ++child) {
             dfs_traverse(block->children[child]);
@@ -186,7 +179,7 @@ int dfs_traverse(astree *node)
 {
     switch(node->symbol) {
         case TOK_FUNCTION:case TOK_PROTOTYPE:
-            handle_function(node);
+            handle_function(node, true);
             break;
         case TOK_STRUCT:
             handle_structure(node);
@@ -196,9 +189,7 @@ int dfs_traverse(astree *node)
             symbolize_declaration(scope_get_top_table(), node, 0);
             break;
         case TOK_VOID:
-            fprintf(stderr,
-                    "%ld.%2ld.%3.3ld: cannot have void variables\n",
-                    node->filenr, node->linenr, node->offset);
+            diag_report(DIAG_VOID_VARIABLE, node);
             semantic_errors++;
             break;
         case TOK_NEW:
@@ -207,12 +198,8 @@ int dfs_traverse(astree *node)
             if(!node->type_name
                     || !find_symbol_in_table(typeid_table,
                         node->type_name)) {
-                fprintf(stderr, 
-                        "%ld.%2ld.%3.3ld: allocator with"
-                        " unknown typeid '%s'\n",
-                        node->filenr, node->linenr, node->offset,
-                        node->type_name ?
-                        node->type_name->c_str() : "???");
+                diag_report(DIAG_UNKNOWN_ALLOC_TYPEID, node,
+                        node->type_name);
                 semantic_errors++;
             }
             break;
@@ -253,12 +240,53 @@ int dfs_traverse(astree *node)
     return 0;
 }
 
+/* a unit that checked cleanly last time, and whose dependencies have
+ * not changed since, only needs its declarations entered so that the
+ * units after it can see them */
+static void declare_unit(astree *node)
+{
+    switch(node->symbol) {
+        case TOK_FUNCTION: case TOK_PROTOTYPE:
+            handle_function(node, false);
+            break;
+        case TOK_STRUCT:
+            handle_structure(node);
+            break;
+        case TOK_VARDECL:
+            dfs_traverse(node->children[0]);
+            node->blocknr = block_num_stack.back();
+            break;
+    }
+}
+
 int oc_run_semantics(astree *root, FILE *file)
 {
     symfile = file;
-    symbol_stack.push_back(new symbol_table()); /* top-level symbols */
+    typeid_table = new_symbol_table();
+    symbol_stack.push_back(new_symbol_table()); /* top-level symbols */
     block_num_stack.push_back(0);
-    dfs_traverse(root);
+    semcache_scan(root);
+    for(size_t child = 0; child < root->children.size(); ++child) {
+        astree *unit = root->children[child];
+        int errors = semantic_errors;
+        if(semcache_unit_clean(unit))
+            declare_unit(unit);
+        else
+            dfs_traverse(unit);
+        semcache_unit_done(unit, semantic_errors - errors);
+    }
+    process_node(root);
+    root->blocknr = block_num_stack.back();
     return semantic_errors;
 }
 
+/* drop every symbol and symbol table in one go. Any symentry pointers
+ * left in the AST are dangling after this. */
+void oc_free_semantics()
+{
+    symbol_stack.clear();
+    block_num_stack.clear();
+    typeid_table = NULL;
+    arena_release(&symbol_arena);
+}
+
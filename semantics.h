@@ -7,27 +7,44 @@
 #include "astree.h"
 #include <vector>
 #include "type.h"
+#include "arena.h"
 
 struct symbol;
 
-using symbol_table = unordered_map<const string*,symbol*>;
-using symbol_entry = pair<const string*,symbol*>;
+/* symbols, their field tables and their parameter lists all live in
+ * symbol_arena, and are released together by oc_free_semantics() */
+using symbol_entry = pair<const string* const,symbol*>;
+using symbol_table = unordered_map<const string*,symbol*,
+      hash<const string*>,equal_to<const string*>,
+      arena_allocator<symbol_entry>>;
+using param_list = vector<symbol*,arena_allocator<symbol*>>;
 
 struct symbol {
     attr_bitset attributes;
     symbol_table *fields;
     size_t filenr, linenr, offset;
     size_t block_nr;
-    vector<symbol *> params;
+    param_list params;
     astree *definition;
     /* for functions, this is set. for prototypes, it isn't */
     astree *fnblock;
     struct symbol *type;
     const string *type_name;
+    /* for functions, typecheck_signature_hash of the first
+     * declaration, so redeclarations can be rejected cheaply */
+    size_t sig_hash;
+    /* the name in the oil, made the first time it is needed */
+    const string *oilname;
+
+    symbol(arena *pool) : fields(NULL), filenr(0), linenr(0),
+        offset(0), block_nr(0), params(arena_allocator<symbol*>(pool)),
+        definition(NULL), fnblock(NULL), type(NULL), type_name(NULL),
+        sig_hash(0), oilname(NULL) {}
 };
 
 #define SCOPE_GLOBAL 0
 
+extern arena symbol_arena;
 extern size_t next_block ;
 extern FILE *symfile;
 extern vector<size_t> block_num_stack;
@@ -43,9 +60,12 @@ int node_generate_attributes(astree *node, attr_bitset &attr);
 #define type_attrs_string(x) \
     __typeid_attrs_string(x->attributes, x->type_name)
 string __typeid_attrs_string(attr_bitset attr, const string *type_name);
+string attrs_string(attr_bitset attr);
 
 int typecheck_compare_functions(astree *f1, astree *f2);
+size_t typecheck_signature_hash(astree *function);
 int oc_run_semantics(astree *root, FILE *);
+void oc_free_semantics();
 int scope_get_current_depth();
 symbol_table *scope_get_global_table();
 symbol_table *scope_get_current_table();
@@ -53,6 +73,7 @@ void enter_block();
 void leave_block();
 size_t get_current_block();
 symbol_table *scope_get_top_table();
+symbol_table *new_symbol_table();
 symbol *create_symbol_in_table(
         symbol_table *table, astree *node);
 struct symbol *create_symbol(struct astree *node,
@@ -63,7 +84,14 @@ struct symbol *find_symbol(const string *ident);
 symbol *symbolize_declaration(symbol_table *table,
         astree *node, attr_bitset initial_attr);
 
-attr_bitset get_node_attributes(astree *node);
+/* incremental re-analysis, see semcache.cpp */
+extern bool semcache_incremental;
+void semcache_scan(astree *root);
+bool semcache_unit_clean(astree *unit);
+void semcache_unit_done(astree *unit, int errors);
+void semcache_load(const char *filename);
+int semcache_save(const char *filename);
+
 int process_attributes(astree *node);
 int typeid_table_field_select(astree *node);
 #endif
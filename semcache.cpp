@@ -0,0 +1,248 @@
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdio>
+#include <cinttypes>
+
+#include "semantics.h"
+#include "astree.h"
+#include "lyutils.h"
+#include "stringset.h"
+using namespace std;
+
+/* Incremental re-analysis.
+ *
+ * Every direct child of the root (function, prototype, structure,
+ * global declaration or statement) is a "unit". A unit's fingerprint
+ * is a hash of its tokens and their shape, and does not depend on
+ * where in the file the unit sits.
+ *
+ * Whatever a unit's analysis depends on outside of itself is reached
+ * through the global identifiers and typeids it mentions. For each of
+ * those we hash the interface that is visible at that point in the
+ * file: the signature of a function, the declared type of a global,
+ * or the fields of a structure along with every structure those
+ * fields lead to. A unit's key combines its fingerprint with the
+ * interfaces of everything it mentions. Editing a function body only
+ * changes that function's key; editing a signature or a structure
+ * changes the key of every unit that depends on it.
+ *
+ * The keys of units that checked without errors are written to the
+ * .sem file after every run. With -i, a later run loads that file and
+ * only enters the declarations of units whose key is listed, without
+ * traversing their bodies again.
+ */
+
+#define SEMCACHE_MAGIC "oc-semcache 1"
+
+bool semcache_incremental = false;
+/* keys loaded from the previous run */
+static unordered_set<uint64_t> clean_keys;
+/* keys of the units in this run, and which of them came out clean */
+static unordered_map<astree*,uint64_t> unit_keys;
+static vector<uint64_t> new_clean_keys;
+
+/* structures by name, and their memoized deep interface hashes */
+static unordered_map<const string*,astree*> struct_defs;
+static unordered_map<const string*,uint64_t> struct_hashes;
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME  1099511628211ULL
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for(size_t i = 0; i < len; i++) {
+        h ^= bytes[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static uint64_t hash_u64(uint64_t h, uint64_t value)
+{
+    return hash_bytes(h, &value, sizeof(value));
+}
+
+static uint64_t hash_string(uint64_t h, const string &str)
+{
+    h = hash_u64(h, str.size());
+    return hash_bytes(h, str.data(), str.size());
+}
+
+static uint64_t fingerprint(uint64_t h, astree *node)
+{
+    h = hash_u64(h, node->symbol);
+    h = hash_string(h, *node->lexinfo);
+    h = hash_u64(h, node->children.size());
+    for(size_t child = 0; child < node->children.size(); ++child)
+        h = fingerprint(h, node->children[child]);
+    return h;
+}
+
+/* collect the identifiers and typeids a subtree mentions, tagged
+ * with their namespace so a function and a struct may share a name */
+static void collect_refs(astree *node, set<string> &refs)
+{
+    if(node->symbol == TOK_IDENT)
+        refs.insert("I:" + *node->lexinfo);
+    else if(node->symbol == TOK_TYPEID)
+        refs.insert("T:" + *node->lexinfo);
+    for(size_t child = 0; child < node->children.size(); ++child)
+        collect_refs(node->children[child], refs);
+}
+
+static void struct_closure(const string *name, set<string> &seen)
+{
+    if(!seen.insert(*name).second)
+        return;
+    auto def = struct_defs.find(name);
+    if(def == struct_defs.end())
+        return;
+    set<string> refs;
+    collect_refs(def->second, refs);
+    for(auto it = refs.begin(); it != refs.end(); ++it) {
+        if((*it)[0] == 'T')
+            struct_closure(intern_stringset(it->c_str() + 2), seen);
+    }
+}
+
+/* a structure's interface covers its own fields and, transitively,
+ * the structures its fields refer to */
+static uint64_t struct_hash(const string *name)
+{
+    auto memo = struct_hashes.find(name);
+    if(memo != struct_hashes.end())
+        return memo->second;
+    set<string> closure;
+    struct_closure(name, closure);
+    uint64_t h = FNV_OFFSET;
+    for(auto it = closure.begin(); it != closure.end(); ++it) {
+        h = hash_string(h, *it);
+        auto def = struct_defs.find(intern_stringset(it->c_str()));
+        if(def != struct_defs.end())
+            h = fingerprint(h, def->second);
+    }
+    struct_hashes[name] = h;
+    return h;
+}
+
+/* the interface of a declaration: its own tokens, plus the full
+ * interface of every structure type it names */
+static uint64_t interface_hash(astree *decl)
+{
+    uint64_t h = fingerprint(FNV_OFFSET, decl);
+    set<string> refs;
+    collect_refs(decl, refs);
+    for(auto it = refs.begin(); it != refs.end(); ++it) {
+        if((*it)[0] == 'T')
+            h = hash_u64(h,
+                    struct_hash(intern_stringset(it->c_str() + 2)));
+    }
+    return h;
+}
+
+static astree *declared_ident(astree *type)
+{
+    if(type->symbol == TOK_ARRAY)
+        return type->children[1];
+    return type->children[0];
+}
+
+void semcache_scan(astree *root)
+{
+    unit_keys.clear();
+    new_clean_keys.clear();
+    struct_defs.clear();
+    struct_hashes.clear();
+    for(size_t child = 0; child < root->children.size(); ++child) {
+        astree *unit = root->children[child];
+        if(unit->symbol == TOK_STRUCT)
+            struct_defs.insert(
+                    make_pair(unit->children[0]->lexinfo, unit));
+    }
+
+    /* interfaces visible so far, in file order */
+    unordered_map<string,uint64_t> visible;
+    for(size_t child = 0; child < root->children.size(); ++child) {
+        astree *unit = root->children[child];
+        string declared;
+        uint64_t iface = 0;
+        switch(unit->symbol) {
+            case TOK_FUNCTION: case TOK_PROTOTYPE:
+                declared = "I:" +
+                    *declared_ident(unit->children[0])->lexinfo;
+                iface = hash_u64(interface_hash(unit->children[0]),
+                        interface_hash(unit->children[1]));
+                break;
+            case TOK_STRUCT:
+                declared = "T:" + *unit->children[0]->lexinfo;
+                iface = struct_hash(unit->children[0]->lexinfo);
+                break;
+            case TOK_VARDECL:
+                declared = "I:" +
+                    *declared_ident(unit->children[0])->lexinfo;
+                iface = interface_hash(unit->children[0]);
+                break;
+        }
+
+        set<string> refs;
+        collect_refs(unit, refs);
+        if(!declared.empty())
+            refs.insert(declared);
+        uint64_t key = fingerprint(FNV_OFFSET, unit);
+        for(auto it = refs.begin(); it != refs.end(); ++it) {
+            auto seen = visible.find(*it);
+            key = hash_string(key, *it);
+            key = hash_u64(key, seen == visible.end() ? 0 : seen->second);
+        }
+        unit_keys[unit] = key;
+        if(!declared.empty())
+            visible[declared] = iface;
+    }
+}
+
+bool semcache_unit_clean(astree *unit)
+{
+    if(!semcache_incremental)
+        return false;
+    auto key = unit_keys.find(unit);
+    return key != unit_keys.end() && clean_keys.count(key->second);
+}
+
+void semcache_unit_done(astree *unit, int errors)
+{
+    auto key = unit_keys.find(unit);
+    if(errors == 0 && key != unit_keys.end())
+        new_clean_keys.push_back(key->second);
+}
+
+void semcache_load(const char *filename)
+{
+    clean_keys.clear();
+    FILE *file = fopen(filename, "r");
+    if(!file)
+        return;
+    char magic[32];
+    if(fgets(magic, sizeof(magic), file)
+            && string(magic) == SEMCACHE_MAGIC "\n") {
+        uint64_t key;
+        while(fscanf(file, "%" SCNx64, &key) == 1)
+            clean_keys.insert(key);
+    }
+    fclose(file);
+}
+
+int semcache_save(const char *filename)
+{
+    FILE *file = fopen(filename, "w");
+    if(!file)
+        return 1;
+    fprintf(file, SEMCACHE_MAGIC "\n");
+    for(size_t i = 0; i < new_clean_keys.size(); i++)
+        fprintf(file, "%016" PRIx64 "\n", new_clean_keys[i]);
+    fclose(file);
+    return 0;
+}
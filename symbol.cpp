@@ -1,18 +1,29 @@
 #include <vector>
+#include <new>
 
 #include "type.h"
 #include "astree.h"
 #include "lyutils.h"
 #include "semantics.h"
+#include "diag.h"
 using namespace std;
 
 extern int semantic_errors;
+arena symbol_arena = ARENA_INIT("symbol arena");
 size_t next_block = 1;
 vector<size_t> block_num_stack;
 vector<symbol_table*> symbol_stack;
 /* has function and struct definitions,
  * along with global code statements */
-symbol_table *typeid_table = new symbol_table();
+symbol_table *typeid_table = NULL;
+
+symbol_table *new_symbol_table()
+{
+    void *mem = arena_alloc(&symbol_arena, sizeof(symbol_table));
+    return new (mem) symbol_table(0, hash<const string*>(),
+            equal_to<const string*>(),
+            arena_allocator<symbol_entry>(&symbol_arena));
+}
 
 int scope_get_current_depth()
 {
@@ -50,14 +61,15 @@ size_t get_current_block()
 symbol_table *scope_get_top_table()
 {
     if(symbol_stack.back() == NULL) {
-        symbol_stack.back() = new symbol_table();
+        symbol_stack.back() = new_symbol_table();
     }
     return symbol_stack.back();
 }
 
 symbol *create_symbol_in_table(symbol_table *table, astree *node)
 {
-    symbol *sym = new symbol();
+    void *mem = arena_alloc(&symbol_arena, sizeof(symbol));
+    symbol *sym = new (mem) symbol(&symbol_arena);
     sym->filenr = node->filenr;
     sym->linenr = node->linenr;
     sym->offset = node->offset;
@@ -104,30 +116,24 @@ int typeid_table_field_select(astree *node)
     symbol *sym = find_symbol_in_table(typeid_table,
             node->children[0]->type_name);
     if(!sym) {
-        fprintf(stderr,
-                "%ld.%2ld.%3.3ld: typeid '%s' is undefined\n",
-                node->filenr, node->linenr, node->offset,
-                node->children[0]->type_name ?
-                    node->children[0]->type_name->c_str()
-                    : "???");
+        diag_report(DIAG_UNDEFINED_TYPEID, node,
+                node->children[0]->type_name);
         semantic_errors++;
         return 1;
     }
     symbol *field = find_symbol_in_table(sym->fields,
             node->children[1]->lexinfo);
     if(!field) {
-        fprintf(stderr,
-                "%ld.%2ld.%3.3ld: typeid '%s' does not"
-                " have a field '%s'\n",
-                node->filenr, node->linenr, node->offset,
-                node->children[0]->type_name->c_str(),
-                node->children[1]->lexinfo->c_str());
+        diag_report(DIAG_NO_SUCH_FIELD, node,
+                node->children[0]->type_name,
+                node->children[1]->lexinfo);
         semantic_errors++;
         return 1;
     }
     node->symentry = field;
     node->type_name = field->type_name;
     node->children[1]->symentry = field;
+    node->children[1]->attributes = field->attributes;
     node->children[1]->type_name = field->type_name;
     return 0;
 }
@@ -176,16 +182,17 @@ symbol *symbolize_declaration(symbol_table *table, astree *node,
     symbol *prev_sym;
     if((prev_sym = find_symbol_in_table(table, decl->lexinfo))) {
         if(initial_attr.test(ATTR_function) && !prev_sym->fnblock) {
+            /* a definition following its prototype shares the
+             * prototype's symbol */
+            decl->symentry = prev_sym;
+            decl->attributes = prev_sym->attributes;
+            decl->type_name = prev_sym->type_name;
             __print_symbol(prev_sym, decl, attr);
             return prev_sym; 
         } else {
-            fprintf(stderr,
-                    "%ld.%2ld.%3.3ld: duplicate declaration of"
-                    " identifier '%s'. Previous"
-                    " declaration at %ld.%ld.%ld\n",
-                    node->filenr, node->linenr, node->offset,
-                    decl->lexinfo->c_str(), prev_sym->filenr,
-                    prev_sym->linenr, prev_sym->offset);
+            diag_report(DIAG_DUPLICATE_IDENT, node, decl->lexinfo,
+                    diag_loc(prev_sym->filenr, prev_sym->linenr,
+                        prev_sym->offset));
             semantic_errors++;
             return 0;
         }
@@ -200,6 +207,7 @@ symbol *symbolize_declaration(symbol_table *table, astree *node,
         decl->type_name = typenm;
     }
     sym->attributes = attr;
+    decl->attributes = attr;
     sym->block_nr = get_current_block();
     decl->blocknr = get_current_block();
     node->blocknr = get_current_block();
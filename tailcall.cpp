@@ -0,0 +1,128 @@
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+#include "opt.h"
+#include "ir.h"
+#include "semantics.h"
+using namespace std;
+
+/* Tail-call elimination.
+ *
+ * OC has no loop but while, so a lot of it recurses, and a function
+ * that returns what a call to itself returns needs a new frame for
+ * every step. Such a call is replaced by assigning the arguments to
+ * the parameters and jumping back to the start of the function, which
+ * runs in constant stack on every backend.
+ *
+ * The arguments were computed before the call, but one may read a
+ * parameter that is assigned before it, as in f(b, a). Those are
+ * copied into registers before any parameter changes.
+ *
+ * The jump goes to what was the entry block, and a new empty entry
+ * falls into it, so the function still starts with a block nothing
+ * jumps to and the loop has a preheader like any other.
+ *
+ * Tail calls between functions that call each other are left to the
+ * inliner, which copies the callee in at -O2. Its calls back to the
+ * caller then come out here as calls to the function itself.
+ */
+
+bool opt_tail_call(ir_block *block, size_t at)
+{
+    ir_instr *call = block->instrs[at];
+    if(call->op != IR_CALL || at + 1 != block->instrs.size())
+        return false;
+    if(call->dest)
+        return block->term == IR_RETURN && block->retval == call->dest;
+    /* a call to a void function can also be followed by empty blocks
+     * on the way out */
+    unordered_set<ir_block *> seen;
+    while(block->term == IR_FALL || block->term == IR_GOTO) {
+        block = block->succ[0];
+        if(!block)
+            return true;
+        if(!block->instrs.empty() || !seen.insert(block).second)
+            return false;
+    }
+    return block->term == IR_RETURNVOID;
+}
+
+/* whether value is a parameter the copies before argument p assign */
+static bool overwritten(ir_function *fn, ir_instr *call, size_t p,
+        ir_value *value)
+{
+    for(size_t q = 0;q < p;q++) {
+        if(fn->params[q] == value && call->args[q] != value)
+            return true;
+    }
+    return false;
+}
+
+static ir_instr *copy_instr(astree *node, ir_value *dest, ir_value *src)
+{
+    ir_instr *instr = new ir_instr();
+    instr->op = IR_COPY;
+    instr->node = node;
+    instr->dest = dest;
+    instr->args.push_back(src);
+    return instr;
+}
+
+/* turn the call ending block into a jump to head */
+static void replace_call(ir_function *fn, ir_block *block, ir_block *head,
+        size_t &next_reg)
+{
+    ir_instr *call = block->instrs.back();
+    block->instrs.pop_back();
+    vector<ir_value *> values = call->args;
+    for(size_t p = 0;p < values.size();p++) {
+        ir_value *arg = values[p];
+        if(!overwritten(fn, call, p, arg))
+            continue;
+        values[p] = ir_register(fn->module, ir_type_category(arg->type),
+                next_reg++, arg->type);
+        block->instrs.push_back(copy_instr(call->node, values[p], arg));
+    }
+    for(size_t p = 0;p < values.size();p++) {
+        if(values[p] != fn->params[p])
+            block->instrs.push_back(copy_instr(call->node,
+                        fn->params[p], values[p]));
+    }
+    block->term = IR_GOTO;
+    block->cond = block->retval = NULL;
+    block->succ[0] = head;
+    block->succ[1] = NULL;
+    delete call;
+}
+
+int opt_eliminate_tail_calls(ir_function *fn)
+{
+    /* __ocmain is never called */
+    if(!fn->sym)
+        return 0;
+    const string &decl = fn->decl;
+    string name = decl.substr(decl.rfind(' ') + 1);
+    ir_block *head = fn->blocks[0];
+    size_t next_reg = ir_next_register_nr(fn);
+    int replaced = 0;
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        if(block->instrs.empty())
+            continue;
+        size_t at = block->instrs.size() - 1;
+        if(!opt_tail_call(block, at)
+                || "__" + block->instrs[at]->text != name)
+            continue;
+        replace_call(fn, block, head, next_reg);
+        replaced++;
+    }
+    if(!replaced)
+        return 0;
+    if(head->label.empty())
+        head->label = "tailcall";
+    ir_block *entry = ir_new_block(fn, "");
+    entry->succ[0] = head;
+    fn->blocks.insert(fn->blocks.begin(), entry);
+    return replaced;
+}
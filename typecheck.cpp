@@ -5,6 +5,7 @@
 #include "astree.h"
 #include <cassert>
 #include "lyutils.h"
+#include "diag.h"
 using namespace std;
 
 const char *attr_names[ATTR_bitset_size] = {
@@ -79,17 +80,13 @@ int node_generate_attributes(astree *node, attr_bitset &attr)
         /* arrays have the basetype stored as the first child, so
          * we recurse there to get the full type of the node */
         if(node->children[0]->symbol == TOK_VOID) {
-            fprintf(stderr,
-                    "%ld.%2ld.%3.3ld: cannot have void arrays\n",
-                    node->filenr, node->linenr, node->offset);
+            diag_report(DIAG_VOID_ARRAY, node);
             return 0;
         }
         return node_generate_attributes(node->children[0], attr);
     }
     if(node->symbol == TOK_VOID && !attr.test(ATTR_function)) {
-        fprintf(stderr,
-                "%ld.%2ld.%3.3ld: cannot have void declarations\n",
-                node->filenr, node->linenr, node->offset);
+        diag_report(DIAG_VOID_DECLARATION, node);
         return 0;
     }
     if(!attr.test(ATTR_function) && !attr.test(ATTR_field))
@@ -97,24 +94,9 @@ int node_generate_attributes(astree *node, attr_bitset &attr)
     return 1;
 }
 
-attr_bitset get_node_attributes(astree *node)
-{
-    switch(node->symbol) {
-        case TOK_IDENT:
-        case TOK_FIELD:
-        case TOK_DECLID:
-        case TOK_TYPEID:
-            /* lookup */
-            if(node->symentry)
-                return node->symentry->attributes;
-        default:
-            return node->attributes;
-    }
-}
-
 /* yeah, okay, #defines are evil, but
  * this gets annoying to type a lot */
-#define childattr(n) get_node_attributes(node->children[n])
+#define childattr(n) (node->children[n]->attributes)
 #define childnode(n) (node->children[n])
 #define BIT(x) attr_bitset(1 << x)
 
@@ -147,13 +129,9 @@ int attr_check_required(astree *node, attr_bitset required)
 {
     /* check if node_attr has all the bits set by 'required' as well. */
     for(int i=0;i<ATTR_bitset_size;i++) {
-        if(required.test(i) && !get_node_attributes(node).test(i)) {
-            fprintf(stderr,
-                    "%ld.%2ld.%3.3ld: node only has {%s},"
-                    " and {%s} is required\n",
-                    node->filenr, node->linenr, node->offset,
-                    attrs_string(get_node_attributes(node)).c_str(),
-                    attrs_string(required).c_str());
+        if(required.test(i) && !node->attributes.test(i)) {
+            diag_report(DIAG_ATTR_REQUIRED, node, node->attributes,
+                    required);
             return 0;
         }
     }
@@ -164,13 +142,9 @@ int attr_check_notallowed(astree *node, attr_bitset notallowed)
 {
     /* check if node_attr has none of the bits set by 'notallowed' */
     for(int i=0;i<ATTR_bitset_size;i++) {
-        if(notallowed.test(i) && get_node_attributes(node).test(i)) {
-            fprintf(stderr,
-                    "%ld.%2ld.%3.3ld: node has {%s}, but none"
-                    " of {%s} are allowed\n",
-                    node->filenr, node->linenr, node->offset,
-                    attrs_string(get_node_attributes(node)).c_str(),
-                    attrs_string(notallowed).c_str());
+        if(notallowed.test(i) && node->attributes.test(i)) {
+            diag_report(DIAG_ATTR_NOTALLOWED, node, node->attributes,
+                    notallowed);
             return 0;
         }
     }
@@ -181,16 +155,11 @@ int attr_check_any(astree *node, attr_bitset sets)
 {
     /* check if node_attr has at least one of the bits set by 'sets' */
     for(int i=0;i<ATTR_bitset_size;i++) {
-        if(sets.test(i) && get_node_attributes(node).test(i)) {
+        if(sets.test(i) && node->attributes.test(i)) {
             return 1;
         }
     }
-    fprintf(stderr, 
-            "%ld.%2ld.%3.3ld: node has {%s}, but at least"
-            " one of {%s} are required\n",
-            node->filenr, node->linenr, node->offset,
-            attrs_string(get_node_attributes(node)).c_str(),
-            attrs_string(sets).c_str());
+    diag_report(DIAG_ATTR_ANY, node, node->attributes, sets);
     return 0;
 }
 
@@ -261,11 +230,7 @@ int attr_check_compatible(astree *node, attr_bitset a, attr_bitset b)
     if((b & REFERENCE).any() && (a.test(ATTR_null)))
         return 1;
     if(a.any() && b.any()) {
-        fprintf(stderr,
-                "%ld.%2ld.%3.3ld: nodes are not compatible:"
-                " have {%s} and {%s}\n",
-                node->filenr, node->linenr, node->offset,
-                attrs_string(a).c_str(), attrs_string(b).c_str());
+        diag_report(DIAG_INCOMPATIBLE, node, a, b);
     }
     return 0;
 }
@@ -324,7 +289,7 @@ int attr_handle_new(astree *node)
 
 int attr_compare_params(astree *node, symbol *param)
 {
-    attr_bitset attr = get_node_attributes(node);
+    attr_bitset attr = node->attributes;
     int res = 1;
     CONDRETURN(attr_check_compatible(node, attr,
                 param->attributes));
@@ -342,12 +307,8 @@ int attr_handle_call(astree *node)
     /* check parameters */
     unsigned int num_params = node->children.size() - 1;
     if(num_params != func->params.size()) {
-        fprintf(stderr,
-                "%ld.%2ld.%3.3ld: invalid number of parameters to "
-                "function '%s' (needed %ld, have %d)\n",
-                node->filenr, node->linenr, node->offset,
-                childnode(0)->lexinfo->c_str(),
-                func->params.size(), num_params);
+        diag_report(DIAG_PARAM_COUNT, node, childnode(0)->lexinfo,
+                (long)func->params.size(), (long)num_params);
         return 0;
     }
     int fails = 0;
@@ -393,11 +354,7 @@ int attr_handle_index(astree *node)
             | BIT(ATTR_vaddr) | BIT(ATTR_lval);
         if(!childattr(0).test(ATTR_string)) {
             if(childattr(0).any()) {
-                fprintf(stderr,
-                        "%ld.%2ld.%3.3ld: cannot index into"
-                        " non-array non-string value\n",
-                        childnode(0)->filenr, childnode(0)->linenr,
-                        childnode(0)->offset);
+                diag_report(DIAG_BAD_INDEX, childnode(0));
             } else {
                 node->attributes = BIT(ATTR_vaddr) | BIT(ATTR_lval);
             }
@@ -455,16 +412,12 @@ int attr_handle_return(astree *node)
         if(!func)
             return 1;
         if(!func->attributes.test(ATTR_void))
-            fprintf(stderr, "%ld.%2ld.%3.3ld: can't return"
-                    " void in a non-void function\n",
-                    node->filenr, node->linenr, node->offset);
+            diag_report(DIAG_RETURN_VOID, node);
         return func->attributes.test(ATTR_void);
     }
     /* okay, do it with types this time */
     if(!func) {
-        fprintf(stderr, "%ld.%2ld.%3.3ld: can't return non-void"
-                " in a void function (global scope)\n",
-                node->filenr, node->linenr, node->offset);
+        diag_report(DIAG_RETURN_GLOBAL, node);
         return 0;
     }
     return attr_check_compatible(node, childattr(0), func->attributes)
@@ -512,6 +465,25 @@ static int __fn_compare_nodes(astree *n1, astree *n2)
     return 1;
 }
 
+/* must agree with __fn_compare_nodes: signatures that compare equal
+ * have to hash equal, so only the same token codes go in */
+static size_t __fn_hash_node(size_t hash, astree *n)
+{
+    hash = hash * 31 + n->symbol;
+    if(n->symbol == TOK_ARRAY)
+        hash = hash * 31 + n->children[0]->symbol;
+    return hash;
+}
+
+size_t typecheck_signature_hash(astree *function)
+{
+    size_t hash = __fn_hash_node(17, function->children[0]);
+    hash = hash * 31 + function->children[1]->children.size();
+    for(size_t i=0;i<function->children[1]->children.size();i++)
+        hash = __fn_hash_node(hash, function->children[1]->children[i]);
+    return hash;
+}
+
 int typecheck_compare_functions(astree *f1, astree *f2)
 {
     if(!__fn_compare_nodes(f1->children[0], f2->children[0]))
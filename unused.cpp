@@ -0,0 +1,147 @@
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <cctype>
+
+#include "opt.h"
+#include "ir.h"
+using namespace std;
+
+/* Unused function and struct elimination.
+ *
+ * A program that includes a library of helpers only calls a few of
+ * them, but every function and struct it declares would be printed
+ * and compiled. Only what __ocmain can reach is kept: the functions it
+ * calls, the functions those call, and so on, and then the structs
+ * named by a type anywhere in those functions or in a global, along
+ * with the structs their fields name.
+ *
+ * OC has no function pointers, so every use of a function is a call
+ * by name, and a struct is only ever named as "struct s_" and its
+ * name in a C type.
+ */
+
+static string function_name(ir_function *fn)
+{
+    return fn->decl.substr(fn->decl.rfind(' ') + 1);
+}
+
+/* the structs a C type or declaration names */
+static void note_structs(const string &text, vector<string> &named)
+{
+    static const string prefix = "struct s_";
+    for(size_t at = text.find(prefix);at != string::npos;
+            at = text.find(prefix, at)) {
+        at += prefix.size();
+        size_t end = at;
+        while(end < text.size()
+                && (isalnum(text[end]) || text[end] == '_'))
+            end++;
+        named.push_back(text.substr(at, end - at));
+    }
+}
+
+static void note_value(ir_value *value, vector<string> &named)
+{
+    if(value)
+        note_structs(value->type, named);
+}
+
+/* what fn calls and the structs it names */
+static void scan_function(ir_function *fn, vector<string> &called,
+        vector<string> &named)
+{
+    note_structs(fn->decl, named);
+    for(size_t p = 0;p < fn->param_decls.size();p++)
+        note_structs(fn->param_decls[p], named);
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            switch(instr->op) {
+                case IR_CALL:
+                    called.push_back("__" + instr->text);
+                    break;
+                case IR_NEW:
+                    named.push_back(instr->text);
+                    break;
+                case IR_DECL: case IR_NEWARRAY: case IR_NEWFRAME:
+                    note_structs(instr->text, named);
+                    break;
+            }
+            note_value(instr->dest, named);
+            for(size_t arg = 0;arg < instr->args.size();arg++)
+                note_value(instr->args[arg], named);
+        }
+    }
+}
+
+int opt_remove_unused(ir_module *module)
+{
+    unordered_map<string, ir_function *> by_name;
+    for(size_t f = 0;f < module->functions.size();f++) {
+        ir_function *fn = module->functions[f];
+        by_name[function_name(fn)] = fn;
+    }
+    unordered_map<string, ir_struct *> structs;
+    for(size_t s = 0;s < module->structs.size();s++)
+        structs[module->structs[s]->name] = module->structs[s];
+
+    /* the functions reachable from __ocmain */
+    unordered_set<ir_function *> used_fns;
+    vector<ir_function *> work(1, module->main);
+    vector<string> called, named;
+    while(!work.empty()) {
+        ir_function *fn = work.back();
+        work.pop_back();
+        called.clear();
+        scan_function(fn, called, named);
+        for(size_t c = 0;c < called.size();c++) {
+            auto found = by_name.find(called[c]);
+            if(found != by_name.end()
+                    && used_fns.insert(found->second).second)
+                work.push_back(found->second);
+        }
+    }
+
+    /* the structs they name, and the ones those name */
+    for(size_t g = 0;g < module->globals.size();g++)
+        note_structs(module->globals[g]->decl, named);
+    unordered_set<ir_struct *> used_structs;
+    while(!named.empty()) {
+        auto found = structs.find(named.back());
+        named.pop_back();
+        if(found == structs.end()
+                || !used_structs.insert(found->second).second)
+            continue;
+        ir_struct *st = found->second;
+        for(size_t field = 0;field < st->field_types.size();field++)
+            note_structs(st->field_types[field], named);
+    }
+
+    int removed = 0;
+    vector<ir_function *> functions;
+    for(size_t f = 0;f < module->functions.size();f++) {
+        ir_function *fn = module->functions[f];
+        if(used_fns.count(fn)) {
+            functions.push_back(fn);
+        } else {
+            ir_free_function(fn);
+            removed++;
+        }
+    }
+    module->functions = functions;
+    vector<ir_struct *> kept;
+    for(size_t s = 0;s < module->structs.size();s++) {
+        ir_struct *st = module->structs[s];
+        if(used_structs.count(st)) {
+            kept.push_back(st);
+        } else {
+            delete st;
+            removed++;
+        }
+    }
+    module->structs = kept;
+    return removed;
+}
@@ -0,0 +1,326 @@
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "oc.h"
+#include "ir.h"
+#include "vm.h"
+#include "opt.h"
+#include "emit.h"
+using namespace std;
+
+/* The interpreter for oc --interp.
+ *
+ * With GCC or Clang every instruction jumps straight to the handler of
+ * the next one through a computed goto, and handler holds the label of
+ * each. Other compilers get a switch in a loop instead. The frames of
+ * the calls in progress are stacked in one array, and the builtins
+ * are the functions of oclib.c linked into oc.
+ */
+
+extern "C" {
+#define __OCLIB_C__
+#include "oclib.oh"
+extern char **oc_argv;
+void ____assert_fail(char *expr, char *file, int line);
+}
+
+#define STACK_SLOTS (1L << 22)
+
+#if defined(__GNUC__)
+#define TARGET(op) case op: L_##op
+#define DISPATCH() goto *ip->handler
+#else
+#define TARGET(op) case op
+#define DISPATCH() continue
+#endif
+#define NEXT() do { ip++; DISPATCH(); } while(0)
+
+/* where a call returns to */
+struct vm_return {
+    const vm_instr *ip;
+    long *fp, *sp;
+};
+
+/* 32 bit arithmetic that wraps, as in C */
+#define INT(x) ((int)(x))
+#define WRAP(a, op, b) ((int)((unsigned)(a) op (unsigned)(b)))
+
+static long builtin(int nr, long *fp, const int *args)
+{
+    switch(nr) {
+        case VMB_ASSERT_FAIL:
+            ____assert_fail((char *)fp[args[0]], (char *)fp[args[1]],
+                    INT(fp[args[2]]));
+            return 0;
+        case VMB_PUTB:
+            __putb(fp[args[0]]);
+            return 0;
+        case VMB_PUTC:
+            __putc(fp[args[0]]);
+            return 0;
+        case VMB_PUTI:
+            __puti(INT(fp[args[0]]));
+            return 0;
+        case VMB_PUTS:
+            __puts((char *)fp[args[0]]);
+            return 0;
+        case VMB_ENDL:
+            __endl();
+            return 0;
+        case VMB_GETC:
+            return __getc();
+        case VMB_GETW:
+            return (long)__getw();
+        case VMB_GETLN:
+            return (long)__getln();
+        case VMB_GETARGV:
+            return (long)__getargv();
+        case VMB_EXIT:
+            __exit(INT(fp[args[0]]));
+            return 0;
+    }
+    return 0;
+}
+
+static void stack_overflow()
+{
+    oc_errprintf("interpreter stack overflow\n");
+    exit(1);
+}
+
+void vm_run(vm_program &program)
+{
+#if defined(__GNUC__)
+    static const void *labels[VM_NR_OPS] = {
+        &&L_VM_HALT, &&L_VM_MOV, &&L_VM_ADD, &&L_VM_SUB, &&L_VM_MUL,
+        &&L_VM_DIV, &&L_VM_MOD, &&L_VM_LT, &&L_VM_GT, &&L_VM_LE,
+        &&L_VM_GE, &&L_VM_EQ, &&L_VM_NE, &&L_VM_LT_JZ, &&L_VM_GT_JZ,
+        &&L_VM_LE_JZ, &&L_VM_GE_JZ, &&L_VM_EQ_JZ, &&L_VM_NE_JZ,
+        &&L_VM_NEG, &&L_VM_NOT, &&L_VM_CHR, &&L_VM_JMP, &&L_VM_JZ,
+        &&L_VM_JNZ,
+        &&L_VM_LOAD1, &&L_VM_LOAD8, &&L_VM_STORE1, &&L_VM_STORE8,
+        &&L_VM_GLOAD, &&L_VM_GSTORE, &&L_VM_INDEX1, &&L_VM_INDEX8,
+        &&L_VM_FIELD, &&L_VM_NEW, &&L_VM_NEWARRAY, &&L_VM_NEWFRAME,
+        &&L_VM_CALL, &&L_VM_BUILTIN, &&L_VM_RET, &&L_VM_RETVOID,
+    };
+    for(size_t i = 0;i < program.code.size();i++)
+        program.code[i].handler = labels[program.code[i].op];
+#endif
+    const vm_instr *code = program.code.data();
+    const int *args = program.args.data();
+    vector<long> globals(program.nr_globals);
+    long *stack = new long[STACK_SLOTS];
+    long *stack_end = stack + STACK_SLOTS;
+    vector<vm_return> calls;
+
+    /* call __ocmain from the halt at the start of the code */
+    vm_function *fn = &program.functions[program.main];
+    vm_return halt = { code, NULL, NULL };
+    calls.push_back(halt);
+    long *fp = stack, *sp = stack + fn->nr_slots;
+    if(sp > stack_end)
+        stack_overflow();
+    memcpy(fp + fn->const_base, fn->consts.data(),
+            fn->consts.size() * sizeof(long));
+    const vm_instr *ip = code + fn->entry;
+
+    for(;;) {
+        switch(ip->op) {
+            TARGET(VM_HALT):
+                delete[] stack;
+                return;
+            TARGET(VM_MOV):
+                fp[ip->a] = fp[ip->b];
+                NEXT();
+            TARGET(VM_ADD):
+                fp[ip->a] = WRAP(fp[ip->b], +, fp[ip->c]);
+                NEXT();
+            TARGET(VM_SUB):
+                fp[ip->a] = WRAP(fp[ip->b], -, fp[ip->c]);
+                NEXT();
+            TARGET(VM_MUL):
+                fp[ip->a] = WRAP(fp[ip->b], *, fp[ip->c]);
+                NEXT();
+            TARGET(VM_DIV):
+                fp[ip->a] = INT(fp[ip->b]) / INT(fp[ip->c]);
+                NEXT();
+            TARGET(VM_MOD):
+                fp[ip->a] = INT(fp[ip->b]) % INT(fp[ip->c]);
+                NEXT();
+            TARGET(VM_LT):
+                fp[ip->a] = fp[ip->b] < fp[ip->c];
+                NEXT();
+            TARGET(VM_GT):
+                fp[ip->a] = fp[ip->b] > fp[ip->c];
+                NEXT();
+            TARGET(VM_LE):
+                fp[ip->a] = fp[ip->b] <= fp[ip->c];
+                NEXT();
+            TARGET(VM_GE):
+                fp[ip->a] = fp[ip->b] >= fp[ip->c];
+                NEXT();
+            TARGET(VM_EQ):
+                fp[ip->a] = fp[ip->b] == fp[ip->c];
+                NEXT();
+            TARGET(VM_NE):
+                fp[ip->a] = fp[ip->b] != fp[ip->c];
+                NEXT();
+            TARGET(VM_LT_JZ):
+                if(!(fp[ip->a] = fp[ip->b] < fp[ip->c])) {
+                    ip = code + ip->d;
+                    DISPATCH();
+                }
+                NEXT();
+            TARGET(VM_GT_JZ):
+                if(!(fp[ip->a] = fp[ip->b] > fp[ip->c])) {
+                    ip = code + ip->d;
+                    DISPATCH();
+                }
+                NEXT();
+            TARGET(VM_LE_JZ):
+                if(!(fp[ip->a] = fp[ip->b] <= fp[ip->c])) {
+                    ip = code + ip->d;
+                    DISPATCH();
+                }
+                NEXT();
+            TARGET(VM_GE_JZ):
+                if(!(fp[ip->a] = fp[ip->b] >= fp[ip->c])) {
+                    ip = code + ip->d;
+                    DISPATCH();
+                }
+                NEXT();
+            TARGET(VM_EQ_JZ):
+                if(!(fp[ip->a] = fp[ip->b] == fp[ip->c])) {
+                    ip = code + ip->d;
+                    DISPATCH();
+                }
+                NEXT();
+            TARGET(VM_NE_JZ):
+                if(!(fp[ip->a] = fp[ip->b] != fp[ip->c])) {
+                    ip = code + ip->d;
+                    DISPATCH();
+                }
+                NEXT();
+            TARGET(VM_NEG):
+                fp[ip->a] = WRAP(0, -, fp[ip->b]);
+                NEXT();
+            TARGET(VM_NOT):
+                fp[ip->a] = !fp[ip->b];
+                NEXT();
+            TARGET(VM_CHR):
+                fp[ip->a] = (signed char)fp[ip->b];
+                NEXT();
+            TARGET(VM_JMP):
+                ip = code + ip->d;
+                DISPATCH();
+            TARGET(VM_JZ):
+                if(!fp[ip->a]) {
+                    ip = code + ip->d;
+                    DISPATCH();
+                }
+                NEXT();
+            TARGET(VM_JNZ):
+                if(fp[ip->a]) {
+                    ip = code + ip->d;
+                    DISPATCH();
+                }
+                NEXT();
+            TARGET(VM_LOAD1):
+                fp[ip->a] = *(signed char *)fp[ip->b];
+                NEXT();
+            TARGET(VM_LOAD8):
+                fp[ip->a] = *(long *)fp[ip->b];
+                NEXT();
+            TARGET(VM_STORE1):
+                *(char *)fp[ip->a] = fp[ip->b];
+                NEXT();
+            TARGET(VM_STORE8):
+                *(long *)fp[ip->a] = fp[ip->b];
+                NEXT();
+            TARGET(VM_GLOAD):
+                fp[ip->a] = globals[ip->b];
+                NEXT();
+            TARGET(VM_GSTORE):
+                globals[ip->a] = fp[ip->b];
+                NEXT();
+            TARGET(VM_INDEX1):
+                fp[ip->a] = fp[ip->b] + INT(fp[ip->c]);
+                NEXT();
+            TARGET(VM_INDEX8):
+                fp[ip->a] = fp[ip->b] + 8L * INT(fp[ip->c]);
+                NEXT();
+            TARGET(VM_FIELD):
+                fp[ip->a] = fp[ip->b] + ip->c;
+                NEXT();
+            TARGET(VM_NEW):
+                fp[ip->a] = (long)xcalloc(1, ip->c);
+                NEXT();
+            TARGET(VM_NEWARRAY):
+                fp[ip->a] = (long)xcalloc(INT(fp[ip->b]), ip->c);
+                NEXT();
+            TARGET(VM_NEWFRAME):
+                memset(fp + ip->b, 0, ip->c * sizeof(long));
+                fp[ip->a] = (long)(fp + ip->b);
+                NEXT();
+            TARGET(VM_CALL): {
+                fn = &program.functions[ip->b];
+                long *frame = sp;
+                if(frame + fn->nr_slots > stack_end)
+                    stack_overflow();
+                for(int p = 0;p < fn->nr_params;p++)
+                    frame[p] = fp[args[ip->c + p]];
+                memcpy(frame + fn->const_base, fn->consts.data(),
+                        fn->consts.size() * sizeof(long));
+                vm_return ret = { ip, fp, sp };
+                calls.push_back(ret);
+                fp = frame;
+                sp = frame + fn->nr_slots;
+                ip = code + fn->entry;
+                DISPATCH();
+            }
+            TARGET(VM_BUILTIN): {
+                long value = builtin(ip->b, fp, args + ip->c);
+                if(ip->a >= 0)
+                    fp[ip->a] = value;
+                NEXT();
+            }
+            TARGET(VM_RET): {
+                long value = fp[ip->a];
+                vm_return &ret = calls.back();
+                ip = ret.ip;
+                fp = ret.fp;
+                sp = ret.sp;
+                calls.pop_back();
+                if(ip->a >= 0)
+                    fp[ip->a] = value;
+                NEXT();
+            }
+            TARGET(VM_RETVOID): {
+                vm_return &ret = calls.back();
+                ip = ret.ip;
+                fp = ret.fp;
+                sp = ret.sp;
+                calls.pop_back();
+                NEXT();
+            }
+        }
+    }
+}
+
+int oc_run_interp(astree *root, char **argv)
+{
+    ir_module *module = ir_build(root);
+    opt_run(module);
+    vm_program program;
+    int errors = vm_compile(module, program);
+    ir_free(module);
+    if(errors)
+        return errors;
+    oc_argv = argv;
+    vm_run(program);
+    fflush(NULL);
+    return 0;
+}
@@ -0,0 +1,78 @@
+#ifndef __VM_H
+#define __VM_H
+
+#include <string>
+#include <vector>
+#include "ir.h"
+
+/* The bytecode run by oc --interp.
+ *
+ * Code is register based: every instruction names its operands by
+ * their slot in the frame of the running function. A frame holds the
+ * parameters first, then the registers and locals, then the constants
+ * of the function, which are copied in on every call. All slots are
+ * 8 bytes; ints, chars and bools are kept sign extended. Globals
+ * have their own array and are moved in and out of scratch slots.
+ *
+ * In memory allocated by new, struct fields are 8 bytes each and
+ * array elements are 1 byte for chars and bools and 8 otherwise, so
+ * strings are plain C strings the runtime can print. Objects that
+ * don't escape their function are kept in its frame, after the
+ * locals.
+ */
+
+enum {
+    VM_HALT, VM_MOV, VM_ADD, VM_SUB, VM_MUL, VM_DIV, VM_MOD,
+    VM_LT, VM_GT, VM_LE, VM_GE, VM_EQ, VM_NE,
+    /* compare, store the result and jump to d if it is false */
+    VM_LT_JZ, VM_GT_JZ, VM_LE_JZ, VM_GE_JZ, VM_EQ_JZ, VM_NE_JZ,
+    VM_NEG, VM_NOT, VM_CHR, VM_JMP, VM_JZ,
+    /* jump to d if a is true */
+    VM_JNZ,
+    VM_LOAD1, VM_LOAD8, VM_STORE1, VM_STORE8, VM_GLOAD, VM_GSTORE,
+    VM_INDEX1, VM_INDEX8, VM_FIELD, VM_NEW, VM_NEWARRAY,
+    /* clear c slots from b on and point a at them */
+    VM_NEWFRAME,
+    VM_CALL, VM_BUILTIN, VM_RET, VM_RETVOID,
+    VM_NR_OPS
+};
+
+/* the functions of oclib.oh, called by VM_BUILTIN */
+enum {
+    VMB_ASSERT_FAIL, VMB_PUTB, VMB_PUTC, VMB_PUTI, VMB_PUTS, VMB_ENDL,
+    VMB_GETC, VMB_GETW, VMB_GETLN, VMB_GETARGV, VMB_EXIT
+};
+
+/* a is usually the destination, b and c the operands and d a jump
+ * target. handler is filled in by the interpreter when it dispatches
+ * by computed goto. */
+struct vm_instr {
+    const void *handler;
+    int op;
+    int a, b, c, d;
+};
+
+struct vm_function {
+    string name;
+    size_t entry;           /* index of the first instruction */
+    int nr_params;
+    int nr_slots;
+    int const_base;         /* constants fill the slots from here */
+    vector<long> consts;
+};
+
+struct vm_program {
+    vector<vm_instr> code;
+    vector<vm_function> functions;
+    /* argument slots of calls, indexed by the c of VM_CALL */
+    vector<int> args;
+    /* the bytes of the string constants */
+    vector<string> strings;
+    size_t nr_globals;
+    size_t main;            /* index of __ocmain */
+};
+
+int vm_compile(ir_module *module, vm_program &program);
+void vm_run(vm_program &program);
+
+#endif
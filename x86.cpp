@@ -0,0 +1,455 @@
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdio>
+#include <cassert>
+
+#include "ir.h"
+#include "x86.h"
+#include "opt.h"
+#include "emit.h"
+#include "astree.h"
+#include "semantics.h"
+using namespace std;
+
+/* The x86-64 backend.
+ *
+ * This generates code for the same IR the oil printer uses, for the
+ * System V ABI. It is printed as GNU assembler text to be linked
+ * against oclib.o, or assembled in memory for --run (see x86asm.cpp).
+ * Code generation is deliberately simple: every register and local
+ * lives in its own 8 byte stack slot, and each instruction loads its
+ * operands into %rax and %rcx, computes, and stores the result. %r11
+ * holds an address being read or written through.
+ *
+ * ints are 4 bytes, chars and bools 1 byte and everything else is a
+ * pointer. chars are sign extended when loaded, as C does.
+ */
+
+static ir_module *module;
+/* field offsets by mangled field name, struct sizes by C type */
+static unordered_map<string, long> field_offsets;
+static unordered_map<string, long> struct_sizes;
+/* where the registers and locals of the current function live, and
+ * the objects it keeps in its frame */
+static unordered_map<ir_value *, long> slots;
+static unordered_map<ir_instr *, long> frame_objects;
+static size_t function_nr;
+
+static const int arg_regs[6] = {
+    X86_RDI, X86_RSI, X86_RDX, X86_RCX, X86_R8, X86_R9
+};
+
+static long type_size(const string &type)
+{
+    if(type.find('*') != string::npos)
+        return 8;
+    if(type == "int")
+        return 4;
+    if(type == "char")
+        return 1;
+    return 0;
+}
+
+/* the type of the object an address register points at */
+static string object_type(const string &address_type)
+{
+    return address_type.substr(0, address_type.size() - 1);
+}
+
+static long value_size(ir_value *value)
+{
+    switch(value->kind) {
+        case IRV_CONST:
+            switch(value->category) {
+                case IR_INT:
+                    return 4;
+                case IR_CHAR: case IR_BOOL:
+                    return 1;
+            }
+            return 8;
+        case IRV_STRING:
+            return 8;
+        case IRV_DEREF:
+            return type_size(object_type(value->base->type));
+        default:
+            return type_size(value->type);
+    }
+}
+
+static int size_of(ir_value *value)
+{
+    /* registers hold ints, bools and chars as 4 bytes */
+    return value_size(value) == 8 ? 8 : 4;
+}
+
+/* the memory operand of a value that lives in memory. Reading or
+ * writing through an address first loads the address into %r11. */
+static x86_operand location(ir_value *value)
+{
+    if(value->kind == IRV_DEREF) {
+        x86_ins(X86_MOV, 8, location(value->base), x86_r(X86_R11));
+        return x86_mem(X86_R11, 0);
+    }
+    auto slot = slots.find(value);
+    if(slot != slots.end())
+        return x86_mem(X86_RBP, slot->second);
+    /* a global */
+    return x86_sym(value->name);
+}
+
+/* load a value into reg, widened to 32 bits unless it is a pointer */
+static void load(ir_value *value, int reg)
+{
+    long size = value_size(value);
+    if(value->kind == IRV_CONST) {
+        x86_ins(X86_MOV, size_of(value), x86_imm(value->cval),
+                x86_r(reg));
+        return;
+    }
+    if(value->kind == IRV_STRING) {
+        x86_ins(X86_LEA, 8, x86_sym(".L" + value->name), x86_r(reg));
+        return;
+    }
+    x86_operand mem = location(value);
+    if(size == 1)
+        x86_ins(X86_MOVSBL, 4, mem, x86_r(reg));
+    else
+        x86_ins(X86_MOV, size, mem, x86_r(reg));
+}
+
+static void store(int reg, ir_value *dest)
+{
+    long size = value_size(dest);
+    x86_operand mem = location(dest);
+    x86_ins(X86_MOV, size, x86_r(reg), mem);
+}
+
+static void emit_binop(ir_instr *instr)
+{
+    const string &op = instr->opname;
+    load(instr->args[0], X86_RAX);
+    load(instr->args[1], X86_RCX);
+    x86_operand rax = x86_r(X86_RAX), rcx = x86_r(X86_RCX);
+    if(op == "+")
+        x86_ins(X86_ADD, 4, rcx, rax);
+    else if(op == "-")
+        x86_ins(X86_SUB, 4, rcx, rax);
+    else if(op == "*")
+        x86_ins(X86_IMUL, 4, rcx, rax);
+    else if(op == "/" || op == "%") {
+        x86_ins(X86_CLTD, 4);
+        x86_ins(X86_IDIV, 4, rcx);
+        if(op == "%")
+            x86_ins(X86_MOV, 4, x86_r(X86_RDX), rax);
+    } else {
+        int set = op == "<" ? X86_SETL : op == ">" ? X86_SETG
+            : op == "<=" ? X86_SETLE : op == ">=" ? X86_SETGE
+            : op == "==" ? X86_SETE : X86_SETNE;
+        if(value_size(instr->args[0]) == 8
+                || value_size(instr->args[1]) == 8)
+            x86_ins(X86_CMP, 8, rcx, rax);
+        else
+            x86_ins(X86_CMP, 4, rcx, rax);
+        x86_ins(set, 1, rax);
+    }
+    store(X86_RAX, instr->dest);
+}
+
+static void emit_unop(ir_instr *instr)
+{
+    const string &op = instr->opname;
+    load(instr->args[0], X86_RAX);
+    if(op == "-")
+        x86_ins(X86_NEG, 4, x86_r(X86_RAX));
+    else if(op == "!")
+        x86_ins(X86_XOR, 4, x86_imm(1), x86_r(X86_RAX));
+    /* +, and the conversions, are done by the load and the store */
+    store(X86_RAX, instr->dest);
+}
+
+static void emit_call(ir_instr *instr)
+{
+    size_t nr_args = instr->args.size();
+    size_t on_stack = nr_args > 6 ? nr_args - 6 : 0;
+    /* keep the stack 16 byte aligned at the call */
+    if(on_stack % 2)
+        x86_ins(X86_SUB, 8, x86_imm(8), x86_r(X86_RSP));
+    for(size_t arg = nr_args;arg-- > 6;) {
+        load(instr->args[arg], X86_RAX);
+        x86_ins(X86_PUSH, 8, x86_r(X86_RAX));
+    }
+    for(size_t arg = 0;arg < nr_args && arg < 6;arg++)
+        load(instr->args[arg], arg_regs[arg]);
+    x86_ins(X86_CALL, 8, x86_sym("__" + instr->text));
+    if(on_stack)
+        x86_ins(X86_ADD, 8, x86_imm((on_stack + on_stack % 2) * 8),
+                x86_r(X86_RSP));
+    if(instr->dest)
+        store(X86_RAX, instr->dest);
+}
+
+static void emit_xcalloc(ir_value *count, long size, ir_value *dest)
+{
+    if(count)
+        load(count, X86_RDI);
+    else
+        x86_ins(X86_MOV, 4, x86_imm(1), x86_r(X86_RDI));
+    x86_ins(X86_MOV, 4, x86_imm(size), x86_r(X86_RSI));
+    x86_ins(X86_CALL, 8, x86_sym("xcalloc"));
+    store(X86_RAX, dest);
+}
+
+static long frame_object_size(ir_instr *instr)
+{
+    auto found = struct_sizes.find(instr->text);
+    long size = found != struct_sizes.end() ? found->second
+        : type_size(instr->text);
+    return (instr->args[0]->cval * size + 7) & ~7L;
+}
+
+/* clear the object eight bytes at a time, then point at it */
+static void emit_newframe(ir_instr *instr)
+{
+    long offset = frame_objects[instr];
+    x86_ins(X86_XOR, 4, x86_r(X86_RAX), x86_r(X86_RAX));
+    for(long at = 0;at < frame_object_size(instr);at += 8)
+        x86_ins(X86_MOV, 8, x86_r(X86_RAX),
+                x86_mem(X86_RBP, offset + at));
+    x86_ins(X86_LEA, 8, x86_mem(X86_RBP, offset), x86_r(X86_RAX));
+    store(X86_RAX, instr->dest);
+}
+
+static void emit_instr(ir_instr *instr)
+{
+    switch(instr->op) {
+        case IR_BINOP:
+            emit_binop(instr);
+            break;
+        case IR_UNOP:
+            emit_unop(instr);
+            break;
+        case IR_COPY: case IR_DECL:
+            if(instr->args.empty())
+                break;
+            load(instr->args[0], X86_RAX);
+            store(X86_RAX, instr->dest);
+            break;
+        case IR_CALL:
+            emit_call(instr);
+            break;
+        case IR_INDEX:
+            load(instr->args[0], X86_RAX);
+            load(instr->args[1], X86_RCX);
+            x86_ins(X86_MOVSLQ, 8, x86_r(X86_RCX), x86_r(X86_RCX));
+            x86_ins(X86_LEA, 8, x86_indexed(X86_RAX, X86_RCX,
+                        type_size(object_type(instr->dest->type))),
+                    x86_r(X86_RAX));
+            store(X86_RAX, instr->dest);
+            break;
+        case IR_FIELD:
+            load(instr->args[0], X86_RAX);
+            x86_ins(X86_ADD, 8, x86_imm(field_offsets[instr->text]),
+                    x86_r(X86_RAX));
+            store(X86_RAX, instr->dest);
+            break;
+        case IR_NEW:
+            emit_xcalloc(NULL, struct_sizes["struct s_" + instr->text],
+                    instr->dest);
+            break;
+        case IR_NEWARRAY:
+            emit_xcalloc(instr->args[0], type_size(instr->text),
+                    instr->dest);
+            break;
+        case IR_NEWSTRING:
+            emit_xcalloc(instr->args[0], 1, instr->dest);
+            break;
+        case IR_NEWFRAME:
+            emit_newframe(instr);
+            break;
+        default:
+            assert(0);
+    }
+}
+
+static string block_label(ir_block *block)
+{
+    return ".L" + to_string(function_nr) + "_" + to_string(block->id);
+}
+
+static void emit_epilogue()
+{
+    x86_ins(X86_LEAVE, 8);
+    x86_ins(X86_RET, 8);
+}
+
+/* compare and jump to target if the comparison is false, or if it is
+ * true when if_true is set */
+static void emit_test(ir_instr *test, ir_block *target, bool if_true)
+{
+    const string op = if_true ? test->opname
+        : ir_inverse_compare(test->opname);
+    int jump = op == "<" ? X86_JL : op == ">" ? X86_JG
+        : op == "<=" ? X86_JLE : op == ">=" ? X86_JGE
+        : op == "==" ? X86_JE : X86_JNE;
+    load(test->args[0], X86_RAX);
+    load(test->args[1], X86_RCX);
+    if(value_size(test->args[0]) == 8 || value_size(test->args[1]) == 8)
+        x86_ins(X86_CMP, 8, x86_r(X86_RCX), x86_r(X86_RAX));
+    else
+        x86_ins(X86_CMP, 4, x86_r(X86_RCX), x86_r(X86_RAX));
+    x86_ins(jump, 8, x86_sym(block_label(target)));
+}
+
+static void emit_block(ir_block *block, ir_block *next)
+{
+    x86_label(block_label(block));
+    bool if_true;
+    ir_block *target;
+    size_t nr_instrs = block->instrs.size();
+    if(block->test_fused)
+        nr_instrs--;
+    for(size_t i = 0;i < nr_instrs;i++)
+        emit_instr(block->instrs[i]);
+    switch(block->term) {
+        case IR_BRANCH:
+            if_true = ir_jump_if_true(block, next);
+            target = block->succ[if_true ? 0 : 1];
+            if(block->test_fused) {
+                emit_test(block->instrs.back(), target, if_true);
+            } else {
+                load(block->cond, X86_RAX);
+                x86_ins(X86_TEST, 4, x86_r(X86_RAX), x86_r(X86_RAX));
+                x86_ins(if_true ? X86_JNE : X86_JE, 8,
+                        x86_sym(block_label(target)));
+            }
+            if(!if_true && block->succ[0] != next)
+                x86_ins(X86_JMP, 8,
+                        x86_sym(block_label(block->succ[0])));
+            break;
+        case IR_GOTO: case IR_FALL:
+            if(!block->succ[0])
+                emit_epilogue();
+            else if(block->succ[0] != next)
+                x86_ins(X86_JMP, 8,
+                        x86_sym(block_label(block->succ[0])));
+            break;
+        case IR_RETURN:
+            load(block->retval, X86_RAX);
+            emit_epilogue();
+            break;
+        case IR_RETURNVOID:
+            emit_epilogue();
+            break;
+    }
+}
+
+static void assign_slot(ir_value *value, long &frame)
+{
+    if(!value)
+        return;
+    if(value->kind == IRV_DEREF)
+        value = value->base;
+    if(slots.count(value))
+        return;
+    if(value->kind == IRV_REG || (value->kind == IRV_VAR
+                && value->sym->block_nr != SCOPE_GLOBAL)) {
+        frame += 8;
+        slots[value] = -frame;
+    }
+}
+
+static void emit_function(ir_function *fn, const string &name)
+{
+    slots.clear();
+    frame_objects.clear();
+    long frame = 0;
+    /* the first six parameters arrive in registers and get a slot,
+     * the rest are already on the stack above the return address */
+    for(size_t p = 0;p < fn->params.size();p++) {
+        if(p < 6)
+            assign_slot(fn->params[p], frame);
+        else
+            slots[fn->params[p]] = 16 + 8 * (p - 6);
+    }
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *block = fn->blocks[b];
+        for(size_t i = 0;i < block->instrs.size();i++) {
+            ir_instr *instr = block->instrs[i];
+            if(instr->op == IR_NEWFRAME) {
+                frame += frame_object_size(instr);
+                frame_objects[instr] = -frame;
+            }
+            assign_slot(instr->dest, frame);
+            for(size_t arg = 0;arg < instr->args.size();arg++)
+                assign_slot(instr->args[arg], frame);
+        }
+    }
+    frame = (frame + 15) & ~15L;
+
+    x86_function_begin(name);
+    x86_ins(X86_PUSH, 8, x86_r(X86_RBP));
+    x86_ins(X86_MOV, 8, x86_r(X86_RSP), x86_r(X86_RBP));
+    if(frame)
+        x86_ins(X86_SUB, 8, x86_imm(frame), x86_r(X86_RSP));
+    for(size_t p = 0;p < fn->params.size() && p < 6;p++)
+        store(arg_regs[p], fn->params[p]);
+    for(size_t b = 0;b < fn->blocks.size();b++) {
+        ir_block *next = b + 1 < fn->blocks.size() ? fn->blocks[b+1]
+            : NULL;
+        emit_block(fn->blocks[b], next);
+    }
+    x86_function_end(name);
+    function_nr++;
+}
+
+/* lay out the structures the way the C compiler would */
+static void layout_structs()
+{
+    field_offsets.clear();
+    struct_sizes.clear();
+    for(size_t s = 0;s < module->structs.size();s++) {
+        ir_struct *st = module->structs[s];
+        long offset = 0, align = 1;
+        for(size_t f = 0;f < st->field_types.size();f++) {
+            long size = type_size(st->field_types[f]);
+            offset = (offset + size - 1) / size * size;
+            field_offsets[st->field_names[f]] = offset;
+            offset += size;
+            if(size > align)
+                align = size;
+        }
+        struct_sizes["struct s_" + st->name] =
+            (offset + align - 1) / align * align;
+    }
+}
+
+/* generate the code of a module with the assembler set up by
+ * x86_assemble_text or x86_assemble_image */
+void x86_generate(ir_module *mod)
+{
+    module = mod;
+    function_nr = 0;
+    layout_structs();
+    for(size_t s = 0;s < module->strings.size();s++)
+        x86_string(".Ls" + to_string(s + 1), *module->strings[s]);
+    for(size_t g = 0;g < module->globals.size();g++)
+        x86_global(module->globals[g]->var->name);
+    x86_section_text();
+    for(size_t f = 0;f < module->functions.size();f++) {
+        ir_function *fn = module->functions[f];
+        emit_function(fn, fn->decl.substr(fn->decl.rfind(' ') + 1));
+    }
+    emit_function(module->main, "__ocmain");
+    x86_finish();
+}
+
+int oc_run_emit_asm(astree *root, FILE *out)
+{
+    ir_module *mod = ir_build(root);
+    opt_run(mod);
+    x86_assemble_text(out);
+    x86_generate(mod);
+    ir_free(mod);
+    return 0;
+}
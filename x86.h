@@ -0,0 +1,86 @@
+#ifndef __X86_H
+#define __X86_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdio>
+#include "ir.h"
+
+/* The x86-64 assembler. The code generator describes instructions
+ * with the calls below, and they are either printed as GNU assembler
+ * text or encoded into an image in memory that the JIT loads. */
+
+/* the general purpose registers, numbered as the encoding does */
+enum {
+    X86_RAX, X86_RCX, X86_RDX, X86_RBX, X86_RSP, X86_RBP, X86_RSI,
+    X86_RDI, X86_R8, X86_R9, X86_R10, X86_R11
+};
+
+enum { X86_REG, X86_MEM, X86_SYM, X86_IMM };
+
+/* a register, disp(base) or (base,index,scale), a symbol addressed
+ * relative to %rip (or the target of a call or jump), or an
+ * immediate */
+struct x86_operand {
+    int kind;
+    int reg, index;     /* index is -1 without one */
+    long value, scale;  /* immediate or displacement */
+    string sym;
+};
+
+x86_operand x86_r(int reg);
+x86_operand x86_mem(int base, long disp);
+x86_operand x86_indexed(int base, int index, long scale);
+x86_operand x86_sym(const string &sym);
+x86_operand x86_imm(long value);
+
+/* the instructions the code generator uses. Sizes are 1, 4 or 8
+ * bytes; movsbl widens a byte to 4 and movslq 4 bytes to 8. */
+enum {
+    X86_MOV, X86_MOVSBL, X86_MOVSLQ, X86_LEA, X86_ADD, X86_SUB,
+    X86_IMUL, X86_CMP, X86_TEST, X86_XOR, X86_NEG, X86_IDIV, X86_CLTD,
+    X86_SETE, X86_SETNE, X86_SETL, X86_SETGE, X86_SETLE, X86_SETG,
+    X86_PUSH, X86_LEAVE, X86_RET, X86_CALL, X86_JMP,
+    X86_JE, X86_JNE, X86_JL, X86_JGE, X86_JLE, X86_JG
+};
+
+enum { X86_TEXT, X86_RODATA, X86_BSS };
+
+struct x86_symbol {
+    int section;
+    size_t offset;
+};
+
+/* a 32 bit displacement in the text, relative to the end of the
+ * instruction, to a symbol that is only placed when loading */
+struct x86_fixup {
+    size_t offset;
+    long addend;
+    string sym;
+};
+
+struct x86_image {
+    vector<unsigned char> text, rodata;
+    size_t bss_size;
+    unordered_map<string, x86_symbol> symbols;
+    vector<x86_fixup> fixups;
+};
+
+void x86_assemble_text(FILE *out);
+void x86_assemble_image(x86_image *image);
+void x86_ins(int op, int size);
+void x86_ins(int op, int size, const x86_operand &dst);
+void x86_ins(int op, int size, const x86_operand &src,
+        const x86_operand &dst);
+void x86_label(const string &name);
+void x86_function_begin(const string &name);
+void x86_function_end(const string &name);
+void x86_string(const string &name, const string &literal);
+void x86_global(const string &name);
+void x86_section_text();
+void x86_finish();
+
+void x86_generate(ir_module *module);
+
+#endif
@@ -0,0 +1,472 @@
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cassert>
+
+#include "x86.h"
+using namespace std;
+
+/* The assembler behind the x86-64 backend.
+ *
+ * With -S the instructions are printed for the GNU assembler. For the
+ * JIT they are encoded here instead: code goes into the text of an
+ * x86_image, string constants into its rodata and globals into its
+ * bss. References to symbols are all 32 bit displacements from %rip,
+ * which are left as fixups until the image is placed in memory.
+ *
+ * Only the forms the code generator uses are encoded, so there is no
+ * operand size prefix and jumps are always the long form.
+ */
+
+static FILE *asmfile;
+static x86_image *image;
+static int section;
+
+#define INDENT "        "
+
+static const char *reg_names[3][12] = {
+    { "%rax", "%rcx", "%rdx", "%rbx", "%rsp", "%rbp", "%rsi", "%rdi",
+      "%r8", "%r9", "%r10", "%r11" },
+    { "%eax", "%ecx", "%edx", "%ebx", "%esp", "%ebp", "%esi", "%edi",
+      "%r8d", "%r9d", "%r10d", "%r11d" },
+    { "%al", "%cl", "%dl", "%bl", "%spl", "%bpl", "%sil", "%dil",
+      "%r8b", "%r9b", "%r10b", "%r11b" },
+};
+
+/* mnemonics by op, and whether they take a size suffix */
+static const struct {
+    const char *name;
+    bool sized;
+} mnemonics[] = {
+    { "mov", true }, { "movsbl", false }, { "movslq", false },
+    { "lea", true }, { "add", true }, { "sub", true }, { "imul", true },
+    { "cmp", true }, { "test", true }, { "xor", true }, { "neg", true },
+    { "idiv", true }, { "cltd", false }, { "sete", false },
+    { "setne", false }, { "setl", false }, { "setge", false },
+    { "setle", false }, { "setg", false }, { "push", true },
+    { "leave", false }, { "ret", false }, { "call", false },
+    { "jmp", false }, { "je", false }, { "jne", false },
+    { "jl", false }, { "jge", false }, { "jle", false }, { "jg", false },
+};
+
+/* the condition codes of the setcc and jcc ops, in the order of the
+ * enum */
+static const unsigned char condition_codes[] = {
+    0x4, 0x5, 0xc, 0xd, 0xe, 0xf,
+};
+
+x86_operand x86_r(int reg)
+{
+    x86_operand operand = { X86_REG, reg, -1, 0, 1, "" };
+    return operand;
+}
+
+x86_operand x86_mem(int base, long disp)
+{
+    x86_operand operand = { X86_MEM, base, -1, disp, 1, "" };
+    return operand;
+}
+
+x86_operand x86_indexed(int base, int index, long scale)
+{
+    x86_operand operand = { X86_MEM, base, index, 0, scale, "" };
+    return operand;
+}
+
+x86_operand x86_sym(const string &sym)
+{
+    x86_operand operand = { X86_SYM, 0, -1, 0, 1, sym };
+    return operand;
+}
+
+x86_operand x86_imm(long value)
+{
+    x86_operand operand = { X86_IMM, 0, -1, value, 1, "" };
+    return operand;
+}
+
+void x86_assemble_text(FILE *out)
+{
+    asmfile = out;
+    image = NULL;
+    section = -1;
+}
+
+void x86_assemble_image(x86_image *out)
+{
+    asmfile = NULL;
+    image = out;
+    image->bss_size = 0;
+    section = X86_TEXT;
+}
+
+/*
+ * Text.
+ */
+
+static bool is_jump(int op)
+{
+    return op == X86_CALL || (op >= X86_JMP && op <= X86_JG);
+}
+
+/* the size of a register operand, which differs from the size of the
+ * operation for the extending moves and setcc */
+static int operand_size(int op, int size, bool src)
+{
+    if(op == X86_MOVSBL)
+        return src ? 1 : 4;
+    if(op == X86_MOVSLQ)
+        return src ? 4 : 8;
+    if(op >= X86_SETE && op <= X86_SETG)
+        return 1;
+    return size;
+}
+
+static string operand_text(int op, int size, const x86_operand &operand,
+        bool src)
+{
+    switch(operand.kind) {
+        case X86_REG: {
+            int reg_size = operand_size(op, size, src);
+            return reg_names[reg_size == 8 ? 0 : reg_size == 4 ? 1 : 2]
+                [operand.reg];
+        }
+        case X86_MEM: {
+            string text = operand.value ? to_string(operand.value) : "";
+            text += "(" + string(reg_names[0][operand.reg]);
+            if(operand.index >= 0)
+                text += "," + string(reg_names[0][operand.index]) + ","
+                    + to_string(operand.scale);
+            return text + ")";
+        }
+        case X86_SYM:
+            return is_jump(op) ? operand.sym : operand.sym + "(%rip)";
+        default:
+            return "$" + to_string(operand.value);
+    }
+}
+
+static void print_ins(int op, int size, const x86_operand *src,
+        const x86_operand *dst)
+{
+    string text = mnemonics[op].name;
+    if(mnemonics[op].sized)
+        text += size == 8 ? 'q' : size == 4 ? 'l' : 'b';
+    if(src)
+        text += " " + operand_text(op, size, *src, true) + ",";
+    if(dst)
+        text += " " + operand_text(op, size, *dst, false);
+    fprintf(asmfile, INDENT "%s\n", text.c_str());
+}
+
+/*
+ * Machine code.
+ */
+
+static bool fits_byte(long value)
+{
+    return value >= -128 && value <= 127;
+}
+
+static bool fits_int(long value)
+{
+    return value >= -2147483648L && value <= 2147483647L;
+}
+
+static void put_byte(long value)
+{
+    image->text.push_back(value & 0xff);
+}
+
+static void put_int(long value)
+{
+    for(int i = 0;i < 4;i++)
+        put_byte(value >> (8 * i));
+}
+
+static void put_fixup(const string &sym, long addend)
+{
+    x86_fixup fixup = { image->text.size(), addend, sym };
+    image->fixups.push_back(fixup);
+    put_int(0);
+}
+
+/* an instruction with a ModRM byte: the REX prefix if one is needed,
+ * the opcode, and the encoding of the r/m operand. trailing is the
+ * number of immediate bytes that follow, which a displacement from
+ * %rip has to skip. */
+static void encode_rm(bool wide, const char *opcode, int reg,
+        const x86_operand &rm, bool byte_regs, int trailing)
+{
+    int rex = wide ? 0x48 : 0;
+    if(reg >= 8)
+        rex |= 0x44;
+    if(rm.kind != X86_SYM && rm.reg >= 8)
+        rex |= 0x41;
+    if(rm.kind == X86_MEM && rm.index >= 8)
+        rex |= 0x42;
+    /* spl, bpl, sil and dil only exist with a REX prefix */
+    if(byte_regs && ((reg >= 4 && reg < 8) || (rm.kind == X86_REG
+                    && rm.reg >= 4 && rm.reg < 8)))
+        rex |= 0x40;
+    if(rex)
+        put_byte(rex);
+    for(const char *c = opcode;*c;c++)
+        put_byte(*c);
+
+    int field = (reg & 7) << 3;
+    if(rm.kind == X86_REG) {
+        put_byte(0xc0 | field | (rm.reg & 7));
+    } else if(rm.kind == X86_SYM) {
+        put_byte(0x05 | field);
+        put_fixup(rm.sym, -4 - trailing);
+    } else {
+        int base = rm.reg & 7;
+        /* rbp and r13 have no form without a displacement */
+        int mod = rm.value == 0 && base != 5 ? 0
+            : fits_byte(rm.value) ? 1 : 2;
+        if(rm.index >= 0 || base == 4) {
+            int scale = rm.scale == 8 ? 3 : rm.scale == 4 ? 2
+                : rm.scale == 2 ? 1 : 0;
+            int index = rm.index >= 0 ? rm.index & 7 : 4;
+            put_byte(mod << 6 | field | 4);
+            put_byte(scale << 6 | index << 3 | base);
+        } else {
+            put_byte(mod << 6 | field | base);
+        }
+        if(mod == 1)
+            put_byte(rm.value);
+        else if(mod == 2)
+            put_int(rm.value);
+    }
+}
+
+static void encode_mov(int size, const x86_operand &src,
+        const x86_operand &dst)
+{
+    if(src.kind == X86_IMM) {
+        assert(dst.kind == X86_REG);
+        if(size == 8 && fits_int(src.value)) {
+            encode_rm(true, "\xc7", 0, dst, false, 4);
+            put_int(src.value);
+        } else {
+            if(size == 8 || dst.reg >= 8)
+                put_byte((size == 8 ? 0x48 : 0x40) | (dst.reg >= 8));
+            put_byte(0xb8 + (dst.reg & 7));
+            put_int(src.value);
+            if(size == 8)
+                put_int(src.value >> 32);
+        }
+    } else if(src.kind == X86_REG) {
+        encode_rm(size == 8, size == 1 ? "\x88" : "\x89", src.reg, dst,
+                size == 1, 0);
+    } else {
+        assert(size != 1 && dst.kind == X86_REG);
+        encode_rm(size == 8, "\x8b", dst.reg, src, false, 0);
+    }
+}
+
+/* add, sub, cmp, xor and test */
+static void encode_arith(int op, int size, const x86_operand &src,
+        const x86_operand &dst)
+{
+    if(src.kind == X86_IMM) {
+        int ext = op == X86_ADD ? 0 : op == X86_SUB ? 5
+            : op == X86_XOR ? 6 : 7;
+        assert(op != X86_TEST);
+        if(fits_byte(src.value)) {
+            encode_rm(size == 8, "\x83", ext, dst, false, 1);
+            put_byte(src.value);
+        } else {
+            encode_rm(size == 8, "\x81", ext, dst, false, 4);
+            put_int(src.value);
+        }
+        return;
+    }
+    const char *opcode = op == X86_ADD ? "\x01" : op == X86_SUB ? "\x29"
+        : op == X86_CMP ? "\x39" : op == X86_XOR ? "\x31" : "\x85";
+    encode_rm(size == 8, opcode, src.reg, dst, size == 1, 0);
+}
+
+static void encode_ins(int op, int size, const x86_operand *src,
+        const x86_operand *dst)
+{
+    switch(op) {
+        case X86_MOV:
+            encode_mov(size, *src, *dst);
+            break;
+        case X86_MOVSBL:
+            encode_rm(false, "\x0f\xbe", dst->reg, *src, false, 0);
+            break;
+        case X86_MOVSLQ:
+            encode_rm(true, "\x63", dst->reg, *src, false, 0);
+            break;
+        case X86_LEA:
+            encode_rm(size == 8, "\x8d", dst->reg, *src, false, 0);
+            break;
+        case X86_ADD: case X86_SUB: case X86_CMP: case X86_XOR:
+        case X86_TEST:
+            encode_arith(op, size, *src, *dst);
+            break;
+        case X86_IMUL:
+            encode_rm(size == 8, "\x0f\xaf", dst->reg, *src, false, 0);
+            break;
+        case X86_NEG:
+            encode_rm(size == 8, "\xf7", 3, *dst, false, 0);
+            break;
+        case X86_IDIV:
+            encode_rm(size == 8, "\xf7", 7, *dst, false, 0);
+            break;
+        case X86_CLTD:
+            put_byte(0x99);
+            break;
+        case X86_SETE: case X86_SETNE: case X86_SETL: case X86_SETGE:
+        case X86_SETLE: case X86_SETG: {
+            char opcode[] = { 0x0f,
+                (char)(0x90 | condition_codes[op - X86_SETE]), 0 };
+            encode_rm(false, opcode, 0, *dst, true, 0);
+            break;
+        }
+        case X86_PUSH:
+            if(dst->reg >= 8)
+                put_byte(0x41);
+            put_byte(0x50 + (dst->reg & 7));
+            break;
+        case X86_LEAVE:
+            put_byte(0xc9);
+            break;
+        case X86_RET:
+            put_byte(0xc3);
+            break;
+        case X86_CALL:
+            put_byte(0xe8);
+            put_fixup(dst->sym, -4);
+            break;
+        case X86_JMP:
+            put_byte(0xe9);
+            put_fixup(dst->sym, -4);
+            break;
+        case X86_JE: case X86_JNE: case X86_JL: case X86_JGE:
+        case X86_JLE: case X86_JG:
+            put_byte(0x0f);
+            put_byte(0x80 | condition_codes[op - X86_JE]);
+            put_fixup(dst->sym, -4);
+            break;
+        default:
+            assert(0);
+    }
+}
+
+static void ins(int op, int size, const x86_operand *src,
+        const x86_operand *dst)
+{
+    if(asmfile)
+        print_ins(op, size, src, dst);
+    else
+        encode_ins(op, size, src, dst);
+}
+
+void x86_ins(int op, int size)
+{
+    ins(op, size, NULL, NULL);
+}
+
+void x86_ins(int op, int size, const x86_operand &dst)
+{
+    ins(op, size, NULL, &dst);
+}
+
+void x86_ins(int op, int size, const x86_operand &src,
+        const x86_operand &dst)
+{
+    ins(op, size, &src, &dst);
+}
+
+/*
+ * Symbols and data.
+ */
+
+static void define(const string &name, int in, size_t offset)
+{
+    x86_symbol sym = { in, offset };
+    image->symbols[name] = sym;
+}
+
+static void switch_section(int to, const char *directive)
+{
+    if(section == to)
+        return;
+    section = to;
+    if(asmfile)
+        fprintf(asmfile, INDENT "%s\n", directive);
+}
+
+void x86_section_text()
+{
+    switch_section(X86_TEXT, ".text");
+}
+
+void x86_label(const string &name)
+{
+    if(asmfile)
+        fprintf(asmfile, "%s:\n", name.c_str());
+    else
+        define(name, X86_TEXT, image->text.size());
+}
+
+void x86_function_begin(const string &name)
+{
+    if(asmfile) {
+        fprintf(asmfile, INDENT ".globl %s\n", name.c_str());
+        fprintf(asmfile, INDENT ".type %s, @function\n", name.c_str());
+    }
+    x86_label(name);
+}
+
+void x86_function_end(const string &name)
+{
+    if(asmfile)
+        fprintf(asmfile, INDENT ".size %s, .-%s\n", name.c_str(),
+                name.c_str());
+}
+
+/* a string constant, given as it was spelled in the source */
+void x86_string(const string &name, const string &literal)
+{
+    switch_section(X86_RODATA, ".section .rodata");
+    if(asmfile) {
+        fprintf(asmfile, "%s:\n" INDENT ".string %s\n", name.c_str(),
+                literal.c_str());
+        return;
+    }
+    define(name, X86_RODATA, image->rodata.size());
+    for(size_t c = 1;c + 1 < literal.size();c++) {
+        char byte = literal[c];
+        if(byte == '\\') {
+            byte = literal[++c];
+            byte = byte == 'n' ? '\n' : byte == 't' ? '\t'
+                : byte == '0' ? '\0' : byte;
+        }
+        image->rodata.push_back(byte);
+    }
+    image->rodata.push_back(0);
+}
+
+/* a global variable; every one is 8 bytes, whatever its type */
+void x86_global(const string &name)
+{
+    if(asmfile) {
+        fprintf(asmfile, INDENT ".local %s\n", name.c_str());
+        fprintf(asmfile, INDENT ".comm %s, 8, 8\n", name.c_str());
+        return;
+    }
+    define(name, X86_BSS, image->bss_size);
+    image->bss_size += 8;
+}
+
+void x86_finish()
+{
+    if(asmfile)
+        fprintf(asmfile,
+                INDENT ".section .note.GNU-stack,\"\",@progbits\n");
+}